@@ -0,0 +1,336 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <openssl/evp.h>
+
+#include "cache.h"
+
+#define BUF_SIZE 65536
+#define PATH_SIZE 1024
+
+
+/*
+ * Cache - a local download cache.
+ * Hidden from the outside, see cache.h
+ */
+typedef struct CacheStruct {
+    char *dir;          // Root of the cache
+} Cache;
+
+
+static void to_hex(const unsigned char *digest, unsigned int len, char *hex) {
+    unsigned int i;
+    for (i = 0; i < len; ++i) {
+        sprintf(hex + 2 * i, "%02x", digest[i]);
+    }
+    hex[2 * len] = '\0';
+}
+
+
+// SHA-256 of a string, used to name url entries
+static void hash_string(const char *string, char *hex) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+
+    EVP_Digest(string, strlen(string), digest, &len, EVP_sha256(), NULL);
+    to_hex(digest, len, hex);
+}
+
+
+// SHA-256 of a file's content, used to name objects
+static int hash_file(const char *path, char *hex) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+
+    char *buffer = malloc(BUF_SIZE);
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+
+    ssize_t num_bytes;
+    while ((num_bytes = read(fd, buffer, BUF_SIZE)) > 0) {
+        EVP_DigestUpdate(ctx, buffer, num_bytes);
+    }
+    EVP_DigestFinal_ex(ctx, digest, &len);
+
+    EVP_MD_CTX_free(ctx);
+    free(buffer);
+    close(fd);
+
+    if (num_bytes == -1) {
+        return -1;
+    }
+    to_hex(digest, len, hex);
+    return 0;
+}
+
+
+/**
+ * Make dest share the content of src. Prefers a reflink, which is a
+ * private copy-on-write copy, then a hardlink, and copies the data
+ * only as a last resort. dest must not exist.
+ */
+static int clone_file(const char *src, const char *dest) {
+    int src_fd = open(src, O_RDONLY);
+    if (src_fd == -1) {
+        return -1;
+    }
+
+    int dest_fd = open(dest, O_CREAT | O_EXCL | O_WRONLY, 0644);
+    if (dest_fd == -1) {
+        close(src_fd);
+        return -1;
+    }
+
+    if (ioctl(dest_fd, FICLONE, src_fd) == 0) {
+        close(src_fd);
+        close(dest_fd);
+        return 0;
+    }
+
+    // No reflinks on this filesystem, try a hardlink instead
+    close(dest_fd);
+    unlink(dest);
+    if (link(src, dest) == 0) {
+        close(src_fd);
+        return 0;
+    }
+
+    dest_fd = open(dest, O_CREAT | O_EXCL | O_WRONLY, 0644);
+    if (dest_fd == -1) {
+        close(src_fd);
+        return -1;
+    }
+
+    char *buffer = malloc(BUF_SIZE);
+    ssize_t num_bytes;
+    int rc = 0;
+    while ((num_bytes = read(src_fd, buffer, BUF_SIZE)) > 0) {
+        if (write(dest_fd, buffer, num_bytes) != num_bytes) {
+            rc = -1;
+            break;
+        }
+    }
+    if (num_bytes == -1) rc = -1;
+
+    free(buffer);
+    close(src_fd);
+    close(dest_fd);
+    return rc;
+}
+
+
+static void make_dir(const char *dir) {
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+        perror("mkdir");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+static void entry_path(Cache *cache, const char *url, char *path) {
+    char key[CACHE_HASH_SIZE];
+    hash_string(url, key);
+    snprintf(path, PATH_SIZE, "%s/urls/%s", cache->dir, key);
+}
+
+
+static void object_path(Cache *cache, const char *hash, char *path) {
+    snprintf(path, PATH_SIZE, "%s/objects/%s", cache->dir, hash);
+}
+
+
+/**
+ * Open a cache directory, creating it if it does not exist
+ * @param dir - Path of the cache directory
+ * @return cache - Pointer to the opened cache
+ */
+Cache *cache_open(const char *dir) {
+    char path[PATH_SIZE];
+    Cache *cache = (Cache *)malloc(sizeof(Cache));
+    cache->dir = strdup(dir);
+
+    make_dir(dir);
+    snprintf(path, PATH_SIZE, "%s/urls", dir);
+    make_dir(path);
+    snprintf(path, PATH_SIZE, "%s/objects", dir);
+    make_dir(path);
+
+    return cache;
+}
+
+
+/**
+ * Close a cache opened by cache_open
+ * @param cache - Pointer to the cache to close
+ */
+void cache_close(Cache *cache) {
+    free(cache->dir);
+    free(cache);
+}
+
+
+/**
+ * Look up the entry of a URL
+ * @param cache - Pointer to the cache
+ * @param url - The URL that was downloaded
+ * @param entry - Filled in with the entry on a hit
+ * @return int - 0 if the URL has an entry whose content is present, -1 otherwise
+ */
+int cache_lookup(Cache *cache, const char *url, CacheEntry *entry) {
+    char path[PATH_SIZE], line[2 * HEADER_SIZE];
+
+    memset(entry, 0, sizeof(CacheEntry));
+    entry_path(cache, url, path);
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    // One "name value" pair per line, see cache_store
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        char *value = strchr(line, ' ');
+        if (!value) continue;
+        *value++ = '\0';
+
+        if (strcmp(line, "etag") == 0) {
+            snprintf(entry->etag, sizeof(entry->etag), "%s", value);
+        }
+        else if (strcmp(line, "last-modified") == 0) {
+            snprintf(entry->last_modified, sizeof(entry->last_modified), "%s", value);
+        }
+        else if (strcmp(line, "hash") == 0) {
+            snprintf(entry->hash, sizeof(entry->hash), "%s", value);
+        }
+    }
+    fclose(fp);
+
+    object_path(cache, entry->hash, path);
+    if (entry->hash[0] == '\0' || access(path, R_OK) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Create dest with the cached content of an entry. The file is
+ * reflinked (FICLONE) where the filesystem supports it, hardlinked
+ * otherwise, and only copied when neither works.
+ * @param cache - Pointer to the cache
+ * @param entry - Entry found by cache_lookup
+ * @param dest - Path of the file to create, replaced if it exists
+ * @return int - 0 on success, -1 on failure
+ */
+int cache_materialize(Cache *cache, const CacheEntry *entry, const char *dest) {
+    char path[PATH_SIZE];
+    object_path(cache, entry->hash, path);
+
+    unlink(dest);
+    return clone_file(path, dest);
+}
+
+
+/**
+ * Record a completed download. The file at path is hashed and becomes the
+ * cached content for url. If the same content is already cached, path is
+ * replaced by a link to the existing copy instead of storing it twice.
+ * @param cache - Pointer to the cache
+ * @param url - The URL the file was downloaded from
+ * @param head - The HEAD response with the validators of the download
+ * @param path - Path of the downloaded file
+ * @return int - 0 on success, -1 on failure
+ */
+int cache_store(Cache *cache, const char *url, const HttpHead *head, const char *path) {
+    char hash[CACHE_HASH_SIZE], object[PATH_SIZE], temp[PATH_SIZE + 16];
+
+    if (hash_file(path, hash) == -1) {
+        return -1;
+    }
+    object_path(cache, hash, object);
+
+    if (access(object, R_OK) == 0) {
+        // Seen this content before, possibly from another URL. Swap the
+        // new file for a link to the cached copy so it is only stored once.
+        snprintf(temp, sizeof(temp), "%s.dedup", path);
+        unlink(temp);
+        if (clone_file(object, temp) == 0) {
+            rename(temp, path);
+        }
+    }
+    else if (link(path, object) == -1) {
+        // Cache on another filesystem, so keep a copy instead
+        snprintf(temp, sizeof(temp), "%s.tmp", object);
+        unlink(temp);
+        if (clone_file(path, temp) == -1 || rename(temp, object) == -1) {
+            unlink(temp);
+            return -1;
+        }
+    }
+
+    // Write the entry beside its final name and rename it into place, so
+    // a crash never leaves a half written entry behind
+    char entry[PATH_SIZE];
+    entry_path(cache, url, entry);
+    snprintf(temp, sizeof(temp), "%s.tmp", entry);
+
+    FILE *fp = fopen(temp, "w");
+    if (fp == NULL) {
+        return -1;
+    }
+    fprintf(fp, "url %s\n", url);
+    fprintf(fp, "etag %s\n", head->etag);
+    fprintf(fp, "last-modified %s\n", head->last_modified);
+    fprintf(fp, "hash %s\n", hash);
+    fclose(fp);
+
+    return rename(temp, entry);
+}
+
+
+/**
+ * Probe a URL, conditionally if it is cached. If the server answers 304
+ * the cached copy is restored to dest instead, and should that fail the
+ * URL is probed again unconditionally.
+ * @param cache - Pointer to the cache, or NULL to always probe in full
+ * @param url - The URL to probe
+ * @param dest - Path the file is downloaded or restored to
+ * @param head - Filled in with the probe response
+ * @return int - 1 if the URL has to be downloaded, 0 if it was restored,
+ *               -1 if the server could not be reached
+ */
+int cache_probe(Cache *cache, const char *url, const char *dest, HttpHead *head) {
+    CacheEntry entry;
+
+    // Probe the URL, conditionally if there is a cached copy of it
+    int cached = cache && cache_lookup(cache, url, &entry) == 0;
+    if (http_head(url, cached ? entry.etag : NULL, cached ? entry.last_modified : NULL, head) == -1) {
+        fprintf(stderr, "error probing: %s\n", url);
+        return -1;
+    }
+
+    // Unchanged since it was cached, so link the cached copy into place
+    if (cached && head->status == 304) {
+        if (cache_materialize(cache, &entry, dest) == 0) {
+            return 0;
+        }
+        fprintf(stderr, "error restoring %s from cache\n", url);
+        if (http_head(url, NULL, NULL, head) == -1) {
+            fprintf(stderr, "error probing: %s\n", url);
+            return -1;
+        }
+    }
+    return 1;
+}
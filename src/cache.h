@@ -0,0 +1,91 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "http.h"
+
+#define CACHE_HASH_SIZE 65     // Hex SHA-256 digest and its null byte
+
+
+/*
+ * Cache - a local download cache.
+ * Contents are stored once under objects/<sha256> however many URLs
+ * they were downloaded from. Each URL has an entry under urls/ holding
+ * the validators it was served with and the hash of its content, so a
+ * repeat download can be revalidated with a conditional request.
+ */
+typedef struct CacheStruct Cache;
+
+
+// What the cache knows about a URL
+typedef struct {
+    char etag[HEADER_SIZE];
+    char last_modified[HEADER_SIZE];
+    char hash[CACHE_HASH_SIZE];
+
+} CacheEntry;
+
+
+/**
+ * Open a cache directory, creating it if it does not exist
+ * @param dir - Path of the cache directory
+ * @return cache - Pointer to the opened cache
+ */
+Cache *cache_open(const char *dir);
+
+
+/**
+ * Close a cache opened by cache_open
+ * @param cache - Pointer to the cache to close
+ */
+void cache_close(Cache *cache);
+
+
+/**
+ * Look up the entry of a URL
+ * @param cache - Pointer to the cache
+ * @param url - The URL that was downloaded
+ * @param entry - Filled in with the entry on a hit
+ * @return int - 0 if the URL has an entry whose content is present, -1 otherwise
+ */
+int cache_lookup(Cache *cache, const char *url, CacheEntry *entry);
+
+
+/**
+ * Create dest with the cached content of an entry. The file is
+ * reflinked (FICLONE) where the filesystem supports it, hardlinked
+ * otherwise, and only copied when neither works.
+ * @param cache - Pointer to the cache
+ * @param entry - Entry found by cache_lookup
+ * @param dest - Path of the file to create, replaced if it exists
+ * @return int - 0 on success, -1 on failure
+ */
+int cache_materialize(Cache *cache, const CacheEntry *entry, const char *dest);
+
+
+/**
+ * Record a completed download. The file at path is hashed and becomes the
+ * cached content for url. If the same content is already cached, path is
+ * replaced by a link to the existing copy instead of storing it twice.
+ * @param cache - Pointer to the cache
+ * @param url - The URL the file was downloaded from
+ * @param head - The HEAD response with the validators of the download
+ * @param path - Path of the downloaded file
+ * @return int - 0 on success, -1 on failure
+ */
+int cache_store(Cache *cache, const char *url, const HttpHead *head, const char *path);
+
+
+/**
+ * Probe a URL, conditionally if it is cached. If the server answers 304
+ * the cached copy is restored to dest instead, and should that fail the
+ * URL is probed again unconditionally.
+ * @param cache - Pointer to the cache, or NULL to always probe in full
+ * @param url - The URL to probe
+ * @param dest - Path the file is downloaded or restored to
+ * @param head - Filled in with the probe response
+ * @return int - 1 if the URL has to be downloaded, 0 if it was restored,
+ *               -1 if the server could not be reached
+ */
+int cache_probe(Cache *cache, const char *url, const char *dest, HttpHead *head);
+
+#endif
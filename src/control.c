@@ -0,0 +1,189 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "control.h"
+
+#define MARGINAL_GAIN 0.25     // An added connection must add this share of a connection's rate
+#define TOLERANCE 0.95         // Goodput below this share of the last sample counts as worse
+
+
+/*
+ * Control - an adaptive concurrency limiter.
+ * Hidden from the outside, see control.h
+ */
+typedef struct ControlStruct {
+    int min_limit;          // Lower bound for limit
+    int max_limit;          // Upper bound for limit
+    int limit;              // Connections currently allowed
+    int active;             // Connections currently running
+
+    int prev_limit;         // Limit during the previous interval
+    double last_goodput;    // Goodput measured during the previous interval
+
+    long interval_ms;       // Length of a sampling interval
+    struct timespec start;  // Start of the current interval
+    size_t bytes;           // Bytes fetched in the current interval
+    int errors;             // Requests failed in the current interval
+
+    pthread_mutex_t mutex_lock;
+    pthread_cond_t slot;    // Signalled when a slot might be free
+} Control;
+
+
+static long elapsed_ms(struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+
+static int clamp(Control *control, int limit) {
+    if (limit < control->min_limit) return control->min_limit;
+    if (limit > control->max_limit) return control->max_limit;
+    return limit;
+}
+
+
+/**
+ * Allocate a concurrency controller
+ * @param min_limit - The smallest number of active connections allowed
+ * @param max_limit - The largest number of active connections allowed
+ * @param interval_ms - Length of a sampling interval in milliseconds
+ * @return control - Pointer to the allocated controller
+ */
+Control *control_alloc(int min_limit, int max_limit, int interval_ms) {
+    Control *control = (Control *)calloc(1, sizeof(Control));
+
+    control->min_limit = min_limit < 1 ? 1 : min_limit;
+    control->max_limit = max_limit < control->min_limit ? control->min_limit : max_limit;
+    control->limit = clamp(control, 2);         // Start small, slow start happens by climbing
+    control->prev_limit = control->limit;
+    control->interval_ms = interval_ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &control->start);
+    pthread_mutex_init(&control->mutex_lock, NULL);
+    pthread_cond_init(&control->slot, NULL);
+    return control;
+}
+
+
+/**
+ * Free a controller. Don't call this while workers still use it.
+ * @param control - Pointer to the controller to free
+ */
+void control_free(Control *control) {
+    pthread_mutex_destroy(&control->mutex_lock);
+    pthread_cond_destroy(&control->slot);
+    free(control);
+}
+
+
+/**
+ * Block until fewer than limit connections are active, then take a slot
+ * @param control - Pointer to the controller
+ */
+void control_acquire(Control *control) {
+    pthread_mutex_lock(&control->mutex_lock);
+    while (control->active >= control->limit) {
+        pthread_cond_wait(&control->slot, &control->mutex_lock);
+    }
+    ++control->active;
+    pthread_mutex_unlock(&control->mutex_lock);
+}
+
+
+/**
+ * Move the limit from the last interval's outcome. Caller holds the lock.
+ */
+static void update_locked(Control *control, double goodput, int errors) {
+    int limit = control->limit;
+    int grown = limit - control->prev_limit;
+    double per_connection = control->last_goodput / control->prev_limit;
+
+    if (errors > 0) {
+        limit = limit / 2;                      // Multiplicative decrease
+    }
+    else if (control->last_goodput <= 0) {
+        ++limit;                                // No baseline yet, keep climbing
+    }
+    else if (grown > 0) {
+        // Keep growing only while the extra connections pulled their weight
+        if (goodput - control->last_goodput >= MARGINAL_GAIN * per_connection * grown) {
+            ++limit;
+        }
+        else {
+            limit -= grown;
+        }
+    }
+    else if (grown < 0) {
+        // Shrinking hurt, so give the connection back. Otherwise hold.
+        if (goodput < control->last_goodput * TOLERANCE) {
+            ++limit;
+        }
+    }
+    else {
+        ++limit;                                // Held for an interval, probe upwards
+    }
+
+    control->prev_limit = control->limit;
+    control->last_goodput = errors > 0 ? 0 : goodput;
+    control->limit = clamp(control, limit);
+
+    pthread_cond_broadcast(&control->slot);
+}
+
+
+/**
+ * Give back a slot taken by control_acquire and record its outcome.
+ * May run a controller step if the sampling interval has elapsed.
+ * @param control - Pointer to the controller
+ * @param bytes - The number of content bytes fetched with the slot
+ * @param failed - Non zero if the request failed
+ */
+void control_release(Control *control, size_t bytes, int failed) {
+    pthread_mutex_lock(&control->mutex_lock);
+
+    --control->active;
+    control->bytes += bytes;
+    if (failed) ++control->errors;
+
+    long elapsed = elapsed_ms(&control->start);
+    if (elapsed >= control->interval_ms) {
+        update_locked(control, control->bytes * 1000.0 / elapsed, control->errors);
+
+        clock_gettime(CLOCK_MONOTONIC, &control->start);
+        control->bytes = 0;
+        control->errors = 0;
+    }
+
+    pthread_cond_signal(&control->slot);
+    pthread_mutex_unlock(&control->mutex_lock);
+}
+
+
+/**
+ * Run one controller step for a finished sampling interval.
+ * Called internally by control_release, exposed for testing.
+ * @param control - Pointer to the controller
+ * @param goodput - Aggregate goodput over the interval in bytes/second
+ * @param errors - The number of failed requests in the interval
+ */
+void control_update(Control *control, double goodput, int errors) {
+    pthread_mutex_lock(&control->mutex_lock);
+    update_locked(control, goodput, errors);
+    pthread_mutex_unlock(&control->mutex_lock);
+}
+
+
+/**
+ * @param control - Pointer to the controller
+ * @return int - The current number of connections allowed to be active
+ */
+int control_limit(Control *control) {
+    pthread_mutex_lock(&control->mutex_lock);
+    int limit = control->limit;
+    pthread_mutex_unlock(&control->mutex_lock);
+    return limit;
+}
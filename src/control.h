@@ -0,0 +1,68 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stddef.h>
+
+
+/*
+ * Control - an adaptive concurrency limiter.
+ * Workers acquire a slot before opening a connection and release it with
+ * the number of bytes they fetched. Every sampling interval the limit is
+ * moved by a hill-climbing AIMD rule: grow by one while aggregate goodput
+ * keeps improving, step back when an extra connection stops paying for
+ * itself, and halve the limit when requests start failing.
+ */
+typedef struct ControlStruct Control;
+
+
+/**
+ * Allocate a concurrency controller
+ * @param min_limit - The smallest number of active connections allowed
+ * @param max_limit - The largest number of active connections allowed
+ * @param interval_ms - Length of a sampling interval in milliseconds
+ * @return control - Pointer to the allocated controller
+ */
+Control *control_alloc(int min_limit, int max_limit, int interval_ms);
+
+
+/**
+ * Free a controller. Don't call this while workers still use it.
+ * @param control - Pointer to the controller to free
+ */
+void control_free(Control *control);
+
+
+/**
+ * Block until fewer than limit connections are active, then take a slot
+ * @param control - Pointer to the controller
+ */
+void control_acquire(Control *control);
+
+
+/**
+ * Give back a slot taken by control_acquire and record its outcome.
+ * May run a controller step if the sampling interval has elapsed.
+ * @param control - Pointer to the controller
+ * @param bytes - The number of content bytes fetched with the slot
+ * @param failed - Non zero if the request failed
+ */
+void control_release(Control *control, size_t bytes, int failed);
+
+
+/**
+ * Run one controller step for a finished sampling interval.
+ * Called internally by control_release, exposed for testing.
+ * @param control - Pointer to the controller
+ * @param goodput - Aggregate goodput over the interval in bytes/second
+ * @param errors - The number of failed requests in the interval
+ */
+void control_update(Control *control, double goodput, int errors);
+
+
+/**
+ * @param control - Pointer to the controller
+ * @return int - The current number of connections allowed to be active
+ */
+int control_limit(Control *control);
+
+#endif
@@ -0,0 +1,505 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "coro.h"
+
+#define MAX_EVENTS 64
+#define STEAL_INTERVAL_MS 10     // How often an idle scheduler looks for work to steal
+
+#define handle_error(msg) \
+        do { perror(msg); exit(EXIT_FAILURE); } while (0)
+
+
+typedef struct CoroutineStruct Coroutine;
+typedef struct SchedulerStruct Scheduler;
+
+
+// A spawned coroutine waiting for a stack
+typedef struct JobStruct {
+    void (*fn)(void *);
+    void *arg;
+    struct JobStruct *next;
+} Job;
+
+
+struct CoroutineStruct {
+    ucontext_t context;
+    void *stack;            // Taken from the runtime's stack pool
+    void (*fn)(void *);
+    void *arg;
+    int done;               // Set when fn has returned
+    Coroutine *next;        // Link in the ready list
+};
+
+
+struct SchedulerStruct {
+    Runtime *runtime;
+    pthread_t thread;
+    int epfd;               // Sockets the coroutines of this scheduler wait on
+    int wakefd;             // eventfd to interrupt epoll_wait
+
+    ucontext_t context;     // Scheduler loop, coroutines yield back here
+    Coroutine *current;     // Coroutine being run
+    Coroutine *ready_head;  // Coroutines ready to resume, only touched by this thread
+    Coroutine *ready_tail;
+
+    pthread_mutex_t mutex_lock; // Guards the pending jobs, which others may steal
+    Job *pending_head;
+    Job *pending_tail;
+};
+
+
+/*
+ * Runtime - a pool of scheduler threads running coroutines.
+ * Hidden from the outside, see coro.h
+ */
+typedef struct RuntimeStruct {
+    Scheduler *schedulers;
+    int num_threads;
+    int next;               // Scheduler the next spawn is given to
+
+    size_t stack_size;      // Usable bytes of each stack
+    void **stacks;          // Free stacks
+    int num_stacks;
+
+    int outstanding;        // Coroutines spawned and not finished
+    int closing;            // Set by coro_runtime_free
+    pthread_mutex_t mutex_lock;
+} Runtime;
+
+
+static __thread Scheduler *this_scheduler = NULL;
+
+
+static void wake(Scheduler *scheduler) {
+    uint64_t one = 1;
+    write(scheduler->wakefd, &one, sizeof(one));
+}
+
+
+static void wake_all(Runtime *runtime) {
+    int i;
+    for (i = 0; i < runtime->num_threads; ++i) {
+        wake(&runtime->schedulers[i]);
+    }
+}
+
+
+// Stacks are mapped with a guard page below them to catch overflows
+static void *stack_alloc(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    char *stack = mmap(NULL, size + page, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+
+    if (stack == MAP_FAILED) {
+        handle_error("mmap");
+    }
+    mprotect(stack, page, PROT_NONE);
+    return stack + page;
+}
+
+
+static void stack_free(void *stack, size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    munmap((char *)stack - page, size + page);
+}
+
+
+static void *stack_get(Runtime *runtime) {
+    void *stack = NULL;
+
+    pthread_mutex_lock(&runtime->mutex_lock);
+    if (runtime->num_stacks > 0) {
+        stack = runtime->stacks[--runtime->num_stacks];
+    }
+    pthread_mutex_unlock(&runtime->mutex_lock);
+    return stack;
+}
+
+
+static void stack_put(Runtime *runtime, void *stack) {
+    pthread_mutex_lock(&runtime->mutex_lock);
+    runtime->stacks[runtime->num_stacks++] = stack;
+    pthread_mutex_unlock(&runtime->mutex_lock);
+}
+
+
+static Job *take_job(Scheduler *scheduler) {
+    pthread_mutex_lock(&scheduler->mutex_lock);
+    Job *job = scheduler->pending_head;
+    if (job) {
+        scheduler->pending_head = job->next;
+        if (!scheduler->pending_head) scheduler->pending_tail = NULL;
+    }
+    pthread_mutex_unlock(&scheduler->mutex_lock);
+    return job;
+}
+
+
+// Take a job from this scheduler, or steal one from another
+static Job *find_job(Scheduler *scheduler) {
+    Runtime *runtime = scheduler->runtime;
+    int self = scheduler - runtime->schedulers;
+    int i;
+
+    Job *job = take_job(scheduler);
+    for (i = 1; !job && i < runtime->num_threads; ++i) {
+        job = take_job(&runtime->schedulers[(self + i) % runtime->num_threads]);
+    }
+    return job;
+}
+
+
+static void make_ready(Scheduler *scheduler, Coroutine *coroutine) {
+    coroutine->next = NULL;
+    if (scheduler->ready_tail) {
+        scheduler->ready_tail->next = coroutine;
+    }
+    else {
+        scheduler->ready_head = coroutine;
+    }
+    scheduler->ready_tail = coroutine;
+}
+
+
+static void coroutine_entry(void) {
+    Scheduler *scheduler = this_scheduler;
+    Coroutine *coroutine = scheduler->current;
+
+    coroutine->fn(coroutine->arg);
+    coroutine->done = 1;
+
+    // Coroutines never migrate, so this is still the scheduler that started it
+    swapcontext(&coroutine->context, &scheduler->context);
+}
+
+
+// Run a coroutine until it yields or returns
+static void resume(Scheduler *scheduler, Coroutine *coroutine) {
+    scheduler->current = coroutine;
+    swapcontext(&scheduler->context, &coroutine->context);
+    scheduler->current = NULL;
+
+    if (coroutine->done) {
+        Runtime *runtime = scheduler->runtime;
+        stack_put(runtime, coroutine->stack);
+        free(coroutine);
+
+        pthread_mutex_lock(&runtime->mutex_lock);
+        --runtime->outstanding;
+        pthread_mutex_unlock(&runtime->mutex_lock);
+
+        // Other schedulers may have jobs that were waiting for this stack
+        wake_all(runtime);
+    }
+}
+
+
+static void start(Scheduler *scheduler, Job *job, void *stack) {
+    Coroutine *coroutine = (Coroutine *)calloc(1, sizeof(Coroutine));
+    coroutine->stack = stack;
+    coroutine->fn = job->fn;
+    coroutine->arg = job->arg;
+    free(job);
+
+    getcontext(&coroutine->context);
+    coroutine->context.uc_stack.ss_sp = stack;
+    coroutine->context.uc_stack.ss_size = scheduler->runtime->stack_size;
+    coroutine->context.uc_link = NULL;
+    makecontext(&coroutine->context, coroutine_entry, 0);
+
+    resume(scheduler, coroutine);
+}
+
+
+static int finished(Runtime *runtime) {
+    pthread_mutex_lock(&runtime->mutex_lock);
+    int finished = runtime->closing && runtime->outstanding == 0;
+    pthread_mutex_unlock(&runtime->mutex_lock);
+    return finished;
+}
+
+
+static void *scheduler_thread(void *arg) {
+    Scheduler *scheduler = (Scheduler *)arg;
+    struct epoll_event events[MAX_EVENTS];
+    this_scheduler = scheduler;
+
+    while (1) {
+        // Resume everything whose socket became ready
+        while (scheduler->ready_head) {
+            Coroutine *coroutine = scheduler->ready_head;
+            scheduler->ready_head = coroutine->next;
+            if (!scheduler->ready_head) scheduler->ready_tail = NULL;
+            resume(scheduler, coroutine);
+        }
+
+        // Start new coroutines for as long as there are stacks for them
+        void *stack;
+        while ((stack = stack_get(scheduler->runtime))) {
+            Job *job = find_job(scheduler);
+            if (!job) {
+                stack_put(scheduler->runtime, stack);
+                break;
+            }
+            start(scheduler, job, stack);
+        }
+
+        if (finished(scheduler->runtime)) {
+            break;
+        }
+
+        int timeout = scheduler->ready_head ? 0 : STEAL_INTERVAL_MS;
+        int num_events = epoll_wait(scheduler->epfd, events, MAX_EVENTS, timeout);
+        int i;
+
+        for (i = 0; i < num_events; ++i) {
+            if (events[i].data.ptr == NULL) {
+                uint64_t count;
+                read(scheduler->wakefd, &count, sizeof(count));
+            }
+            else {
+                make_ready(scheduler, (Coroutine *)events[i].data.ptr);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Start a coroutine runtime
+ * @param num_threads - The number of scheduler threads, usually one per core
+ * @param max_coroutines - The number of coroutines that may run at once.
+ *                         Further spawns wait until a stack is free.
+ * @param stack_size - The stack size of each coroutine in bytes
+ * @return runtime - Pointer to the started runtime
+ */
+Runtime *coro_runtime_alloc(int num_threads, int max_coroutines, size_t stack_size) {
+    Runtime *runtime = (Runtime *)calloc(1, sizeof(Runtime));
+    size_t page = sysconf(_SC_PAGESIZE);
+    int i;
+
+    runtime->num_threads = num_threads;
+    runtime->stack_size = (stack_size + page - 1) / page * page;
+    runtime->stacks = (void **)malloc(sizeof(void *) * max_coroutines);
+    for (i = 0; i < max_coroutines; ++i) {
+        runtime->stacks[runtime->num_stacks++] = stack_alloc(runtime->stack_size);
+    }
+    pthread_mutex_init(&runtime->mutex_lock, NULL);
+
+    runtime->schedulers = (Scheduler *)calloc(num_threads, sizeof(Scheduler));
+    for (i = 0; i < num_threads; ++i) {
+        Scheduler *scheduler = &runtime->schedulers[i];
+        scheduler->runtime = runtime;
+        pthread_mutex_init(&scheduler->mutex_lock, NULL);
+
+        scheduler->epfd = epoll_create1(0);
+        scheduler->wakefd = eventfd(0, EFD_NONBLOCK);
+        if (scheduler->epfd == -1 || scheduler->wakefd == -1) {
+            handle_error("epoll");
+        }
+
+        // A NULL pointer marks the wake up event
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+        epoll_ctl(scheduler->epfd, EPOLL_CTL_ADD, scheduler->wakefd, &event);
+    }
+
+    for (i = 0; i < num_threads; ++i) {
+        if (pthread_create(&runtime->schedulers[i].thread, NULL, scheduler_thread, &runtime->schedulers[i]) != 0) {
+            handle_error("pthread_create");
+        }
+    }
+    return runtime;
+}
+
+
+/**
+ * Wait for every spawned coroutine to finish, then stop the scheduler
+ * threads and free the runtime
+ * @param runtime - Pointer to the runtime to free
+ */
+void coro_runtime_free(Runtime *runtime) {
+    int i;
+
+    pthread_mutex_lock(&runtime->mutex_lock);
+    runtime->closing = 1;
+    pthread_mutex_unlock(&runtime->mutex_lock);
+    wake_all(runtime);
+
+    for (i = 0; i < runtime->num_threads; ++i) {
+        Scheduler *scheduler = &runtime->schedulers[i];
+        if (pthread_join(scheduler->thread, NULL) != 0) {
+            handle_error("pthread_join");
+        }
+        close(scheduler->epfd);
+        close(scheduler->wakefd);
+        pthread_mutex_destroy(&scheduler->mutex_lock);
+    }
+
+    for (i = 0; i < runtime->num_stacks; ++i) {
+        stack_free(runtime->stacks[i], runtime->stack_size);
+    }
+    pthread_mutex_destroy(&runtime->mutex_lock);
+
+    free(runtime->stacks);
+    free(runtime->schedulers);
+    free(runtime);
+}
+
+
+/**
+ * Run fn(arg) in a new coroutine. Never blocks, the coroutine is queued
+ * until a scheduler has a stack free for it.
+ * @param runtime - Pointer to the runtime
+ * @param fn - The function to run
+ * @param arg - Argument passed to fn
+ */
+void coro_spawn(Runtime *runtime, void (*fn)(void *), void *arg) {
+    Job *job = (Job *)malloc(sizeof(Job));
+    job->fn = fn;
+    job->arg = arg;
+    job->next = NULL;
+
+    // Hand jobs out round robin, idle schedulers steal from busy ones
+    pthread_mutex_lock(&runtime->mutex_lock);
+    ++runtime->outstanding;
+    Scheduler *scheduler = &runtime->schedulers[runtime->next];
+    runtime->next = (runtime->next + 1) % runtime->num_threads;
+    pthread_mutex_unlock(&runtime->mutex_lock);
+
+    pthread_mutex_lock(&scheduler->mutex_lock);
+    if (scheduler->pending_tail) {
+        scheduler->pending_tail->next = job;
+    }
+    else {
+        scheduler->pending_head = job;
+    }
+    scheduler->pending_tail = job;
+    pthread_mutex_unlock(&scheduler->mutex_lock);
+
+    wake(scheduler);
+}
+
+
+/**
+ * Park the running coroutine until fd is ready for events
+ */
+static void wait_fd(int fd, uint32_t events) {
+    Scheduler *scheduler = this_scheduler;
+    Coroutine *coroutine = scheduler->current;
+    struct epoll_event event = { .events = events | EPOLLONESHOT, .data.ptr = coroutine };
+
+    // Closed sockets leave the epoll set by themselves, so a reused fd
+    // number is simply added again
+    if (epoll_ctl(scheduler->epfd, EPOLL_CTL_MOD, fd, &event) == -1) {
+        if (errno != ENOENT || epoll_ctl(scheduler->epfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            handle_error("epoll_ctl");
+        }
+    }
+    swapcontext(&coroutine->context, &scheduler->context);
+}
+
+
+static int in_coroutine(void) {
+    return this_scheduler && this_scheduler->current;
+}
+
+
+static void set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (!(flags & O_NONBLOCK)) {
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    }
+}
+
+
+// Sockets outlive coroutines in a connection pool, so one used by a
+// coroutine may come back to a thread that expects to block
+static void set_blocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags & O_NONBLOCK) {
+        fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    }
+}
+
+
+int coro_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+    if (!in_coroutine()) {
+        return connect(sockfd, addr, addrlen);
+    }
+
+    set_nonblocking(sockfd);
+    if (connect(sockfd, addr, addrlen) == 0) {
+        return 0;
+    }
+    if (errno != EINPROGRESS) {
+        return -1;
+    }
+
+    wait_fd(sockfd, EPOLLOUT);
+
+    int error = 0;
+    socklen_t len = sizeof(error);
+    getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+
+ssize_t coro_read(int fd, void *buf, size_t count) {
+    if (!in_coroutine()) {
+        set_blocking(fd);
+        return read(fd, buf, count);
+    }
+
+    set_nonblocking(fd);
+    while (1) {
+        ssize_t num_bytes = read(fd, buf, count);
+        if (num_bytes >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            return num_bytes;
+        }
+        wait_fd(fd, EPOLLIN);
+    }
+}
+
+
+ssize_t coro_write(int fd, const void *buf, size_t count) {
+    if (!in_coroutine()) {
+        set_blocking(fd);
+        return write(fd, buf, count);
+    }
+
+    set_nonblocking(fd);
+    while (1) {
+        ssize_t num_bytes = write(fd, buf, count);
+        if (num_bytes >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            return num_bytes;
+        }
+        wait_fd(fd, EPOLLOUT);
+    }
+}
+
+
+void coro_wait(int fd, int write) {
+    if (!in_coroutine()) {
+        struct pollfd pollfd = { .fd = fd, .events = write ? POLLOUT : POLLIN };
+        while (poll(&pollfd, 1, -1) == -1 && errno == EINTR) {}
+        return;
+    }
+    wait_fd(fd, write ? EPOLLOUT : EPOLLIN);
+}
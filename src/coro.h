@@ -0,0 +1,70 @@
+#ifndef CORO_H
+#define CORO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+
+/*
+ * Runtime - a pool of scheduler threads running coroutines.
+ * Each coroutine runs on a small stack taken from a shared pool. When a
+ * coroutine would block on a socket it yields to its scheduler, which
+ * waits for the socket with epoll and runs other coroutines meanwhile.
+ * Spawned coroutines that have not started yet can be stolen by any
+ * idle scheduler; once started a coroutine stays on its scheduler.
+ */
+typedef struct RuntimeStruct Runtime;
+
+
+/**
+ * Start a coroutine runtime
+ * @param num_threads - The number of scheduler threads, usually one per core
+ * @param max_coroutines - The number of coroutines that may run at once.
+ *                         Further spawns wait until a stack is free.
+ * @param stack_size - The stack size of each coroutine in bytes
+ * @return runtime - Pointer to the started runtime
+ */
+Runtime *coro_runtime_alloc(int num_threads, int max_coroutines, size_t stack_size);
+
+
+/**
+ * Wait for every spawned coroutine to finish, then stop the scheduler
+ * threads and free the runtime
+ * @param runtime - Pointer to the runtime to free
+ */
+void coro_runtime_free(Runtime *runtime);
+
+
+/**
+ * Run fn(arg) in a new coroutine. Never blocks, the coroutine is queued
+ * until a scheduler has a stack free for it.
+ * @param runtime - Pointer to the runtime
+ * @param fn - The function to run
+ * @param arg - Argument passed to fn
+ */
+void coro_spawn(Runtime *runtime, void (*fn)(void *), void *arg);
+
+
+/*
+ * Socket calls that yield the calling coroutine instead of blocking its
+ * scheduler thread. They make the socket non-blocking on first use.
+ * Called outside a coroutine they block like the plain system calls.
+ */
+int coro_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen);
+
+ssize_t coro_read(int fd, void *buf, size_t count);
+
+ssize_t coro_write(int fd, const void *buf, size_t count);
+
+
+/**
+ * Wait until a non-blocking socket is readable, or writable if write is
+ * set, for code that drives the socket itself such as TLS. Yields inside
+ * a coroutine and polls outside one.
+ * @param fd - The socket
+ * @param write - Non zero to wait until it is writable
+ */
+void coro_wait(int fd, int write);
+
+#endif
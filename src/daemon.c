@@ -0,0 +1,552 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "daemon.h"
+
+#define LINE_SIZE (JOB_ID_SIZE + JOB_URL_SIZE + JOB_DIR_SIZE + JOB_RANGES_SIZE + 64)   // Longest request line
+#define EVENT_SIZE (JOB_ID_SIZE + JOB_URL_SIZE + JOB_DIR_SIZE + 64)   // Longest completion event
+#define BACKLOG 64
+#define EVENT_BACKLOG (64 * 1024)   // Bytes of events queued for a client before it is dropped
+#define SEND_TIMEOUT 10             // Seconds a client may stall one event before it is dropped
+
+#define handle_error(msg) \
+    do { perror(msg); exit(EXIT_FAILURE); } while (0)
+
+
+// An event line waiting to be written to a client
+typedef struct EventStruct {
+    struct EventStruct *next;
+    int length;
+    char line[];
+} Event;
+
+
+// A connected client. Events are queued and written by its own writer
+// thread, so a client that stops reading never holds up the daemon.
+typedef struct ClientStruct {
+    int fd;
+    int refs;               // Its reader and its jobs not finished yet, guarded by the daemon
+    Daemon *daemon;
+    struct ClientStruct *next;  // In the list of clients still being read
+
+    pthread_mutex_t write_lock; // Guards the fields below
+    pthread_cond_t writable;    // Signalled when an event is queued or the client closes
+    Event *head;                // Events not written yet, oldest first
+    Event *tail;
+    int backlog;                // Bytes of the events queued
+    int dropped;                // Set once it is disconnected, its events are discarded
+    int closing;                // Set once no more events can come
+} Client;
+
+
+// A job waiting to be taken
+typedef struct PendingStruct {
+    Job *job;
+    struct PendingStruct *next;
+} Pending;
+
+
+/*
+ * Daemon - accepts download jobs on a UNIX domain socket.
+ * Hidden from the outside, see daemon.h
+ */
+typedef struct DaemonStruct {
+    struct sockaddr_un addr;
+    int listen_fd;
+    sigset_t signals;           // Drain on these
+
+    void (*wake)(void *);
+    void *arg;
+    pthread_t acceptor;
+    pthread_t watcher;
+
+    Pending *head;              // Jobs not taken yet, oldest first
+    Pending *tail;
+    int active;                 // Jobs accepted and not finished yet
+    int draining;
+
+    Client *clients;
+    int num_readers;
+    int num_writers;
+    pthread_cond_t clients_done;    // Signalled when the last reader or writer ends
+
+    pthread_mutex_t mutex_lock;
+} Daemon;
+
+
+/**
+ * Listen on a UNIX domain socket, replacing a stale one at the path.
+ * Blocks SIGTERM and SIGINT in the calling thread, so call it before any
+ * other thread is started and they all leave the signals to the daemon.
+ * @param path - Path of the socket
+ * @return daemon - Pointer to the daemon
+ */
+Daemon *daemon_open(const char *path) {
+    Daemon *daemon = (Daemon *)calloc(1, sizeof(Daemon));
+
+    sigemptyset(&daemon->signals);
+    sigaddset(&daemon->signals, SIGTERM);
+    sigaddset(&daemon->signals, SIGINT);
+    if (pthread_sigmask(SIG_BLOCK, &daemon->signals, NULL) != 0) {
+        handle_error("pthread_sigmask");
+    }
+
+    daemon->addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(daemon->addr.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(daemon->addr.sun_path, path);
+
+    daemon->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (daemon->listen_fd == -1) {
+        handle_error("socket");
+    }
+
+    // A socket left by a daemon that died is replaced, a live one is not
+    if (connect(daemon->listen_fd, (struct sockaddr *)&daemon->addr, sizeof(daemon->addr)) == 0) {
+        fprintf(stderr, "a daemon is already listening on %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    close(daemon->listen_fd);
+    unlink(path);
+
+    daemon->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (daemon->listen_fd == -1) {
+        handle_error("socket");
+    }
+    if (bind(daemon->listen_fd, (struct sockaddr *)&daemon->addr, sizeof(daemon->addr)) == -1) {
+        handle_error("bind");
+    }
+    if (listen(daemon->listen_fd, BACKLOG) == -1) {
+        handle_error("listen");
+    }
+
+    pthread_mutex_init(&daemon->mutex_lock, NULL);
+    pthread_cond_init(&daemon->clients_done, NULL);
+    return daemon;
+}
+
+
+// Disconnect a client and discard its queued events.
+// Caller holds the client's write_lock.
+static void drop_client(Client *client) {
+    client->dropped = 1;
+    shutdown(client->fd, SHUT_RDWR);    // Ends its reader and a stalled send
+
+    while (client->head) {
+        Event *event = client->head;
+        client->head = event->next;
+        free(event);
+    }
+    client->tail = NULL;
+    client->backlog = 0;
+}
+
+
+// Queue one event line for a client, dropping the client if it has
+// stopped reading. Never blocks on the client.
+static void send_event(Client *client, const char *id, const char *status, const char *detail) {
+    Event *event = (Event *)malloc(sizeof(Event) + EVENT_SIZE);
+    if (event == NULL) {
+        perror("malloc");
+        return;
+    }
+    event->next = NULL;
+    event->length = snprintf(event->line, EVENT_SIZE, "%s %s %s\n", id, status, detail);
+    if (event->length >= EVENT_SIZE) {
+        event->length = EVENT_SIZE - 1;
+        event->line[event->length - 1] = '\n';
+    }
+
+    pthread_mutex_lock(&client->write_lock);
+    if (!client->dropped && client->backlog + event->length > EVENT_BACKLOG) {
+        fprintf(stderr, "dropping a client that stopped reading events\n");
+        drop_client(client);
+    }
+    if (client->dropped) {
+        free(event);
+    }
+    else {
+        if (client->tail) {
+            client->tail->next = event;
+        }
+        else {
+            client->head = event;
+        }
+        client->tail = event;
+        client->backlog += event->length;
+        pthread_cond_signal(&client->writable);
+    }
+    pthread_mutex_unlock(&client->write_lock);
+}
+
+
+// Drop a reference to a client, letting its writer finish with the last
+static void release_client(Daemon *daemon, Client *client) {
+    pthread_mutex_lock(&daemon->mutex_lock);
+    int refs = --client->refs;
+    pthread_mutex_unlock(&daemon->mutex_lock);
+
+    if (refs == 0) {
+        pthread_mutex_lock(&client->write_lock);
+        client->closing = 1;
+        pthread_cond_signal(&client->writable);
+        pthread_mutex_unlock(&client->write_lock);
+    }
+}
+
+
+// Write a client's events as they are queued, then close it once it has
+// no more to come
+static void *writer_thread(void *arg) {
+    Client *client = (Client *)arg;
+    Daemon *daemon = client->daemon;
+
+    pthread_mutex_lock(&client->write_lock);
+    while (1) {
+        while (!client->head && !client->closing) {
+            pthread_cond_wait(&client->writable, &client->write_lock);
+        }
+        Event *event = client->head;
+        if (!event) {
+            break;      // Closing and everything written
+        }
+        client->head = event->next;
+        if (!client->head) client->tail = NULL;
+        client->backlog -= event->length;
+        pthread_mutex_unlock(&client->write_lock);
+
+        int sent = 0;
+        while (sent < event->length) {
+            ssize_t num_bytes = send(client->fd, event->line + sent, event->length - sent, MSG_NOSIGNAL);
+            if (num_bytes <= 0) break;
+            sent += num_bytes;
+        }
+        int failed = sent < event->length;
+        free(event);
+
+        // Gone or stalled past SEND_TIMEOUT
+        pthread_mutex_lock(&client->write_lock);
+        if (failed && !client->dropped) {
+            drop_client(client);
+        }
+    }
+    pthread_mutex_unlock(&client->write_lock);
+
+    close(client->fd);
+    pthread_cond_destroy(&client->writable);
+    pthread_mutex_destroy(&client->write_lock);
+    free(client);
+
+    pthread_mutex_lock(&daemon->mutex_lock);
+    if (--daemon->num_writers == 0 && daemon->num_readers == 0) {
+        pthread_cond_broadcast(&daemon->clients_done);
+    }
+    pthread_mutex_unlock(&daemon->mutex_lock);
+    return NULL;
+}
+
+
+// Copy a field of a request, 0 if it does not fit
+static int copy_field(char *dest, const char *src, size_t size) {
+    return src && snprintf(dest, size, "%s", src) < (int)size;
+}
+
+
+/**
+ * Parse a request line and queue its job
+ * @param daemon - Pointer to the daemon
+ * @param client - The client that sent it
+ * @param line - The line, without its newline
+ */
+static void submit_line(Daemon *daemon, Client *client, char *line) {
+    char *save = NULL;
+    char *id = strtok_r(line, " \t\r", &save);
+    char *url = strtok_r(NULL, " \t\r", &save);
+    char *dir = strtok_r(NULL, " \t\r", &save);
+    char *option;
+
+    if (!id) {
+        return;     // Blank line
+    }
+
+    Job *job = (Job *)calloc(1, sizeof(Job));
+    job->client = client;
+    if (!copy_field(job->id, id, sizeof(job->id))) {
+        send_event(client, "-", "error", "bad request");
+        free(job);
+        return;
+    }
+    if (!copy_field(job->url, url, sizeof(job->url)) || !copy_field(job->dir, dir, sizeof(job->dir))) {
+        send_event(client, job->id, "error", "bad request");
+        free(job);
+        return;
+    }
+    while ((option = strtok_r(NULL, " \t\r", &save))) {
+        if (strncmp(option, "priority=", 9) == 0) {
+            job->priority = atoi(option + 9);
+        }
+        else if (strncmp(option, "ranges=", 7) == 0) {
+            if (!copy_field(job->ranges, option + 7, sizeof(job->ranges))) {
+                send_event(client, job->id, "error", "bad request");
+                free(job);
+                return;
+            }
+        }
+        else {
+            send_event(client, job->id, "error", "unknown option");
+            free(job);
+            return;
+        }
+    }
+
+    Pending *pending = (Pending *)malloc(sizeof(Pending));
+    pending->job = job;
+    pending->next = NULL;
+
+    pthread_mutex_lock(&daemon->mutex_lock);
+    if (daemon->draining) {
+        pthread_mutex_unlock(&daemon->mutex_lock);
+        send_event(client, job->id, "error", "draining");
+        free(pending);
+        free(job);
+        return;
+    }
+    if (daemon->tail) {
+        daemon->tail->next = pending;
+    }
+    else {
+        daemon->head = pending;
+    }
+    daemon->tail = pending;
+    ++daemon->active;
+    ++client->refs;
+    pthread_mutex_unlock(&daemon->mutex_lock);
+
+    daemon->wake(daemon->arg);
+}
+
+
+// Read requests from a client until it hangs up or the daemon drains
+static void *client_thread(void *arg) {
+    Client *client = (Client *)arg;
+    Daemon *daemon = client->daemon;
+    char line[LINE_SIZE];
+    size_t length = 0;
+
+    while (1) {
+        ssize_t num_bytes = recv(client->fd, line + length, sizeof(line) - 1 - length, 0);
+        if (num_bytes <= 0) break;
+        length += num_bytes;
+
+        char *start = line, *end;
+        while ((end = memchr(start, '\n', line + length - start))) {
+            *end = '\0';
+            submit_line(daemon, client, start);
+            start = end + 1;
+        }
+        length -= start - line;
+        memmove(line, start, length);
+
+        if (length == sizeof(line) - 1) {
+            send_event(client, "-", "error", "request too long");
+            length = 0;
+        }
+    }
+
+    pthread_mutex_lock(&daemon->mutex_lock);
+    Client **link = &daemon->clients;
+    while (*link != client) {
+        link = &(*link)->next;
+    }
+    *link = client->next;
+    pthread_mutex_unlock(&daemon->mutex_lock);
+
+    release_client(daemon, client);
+
+    pthread_mutex_lock(&daemon->mutex_lock);
+    if (--daemon->num_readers == 0 && daemon->num_writers == 0) {
+        pthread_cond_broadcast(&daemon->clients_done);
+    }
+    pthread_mutex_unlock(&daemon->mutex_lock);
+    return NULL;
+}
+
+
+// Accept clients until the daemon drains
+static void *accept_thread(void *arg) {
+    Daemon *daemon = (Daemon *)arg;
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    while (1) {
+        int fd = accept(daemon->listen_fd, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;      // Shut down by the drain
+        }
+
+        // A send that cannot go on for this long drops the client
+        struct timeval timeout = { SEND_TIMEOUT, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        Client *client = (Client *)calloc(1, sizeof(Client));
+        client->fd = fd;
+        client->refs = 1;
+        client->daemon = daemon;
+        pthread_mutex_init(&client->write_lock, NULL);
+        pthread_cond_init(&client->writable, NULL);
+
+        pthread_mutex_lock(&daemon->mutex_lock);
+        client->next = daemon->clients;
+        daemon->clients = client;
+        ++daemon->num_readers;
+        ++daemon->num_writers;
+        pthread_mutex_unlock(&daemon->mutex_lock);
+
+        if (pthread_create(&thread, &attr, writer_thread, client) != 0 ||
+            pthread_create(&thread, &attr, client_thread, client) != 0) {
+            handle_error("pthread_create");
+        }
+    }
+
+    pthread_attr_destroy(&attr);
+    return NULL;
+}
+
+
+// Wait for a signal, then stop taking jobs
+static void *signal_thread(void *arg) {
+    Daemon *daemon = (Daemon *)arg;
+    Client *client;
+    int sig;
+
+    sigwait(&daemon->signals, &sig);
+    fprintf(stderr, "draining on signal %d\n", sig);
+
+    pthread_mutex_lock(&daemon->mutex_lock);
+    daemon->draining = 1;
+    shutdown(daemon->listen_fd, SHUT_RDWR);         // Wakes the acceptor
+    for (client = daemon->clients; client; client = client->next) {
+        shutdown(client->fd, SHUT_RD);              // Events still go out
+    }
+    pthread_mutex_unlock(&daemon->mutex_lock);
+
+    daemon->wake(daemon->arg);
+    return NULL;
+}
+
+
+/**
+ * Start accepting clients and watching for signals
+ * @param daemon - Pointer to the daemon
+ * @param wake - Called from another thread when a job arrives or the
+ *               daemon starts draining
+ * @param arg - Passed to wake
+ */
+void daemon_run(Daemon *daemon, void (*wake)(void *), void *arg) {
+    daemon->wake = wake;
+    daemon->arg = arg;
+
+    if (pthread_create(&daemon->watcher, NULL, signal_thread, daemon) != 0) {
+        handle_error("pthread_create");
+    }
+    if (pthread_create(&daemon->acceptor, NULL, accept_thread, daemon) != 0) {
+        handle_error("pthread_create");
+    }
+}
+
+
+/**
+ * Take the next job submitted, in the order they arrived
+ * @param daemon - Pointer to the daemon
+ * @return job - The job, or NULL if none is waiting
+ */
+Job *daemon_next(Daemon *daemon) {
+    Job *job = NULL;
+
+    pthread_mutex_lock(&daemon->mutex_lock);
+    Pending *pending = daemon->head;
+    if (pending) {
+        daemon->head = pending->next;
+        if (!daemon->head) daemon->tail = NULL;
+        job = pending->job;
+        free(pending);
+    }
+    pthread_mutex_unlock(&daemon->mutex_lock);
+    return job;
+}
+
+
+/**
+ * Report a job's completion to its client and free it. The event is
+ * queued for the client, so this never blocks on it.
+ * @param daemon - Pointer to the daemon
+ * @param job - The job taken with daemon_next
+ * @param status - done, cached or error
+ * @param detail - The path of the file, or the reason for an error
+ */
+void daemon_finish(Daemon *daemon, Job *job, const char *status, const char *detail) {
+    Client *client = (Client *)job->client;
+    send_event(client, job->id, status, detail);
+
+    pthread_mutex_lock(&daemon->mutex_lock);
+    --daemon->active;
+    pthread_mutex_unlock(&daemon->mutex_lock);
+
+    release_client(daemon, client);
+    free(job);
+}
+
+
+/**
+ * @param daemon - Pointer to the daemon
+ * @return int - Non zero once draining and every job has been finished
+ */
+int daemon_idle(Daemon *daemon) {
+    pthread_mutex_lock(&daemon->mutex_lock);
+    int idle = daemon->draining && daemon->active == 0;
+    pthread_mutex_unlock(&daemon->mutex_lock);
+    return idle;
+}
+
+
+/**
+ * Disconnect the clients, remove the socket and free the daemon
+ * @param daemon - Pointer to the daemon
+ */
+void daemon_close(Daemon *daemon) {
+    Client *client;
+
+    pthread_join(daemon->watcher, NULL);
+    pthread_join(daemon->acceptor, NULL);
+
+    // Readers stop at once, writers once their queued events are out
+    pthread_mutex_lock(&daemon->mutex_lock);
+    for (client = daemon->clients; client; client = client->next) {
+        shutdown(client->fd, SHUT_RD);
+    }
+    while (daemon->num_readers > 0 || daemon->num_writers > 0) {
+        pthread_cond_wait(&daemon->clients_done, &daemon->mutex_lock);
+    }
+    pthread_mutex_unlock(&daemon->mutex_lock);
+
+    close(daemon->listen_fd);
+    unlink(daemon->addr.sun_path);
+
+    pthread_cond_destroy(&daemon->clients_done);
+    pthread_mutex_destroy(&daemon->mutex_lock);
+    free(daemon);
+}
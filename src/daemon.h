@@ -0,0 +1,96 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#define JOB_ID_SIZE 64
+#define JOB_URL_SIZE 1024
+#define JOB_DIR_SIZE 256
+#define JOB_RANGES_SIZE 1024
+
+
+/*
+ * Daemon - accepts download jobs on a UNIX domain socket.
+ *
+ * A client writes one job per line:
+ *
+ *     <id> <url> <download_dir> [priority=N] [ranges=A-B,C-,-N]
+ *
+ * and reads one event per line as each of its jobs completes:
+ *
+ *     <id> done <path>
+ *     <id> cached <path>
+ *     <id> error <reason>
+ *
+ * A client may keep its connection open and send any number of jobs.
+ * Events are written by a thread of each client's own, and a client that
+ * stops reading them is disconnected rather than allowed to hold them up.
+ * On SIGTERM or SIGINT the daemon drains: it stops accepting jobs,
+ * finishes the ones it has and then reports that it is idle.
+ */
+typedef struct DaemonStruct Daemon;
+
+
+// A job submitted by a client
+typedef struct {
+    void *client;               // Where the completion event goes
+    char id[JOB_ID_SIZE];       // Chosen by the client, echoed in the event
+    char url[JOB_URL_SIZE];
+    char dir[JOB_DIR_SIZE];
+    int priority;
+    char ranges[JOB_RANGES_SIZE];   // Byte ranges wanted, "" for the whole file
+
+} Job;
+
+
+/**
+ * Listen on a UNIX domain socket, replacing a stale one at the path.
+ * Blocks SIGTERM and SIGINT in the calling thread, so call it before any
+ * other thread is started and they all leave the signals to the daemon.
+ * @param path - Path of the socket
+ * @return daemon - Pointer to the daemon
+ */
+Daemon *daemon_open(const char *path);
+
+
+/**
+ * Start accepting clients and watching for signals
+ * @param daemon - Pointer to the daemon
+ * @param wake - Called from another thread when a job arrives or the
+ *               daemon starts draining
+ * @param arg - Passed to wake
+ */
+void daemon_run(Daemon *daemon, void (*wake)(void *), void *arg);
+
+
+/**
+ * Take the next job submitted, in the order they arrived
+ * @param daemon - Pointer to the daemon
+ * @return job - The job, or NULL if none is waiting
+ */
+Job *daemon_next(Daemon *daemon);
+
+
+/**
+ * Report a job's completion to its client and free it. The event is
+ * queued for the client, so this never blocks on it.
+ * @param daemon - Pointer to the daemon
+ * @param job - The job taken with daemon_next
+ * @param status - done, cached or error
+ * @param detail - The path of the file, or the reason for an error
+ */
+void daemon_finish(Daemon *daemon, Job *job, const char *status, const char *detail);
+
+
+/**
+ * @param daemon - Pointer to the daemon
+ * @return int - Non zero once draining and every job has been finished
+ */
+int daemon_idle(Daemon *daemon);
+
+
+/**
+ * Disconnect the clients, remove the socket and free the daemon
+ * @param daemon - Pointer to the daemon
+ */
+void daemon_close(Daemon *daemon);
+
+#endif
@@ -7,71 +7,565 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
 
 #include "http.h"
 #include "queue.h"
-
-#define BUF_SIZE 1024
+#include "control.h"
+#include "cache.h"
+#include "coro.h"
+#include "sched.h"
+#include "shard.h"
+#include "hedge.h"
+#include "pool.h"
+#include "daemon.h"
+#include "h2.h"
+#include "tls.h"
+#include "multipart.h"
+#include "list.h"
+
+#define BUF_SIZE (64 * 1024)    // Merge buffer, files may be hundreds of gigabytes
 #define FILE_SIZE 256
 
+#define AUTO_MAX_WORKERS 32         // Largest pool the controller may grow to
+#define CONTROL_INTERVAL_MS 500     // Controller sampling interval
+
+#define CORO_STACK_SIZE (128 * 1024)    // Leaves room for glibc's alloca use in getaddrinfo
+
+#define MAX_FILES_IN_FLIGHT 8       // Files whose ranges are scheduled at the same time
+#define FILE_WINDOW_FACTOR 2        // Ranges of a file queued or in flight at once, per worker
+#define LIST_LOOKAHEAD 32           // Listed URLs probed ahead of being scheduled
+#define LIST_PROBERS 8              // Probes of listed URLs in flight at once
+#define SHARD_POLL_MS 100           // How often an idle process checks on the others
+
+// Range data held in memory at once. Each worker holds the range it is
+// downloading and the done queue two more per worker, so ranges are
+// planned against a third of it.
+#define MAX_IN_FLIGHT_BYTES (768LL * 1024 * 1024)
+#define PLANNED_IN_FLIGHT (MAX_IN_FLIGHT_BYTES / 3)
+
+#define HEDGE_INTERVAL_MS 100       // How often ranges in flight are checked for stragglers
+#define HEDGE_SLOW_FACTOR 0.5       // Share of its file's median rate below which a range straggles
+#define HEDGE_MIN_SECONDS 0.5       // How long a range runs before its rate is judged
+
+#define POOL_MAX_IDLE 64            // Idle connections kept open for later ranges
+#define POOL_IDLE_SECONDS 30        // Servers close idle connections after a while
+#define DNS_TTL_SECONDS 60          // How long a resolved host is reused
+
+// HTTP/2 windows sized for links with a large bandwidth-delay product.
+// Range data is bounded by MAX_IN_FLIGHT_BYTES anyway, so the connection
+// window only needs to stay out of the way.
+#define H2_CONNS_PER_HOST 1
+#define H2_STREAM_WINDOW (16 * 1024 * 1024)
+#define H2_CONN_WINDOW (1024 * 1024 * 1024)
+
+#define SPARSE_GAP_BYTES (64 * 1024)    // Wanted ranges closer than this are fetched as one
+#define SPARSE_MAX_PARTS 32             // Ranges asked for in one multipart request
+#define SPARSE_MAX_RANGES 1024          // Ranges a line or job may list
+
+// Task states, for hedging
+#define TASK_QUEUED 0
+#define TASK_RUNNING 1
+#define TASK_FINISHED 2
+
+// A file being downloaded as num_tasks ranges of bytes each
 typedef struct {
     char *url;
-    int min_range;
-    int max_range;
+    char *dir;          // Where the file is downloaded to
+    int id;             // Unique per download, names the chunk files
+    int64_t bytes;      // Size of every range but the last
+    int num_tasks;
+    int pending;        // Ranges not written to disk yet
+    int next_task;      // Ranges created so far, see submit_ranges
+    int window;         // The most ranges queued or in flight at once
+    HttpHead head;      // Probe response, kept for the cache
+    Lane *lane;         // Where the ranges of this file are scheduled
+    int shard_file;     // Index in the shared list, -1 unless sharded
+    int merge;          // Set when this process is the one to merge the file
+    double *rates;      // Rates of finished ranges while hedging, bytes/second
+    int num_rates;
+    int failed;         // Set when a range could not be downloaded
+    Job *job;           // The job asking for it in daemon mode, NULL otherwise
+
+    // For a sparse download of some ranges of the file, see schedule_sparse
+    HttpRange *ranges;  // The ranges planned, NULL for the whole file
+    int num_ranges;
+    int sparse_fd;      // The output file they are written into
+    int multipart;      // Cleared once the server shows it will not send several ranges at once
+} Download;
+
+
+typedef struct TaskStruct {
+    char *url;
+    int64_t min_range;
+    int64_t max_range;  // Below min_range if the length is unknown
     Buffer *result;
+    Download *download;
+    int shard_range;    // Index in the shared range table, -1 unless sharded
+
+    // As scheduled, see submit_task. Kept here since a dropped duplicate
+    // is handed back after its download may have been freed.
+    Lane *lane;
+    int64_t length;
+
+    // While hedging, guarded by the context's hedge_lock
+    HttpProgress progress;
+    struct timespec started;
+    int state;                  // TASK_QUEUED, TASK_RUNNING or TASK_FINISHED
+    int hedge;                  // Set on the duplicate of a straggling range
+    int won;                    // Set on the copy of a hedged range that is kept
+    struct TaskStruct *partner; // The other copy of a hedged range
+    struct TaskStruct *prev;    // In the list of running tasks
+    struct TaskStruct *next;
+
+    // For a sparse download, the ranges of it this task fetches
+    int first_range;
+    int num_ranges;
+    int64_t written;            // Bytes of them written to the output file
+    HttpRange *asked;           // The ranges of the request in flight
+    int num_asked;
+    int64_t position;           // Offset of the next byte of a single part response, -1 before its header
+    Multipart *multipart;       // Reads a multipart response, NULL for a single part
 }  Task;
 
 
 typedef struct {
-    Queue *todo;
+    Sched *todo;
     Queue *done;
 
     pthread_t *threads;
     int num_workers;
 
+    Control *control;   // Limits active connections in auto mode, NULL otherwise
+    Runtime *runtime;   // Runs each task as a coroutine in coro mode, NULL otherwise
+    Shard *shard;       // URL list shared with other processes, NULL otherwise
+    Daemon *daemon;     // Takes jobs from clients in daemon mode, NULL otherwise
+
+    Hedge *hedge;       // Duplicates straggling ranges, NULL otherwise
+    pthread_t hedger;   // Watches the running tasks for stragglers
+    pthread_mutex_t hedge_lock;
+    Task *running;      // Tasks being downloaded
+    Lane *hedge_lane;   // Duplicates go ahead of every file
+    int stopping;
+
 } Context;
 
-void create_directory(const char *dir) {
+int create_directory(const char *dir) {
     struct stat st = { 0 };
 
     if (stat(dir, &st) == -1) {
         int rc = mkdir(dir, 0700);
         if (rc == -1) {
             perror("mkdir");
-            exit(EXIT_FAILURE);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+Task *new_task(Download *download, int64_t min_range, int64_t max_range) {
+    Task *task = calloc(1, sizeof(Task));
+    task->result = NULL;
+    task->download = download;
+    task->shard_range = -1;
+    task->url = download->url;      // Owned by the download
+    task->min_range = min_range;
+    task->max_range = max_range;
+    http_progress_init(&task->progress, 0);
+
+    // Leading ranges of a file get more of a shared HTTP/2 connection
+    if (download->bytes > 0 && !download->ranges) {
+        task->progress.weight = 256 - 255 * (min_range / download->bytes) / download->num_tasks;
+    }
+
+    return task;
+}
+
+void free_task(Task *task) {
+
+    if (task->result) {
+        free(task->result->data);
+        free(task->result);
+    }
+
+    http_progress_destroy(&task->progress);
+    free(task);
+}
+
+
+/**
+ * Format the Range header value of a task
+ * @param task - The task
+ * @param range - Buffer receiving the range
+ * @param size - Size of the buffer
+ */
+void task_range(Task *task, char *range, size_t size) {
+    if (task->max_range < task->min_range) {
+        snprintf(range, size, "%" PRId64 "-", task->min_range);     // To the end
+    }
+    else {
+        snprintf(range, size, "%" PRId64 "-%" PRId64, task->min_range, task->max_range);
+    }
+}
+
+
+// Bytes of a task, 0 if the length is unknown
+int64_t task_length(Task *task) {
+    int64_t length = 0;
+    int i;
+
+    if (task->download->ranges) {
+        for (i = 0; i < task->num_ranges; ++i) {
+            length += task->download->ranges[task->first_range + i].length;
+        }
+        return length;
+    }
+    return task->max_range < task->min_range ? 0 : task->max_range - task->min_range + 1;
+}
+
+
+// The lane a task is scheduled in
+Lane *task_lane(Context *context, Task *task) {
+    return task->hedge ? context->hedge_lane : task->download->lane;
+}
+
+
+// Content bytes of a finished task's response, 0 if there is none
+int64_t task_received(Task *task) {
+    if (!task->result) {
+        return 0;
+    }
+    char *data = http_get_content(task->result);
+    return task->result->length - (data - task->result->data);
+}
+
+
+// Non zero if a finished task holds a successful response of the whole range
+int task_complete(Task *task) {
+    if (task->download->ranges) {
+        return task->written == task_length(task);
+    }
+
+    int status = task->result ? http_get_status(task->result) : -1;
+
+    if (status < 200 || status >= 300) {
+        return 0;
+    }
+    return task_length(task) == 0 || task_received(task) == task_length(task);
+}
+
+
+// Seconds a running task has been downloading for
+double task_elapsed(Task *task) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - task->started.tv_sec) + (now.tv_nsec - task->started.tv_nsec) / 1e9;
+}
+
+
+/**
+ * Mark a task as running before a worker downloads it
+ * @param context - The pool the task is downloaded by
+ * @param task - The task
+ * @return int - 0 if the task is a duplicate that is no longer needed
+ *               because the original finished first
+ */
+int begin_task(Context *context, Task *task) {
+    if (!context->hedge) {
+        return 1;
+    }
+
+    pthread_mutex_lock(&context->hedge_lock);
+    if (task->hedge && !task->partner) {
+        pthread_mutex_unlock(&context->hedge_lock);
+        return 0;
+    }
+
+    task->state = TASK_RUNNING;
+    clock_gettime(CLOCK_MONOTONIC, &task->started);
+    task->prev = NULL;
+    task->next = context->running;
+    if (context->running) context->running->prev = task;
+    context->running = task;
+    pthread_mutex_unlock(&context->hedge_lock);
+    return 1;
+}
+
+
+/**
+ * Hand a downloaded task to the done queue. The two copies of a hedged
+ * range go together once both have stopped: the first to complete is
+ * kept and the other is cancelled.
+ * @param context - The pool the task was downloaded by
+ * @param task - The task
+ */
+void end_task(Context *context, Task *task) {
+    if (!context->hedge) {
+        queue_put(context->done, task);
+        return;
+    }
+
+    pthread_mutex_lock(&context->hedge_lock);
+    if (task->prev) task->prev->next = task->next;
+    else context->running = task->next;
+    if (task->next) task->next->prev = task->prev;
+    task->state = TASK_FINISHED;
+
+    Task *partner = task->partner;
+    if (task_complete(task)) {
+        Download *download = task->download;
+        if (!task->hedge && download->num_rates < download->num_tasks) {
+            download->rates[download->num_rates++] = task_received(task) / task_elapsed(task);
+        }
+
+        if (partner && !partner->won) {
+            task->won = 1;
+            if (partner->state == TASK_QUEUED) {
+                // Never started, the worker that takes it drops it
+                hedge_refund(context->hedge, partner->length);
+                partner->partner = NULL;
+                task->partner = NULL;
+            }
+            else if (partner->state == TASK_RUNNING) {
+                http_cancel(&partner->progress);
+            }
+        }
+    }
+
+    int ready = !task->partner || task->partner->state == TASK_FINISHED;
+    Task *original = task->hedge ? task->partner : task;
+    pthread_mutex_unlock(&context->hedge_lock);
+
+    if (ready) {
+        queue_put(context->done, original);
+    }
+}
+
+
+/**
+ * Write the parts of a piece of content that fall in the ranges asked
+ * for into a sparse download's output file
+ * @param offset - Offset in the file of the first byte of data
+ * @param data - The content
+ * @param length - Bytes of content
+ * @param arg - The Task the content is for
+ * @return int - 0 on success, -1 if the file could not be written
+ */
+int sparse_write(int64_t offset, const char *data, size_t length, void *arg) {
+    Task *task = (Task *)arg;
+    int i;
+
+    for (i = 0; i < task->num_asked; ++i) {
+        int64_t first = task->asked[i].offset > offset ? task->asked[i].offset : offset;
+        int64_t end = task->asked[i].offset + task->asked[i].length;
+        if (end > offset + (int64_t)length) end = offset + length;
+
+        while (first < end) {
+            ssize_t num_bytes = pwrite(task->download->sparse_fd, data + (first - offset), end - first, first);
+            if (num_bytes <= 0) {
+                perror("pwrite");
+                return -1;
+            }
+            first += num_bytes;
+            task->written += num_bytes;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * Take the content of a sparse task's response as it arrives, see HttpSink.
+ * Several ranges come as a multipart/byteranges response, one range as a
+ * 206 with its Content-Range. A server that ignores ranges sends the
+ * whole file, which is read up to the end of one range asked for but
+ * stopped at once for several, as separate requests fetch those for less.
+ * @return int - 0 to go on, -1 to stop the query
+ */
+int sparse_sink(const char *header, const char *data, size_t length, void *arg) {
+    Task *task = (Task *)arg;
+
+    if (task->position == -1 && !task->multipart) {
+        Buffer response = { (char *)header, strlen(header) };
+        char value[HEADER_SIZE];
+        char boundary[HEADER_SIZE];
+        int status = http_get_status(&response);
+
+        if (status == 206 && http_header(header, "Content-Type", value, sizeof(value)) == 0 &&
+            multipart_boundary(value, boundary, sizeof(boundary)) == 0) {
+            task->multipart = multipart_alloc(boundary, sparse_write, task);
+        }
+        else if (status == 206 && http_header(header, "Content-Range", value, sizeof(value)) == 0 &&
+            sscanf(value, "bytes %" SCNd64, &task->position) == 1) {
+            // One range, possibly covering all of those asked for
+        }
+        else if (status == 200 && task->num_asked == 1) {
+            task->position = 0;
+        }
+        else {
+            if (status == 200) {
+                __atomic_store_n(&task->download->multipart, 0, __ATOMIC_RELAXED);
+            }
+            task->position = -1;
+            return -1;
+        }
+    }
+
+    if (task->multipart) {
+        return multipart_feed(task->multipart, data, length);
+    }
+    if (sparse_write(task->position, data, length, task) == -1) {
+        return -1;
+    }
+    task->position += length;
+
+    // Nothing past the last range asked for is needed
+    HttpRange *last = &task->asked[task->num_asked - 1];
+    return task->position >= last->offset + last->length ? -1 : 0;
+}
+
+
+/**
+ * Request some of a sparse task's ranges, writing them as they arrive
+ * @param task - The task
+ * @param first - Index of the first range in the task
+ * @param count - The number of ranges to ask for
+ */
+void sparse_request(Task *task, int first, int count) {
+    char *range = (char *)malloc(count * 48);
+    int i, length = 0;
+
+    task->asked = task->download->ranges + task->first_range + first;
+    task->num_asked = count;
+    task->position = -1;
+    task->multipart = NULL;
+    for (i = 0; i < count; ++i) {
+        length += sprintf(range + length, "%s%" PRId64 "-%" PRId64, i ? "," : "",
+            task->asked[i].offset, task->asked[i].offset + task->asked[i].length - 1);
+    }
+
+    if (task->result) {
+        buffer_free(task->result);
+    }
+    task->result = http_url_progress(task->url, range, &task->progress);
+
+    // Over HTTP/2 the content was kept in the response instead
+    if (task->result && strstr(task->result->data, "\r\n\r\n") && task_received(task) > 0) {
+        char *content = http_get_content(task->result);
+        char *header = strndup(task->result->data, content - task->result->data);
+        sparse_sink(header, content, task_received(task), task);
+        free(header);
+    }
+
+    if (task->multipart) {
+        multipart_free(task->multipart);
+        task->multipart = NULL;
+    }
+    free(range);
+}
+
+
+/**
+ * Download the ranges of a sparse task: all of them in one multipart
+ * request, or one request per range if the server will not send several
+ * ranges at once. A range written twice is written the same both times.
+ * @param task - The task
+ */
+void fetch_sparse(Task *task) {
+    int i;
+
+    task->progress.sink = sparse_sink;
+    task->progress.sink_arg = task;
+
+    if (task->num_ranges > 1 && __atomic_load_n(&task->download->multipart, __ATOMIC_RELAXED)) {
+        sparse_request(task, 0, task->num_ranges);
+        if (task_complete(task)) {
+            return;
         }
+        task->written = 0;
+    }
+    for (i = 0; i < task->num_ranges && !__atomic_load_n(&task->progress.cancelled, __ATOMIC_RELAXED); ++i) {
+        sparse_request(task, i, 1);
+    }
+}
+
+
+/**
+ * Download a task, its range or for a sparse download its ranges
+ * @param task - The task
+ */
+void fetch_task(Task *task) {
+    char range[64];
+
+    if (task->download->ranges) {
+        fetch_sparse(task);
+        return;
     }
+    task_range(task, range, sizeof(range));
+    task->result = http_url_progress(task->url, range, &task->progress);
 }
 
 
 void *worker_thread(void *arg) {
     Context *context = (Context *)arg;
 
-    Task *task = (Task *)queue_get(context->todo);
-    char *range = (char *)malloc(1024 * sizeof(char));
+    Task *task = (Task *)sched_get(context->todo);
 
     while (task) {
-        snprintf(range, 1024 * sizeof(char), "%d-%d", task->min_range,
-        task->max_range);
+        if (!begin_task(context, task)) {
+            // A duplicate whose original finished first
+            sched_done(context->todo, task->lane, task->length);
+            free_task(task);
+            task = (Task *)sched_get(context->todo);
+            continue;
+        }
+
+        if (context->control) {
+            control_acquire(context->control);
+        }
 
-        task->result = http_url(task->url, range);
+        fetch_task(task);
 
-        queue_put(context->done, task);
-        task = (Task *)queue_get(context->todo);
+        if (context->control) {
+            // Content received, which a sparse task streamed to its file
+            int status = task->result ? http_get_status(task->result) : -1;
+            int64_t received = task->download->ranges ? task->written : task_received(task);
+            control_release(context->control, received, status < 200 || status >= 300);
+        }
+
+        sched_done(context->todo, task->lane, task->length);
+        end_task(context, task);
+        task = (Task *)sched_get(context->todo);
     }
 
-    free(range);
     return NULL;
 }
 
 
-Context *spawn_workers(int num_workers) {
+/**
+ * Create the work queues and start a pool of worker threads.
+ * @param num_workers - The number of threads to start
+ * @param control - Controller limiting how many workers download at once,
+ *                  or NULL to let every worker download
+ * @param policy - How the scheduler orders files of equal priority
+ * @return context - Pointer to the started pool
+ */
+Context *spawn_workers(int num_workers, Control *control, SchedPolicy policy) {
     Context *context = (Context*)malloc(sizeof(Context));
 
-    context->todo = queue_alloc(num_workers * 2);
+    context->todo = sched_alloc(policy);
     context->done = queue_alloc(num_workers * 2);
 
     context->num_workers = num_workers;
+    context->control = control;
+    context->runtime = NULL;
+    context->shard = NULL;
+    context->daemon = NULL;
+    context->hedge = NULL;
 
     context->threads = (pthread_t*)malloc(sizeof(pthread_t) * num_workers);
     int i = 0;
@@ -86,14 +580,214 @@ Context *spawn_workers(int num_workers) {
     return context;
 }
 
+/**
+ * Download the most urgent task inside a coroutine and report it to the
+ * done queue. One coroutine is spawned per submitted task, but each takes
+ * whichever task the scheduler ranks first when it starts. The socket
+ * calls in http.c yield while waiting, so a scheduler thread serves many
+ * of these at once.
+ * @param arg - The Context the task is scheduled in
+ */
+void download_coroutine(void *arg) {
+    Context *context = (Context *)arg;
+    Task *task = (Task *)sched_try_get(context->todo);
+
+    if (!task) {
+        return;
+    }
+
+    if (!begin_task(context, task)) {
+        // A duplicate whose original finished first
+        sched_done(context->todo, task->lane, task->length);
+        free_task(task);
+        return;
+    }
+
+    fetch_task(task);
+
+    sched_done(context->todo, task->lane, task->length);
+    end_task(context, task);
+}
+
+
+/**
+ * Start a coroutine runtime with one scheduler thread per core in place
+ * of a pool of worker threads.
+ * @param num_workers - The number of downloads that may be in flight
+ * @param policy - How the scheduler orders files of equal priority
+ * @return context - Pointer to the started runtime
+ */
+Context *spawn_coroutines(int num_workers, SchedPolicy policy) {
+    Context *context = (Context*)malloc(sizeof(Context));
+
+    context->todo = sched_alloc(policy);
+
+    // Finished tasks are handed back from scheduler threads, which must not
+    // block on a slow main thread while other coroutines wait to run
+    context->done = queue_alloc_unbounded(num_workers * 2);
+
+    context->num_workers = num_workers;
+    context->control = NULL;
+    context->threads = NULL;
+    context->shard = NULL;
+    context->daemon = NULL;
+    context->hedge = NULL;
+
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    context->runtime = coro_runtime_alloc(num_threads > 0 ? num_threads : 1, num_workers, CORO_STACK_SIZE);
+
+    return context;
+}
+
+
+/**
+ * Hand a task to the worker pool or the coroutine runtime
+ * @param context - The pool the task is downloaded by
+ * @param task - The task to download
+ */
+void submit_task(Context *context, Task *task) {
+    task->lane = task_lane(context, task);
+    task->length = task_length(task);
+    sched_put(context->todo, task->lane, task, task->min_range, task->length);
+
+    if (context->runtime) {
+        coro_spawn(context->runtime, download_coroutine, context);
+    }
+}
+
+
+/**
+ * Create and submit the next ranges of a whole file download, up to its
+ * window of them queued or in flight. The rest are created as earlier
+ * ones are written, so a file of many chunks holds only a window of
+ * tasks at a time. Their bytes were planned in the file's lane already.
+ * @param context - The pool the ranges are downloaded by
+ * @param download - The download
+ */
+void submit_ranges(Context *context, Download *download) {
+    int64_t bytes = download->bytes;
+
+    while (download->next_task < download->num_tasks &&
+           download->next_task - (download->num_tasks - download->pending) < download->window) {
+        int i = download->next_task;
+        int64_t max_range = (i + 1) * bytes - 1;
+        if (max_range >= download->head.content_length) max_range = download->head.content_length - 1;
+
+        // Before it is queued, so the task cannot finish and free the download first
+        download->next_task = i + 1;
+        submit_task(context, new_task(download, i * bytes, max_range));
+    }
+}
+
+
+/**
+ * Duplicate the rest of every straggling range, see hedge.h. A range is
+ * only judged once its file has nothing left queued.
+ * Caller holds the hedge_lock.
+ * @param context - The pool the ranges are downloaded by
+ */
+void hedge_stragglers(Context *context) {
+    Task *task, *other;
+
+    for (task = context->running; task; task = task->next) {
+        Download *download = task->download;
+
+        if (task->hedge || task->partner || task_length(task) == 0 || download->ranges ||
+            sched_lane_queued(context->todo, download->lane)) {
+            continue;
+        }
+
+        // Rates of the file's ranges, finished and running
+        int num_rates = download->num_rates;
+        for (other = context->running; other; other = other->next) {
+            if (other->download == download && !other->hedge) ++num_rates;
+        }
+        double *rates = (double *)malloc(sizeof(double) * num_rates);
+        memcpy(rates, download->rates, sizeof(double) * download->num_rates);
+
+        int i = download->num_rates;
+        for (other = context->running; other; other = other->next) {
+            if (other->download == download && !other->hedge) {
+                rates[i++] = __atomic_load_n(&other->progress.received, __ATOMIC_RELAXED) / task_elapsed(other);
+            }
+        }
+
+        int64_t received = __atomic_load_n(&task->progress.received, __ATOMIC_RELAXED);
+        double elapsed = task_elapsed(task);
+        int64_t remaining = task_length(task) - received;
+
+        if (hedge_decide(context->hedge, received / elapsed, rates, num_rates, elapsed, remaining)) {
+            // Request the rest again, from another address of the host if it has one
+            Task *hedge = new_task(download, task->min_range + received, task->max_range);
+            hedge->progress.address = task->progress.address + 1;
+            hedge->hedge = 1;
+            hedge->state = TASK_QUEUED;
+            hedge->partner = task;
+            task->partner = hedge;
+            submit_task(context, hedge);
+        }
+        free(rates);
+    }
+}
+
+
+/**
+ * Check the running tasks for stragglers until the pool stops
+ * @param arg - The Context of the pool
+ */
+void *hedge_thread(void *arg) {
+    Context *context = (Context *)arg;
+
+    while (!__atomic_load_n(&context->stopping, __ATOMIC_ACQUIRE)) {
+        usleep(HEDGE_INTERVAL_MS * 1000);
+
+        pthread_mutex_lock(&context->hedge_lock);
+        hedge_stragglers(context);
+        pthread_mutex_unlock(&context->hedge_lock);
+    }
+    return NULL;
+}
+
+
+/**
+ * Start duplicating straggling ranges
+ * @param context - The pool the ranges are downloaded by
+ * @param hedge - The policy deciding which ranges to duplicate
+ */
+void start_hedging(Context *context, Hedge *hedge) {
+    context->hedge = hedge;
+    context->hedge_lane = sched_lane_alloc(context->todo, INT_MAX);
+    context->running = NULL;
+    context->stopping = 0;
+    pthread_mutex_init(&context->hedge_lock, NULL);
+
+    if (pthread_create(&context->hedger, NULL, hedge_thread, context) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+}
+
+
 void free_workers(Context *context) {
     int num_workers = context->num_workers;
     int i = 0;
 
-    for (i = 0; i < num_workers; ++i) {
-        queue_put(context->todo, NULL);
+    if (context->hedge) {
+        __atomic_store_n(&context->stopping, 1, __ATOMIC_RELEASE);
+        pthread_join(context->hedger, NULL);
+    }
+
+    if (context->runtime) {
+        coro_runtime_free(context->runtime);
+        if (context->hedge) pthread_mutex_destroy(&context->hedge_lock);
+        sched_free(context->todo);
+        queue_free(context->done);
+        free(context);
+        return;
     }
 
+    sched_close(context->todo);     // Workers stop once nothing is left
+
     for (i = 0; i < num_workers; ++i) {
         if (pthread_join(context->threads[i], NULL) != 0) {
             perror("pthread_join");
@@ -101,7 +795,8 @@ void free_workers(Context *context) {
         }
     }
 
-    queue_free(context->todo);
+    if (context->hedge) pthread_mutex_destroy(&context->hedge_lock);
+    sched_free(context->todo);
     queue_free(context->done);
 
     free(context->threads);
@@ -109,71 +804,130 @@ void free_workers(Context *context) {
 }
 
 
-Task *new_task(char *url, int min_range, int max_range) {
-    Task *task = malloc(sizeof(Task));
-    task->result = NULL;
-    task->url = malloc(strlen(url) + 1);
-    task->min_range = min_range;
-    task->max_range = max_range;
-
-    strcpy(task->url, url);
+/**
+ * Build the path a URL is downloaded to, "/" in the URL becomes "+"
+ * @param dir - The download directory
+ * @param url - The URL being downloaded
+ * @param path - Buffer of FILE_SIZE bytes receiving the path
+ */
+void output_path(const char *dir, const char *url, char *path) {
+    int i, len = snprintf(path, FILE_SIZE, "%s/", dir);
+    snprintf(path + len, FILE_SIZE - len, "%s", url);
 
-    return task;
+    for (i = len; path[i]; ++i) {
+        if (path[i] == '/') {path[i] = '+';}    //  Replece "/" for naming a file
+    }
 }
 
-void free_task(Task *task) {
 
-    if (task->result) {
-        free(task->result->data);
-        free(task->result);
-    }
+/**
+ * Build the path of the chunk file holding one range of a URL
+ * @param dir - The download directory
+ * @param url - The URL being downloaded
+ * @param id - Identifies the download, so the same URL listed twice
+ *             does not share chunk files
+ * @param offset - Offset of the range
+ * @param path - Buffer of FILE_SIZE bytes receiving the path
+ */
+void chunk_path(const char *dir, const char *url, int id, int64_t offset, char *path) {
+    output_path(dir, url, path);
 
-    free(task->url);
-    free(task);
+    int len = strlen(path);
+    snprintf(path + len, FILE_SIZE - len, ".%d.part%" PRId64, id, offset);
 }
 
 
-void wait_task(const char *download_dir, Context *context) {
-    char filename[FILE_SIZE], url_file[FILE_SIZE];
+/**
+ * Wait for a finished task and write its range to a chunk file. If the
+ * range was hedged and the duplicate finished first, the chunk is what
+ * the original received before the duplicate's offset followed by the
+ * duplicate. A sparse download's ranges were written as they arrived.
+ * @param context - The pool the task was downloaded by
+ * @return download - The download the task belonged to if that was its
+ *                    last range, NULL otherwise or if woken by a daemon
+ */
+Download *wait_task(Context *context) {
+    char filename[FILE_SIZE];
     Task *task = (Task*)queue_get(context->done);
+    if (!task) {
+        return NULL;    // A job arrived or the daemon is draining
+    }
 
-    if (task->result) {
+    Download *download = task->download;
+    Task *hedge = task->partner && task->partner->won ? task->partner : NULL;
+    FILE *fp = NULL;
 
-        snprintf(url_file, FILE_SIZE * sizeof(char), "%d", task->min_range);
-        size_t len = strlen(url_file);
-        for (int i = 0; i < len; ++i) {
-            if (url_file[i] == '/') {
-                url_file[i] = '|';
-            }
+    int complete = task_complete(task);
+
+    // A duplicate that won only has the rest of the range, so the original
+    // must have received everything before it
+    if (!complete && hedge) {
+        int status = task->result ? http_get_status(task->result) : -1;
+        complete = status >= 200 && status < 300 && task_received(task) >= hedge->min_range - task->min_range;
+        if (!complete) {
+            fprintf(stderr, "error downloading: %s (hedged range incomplete)\n", task->url);
+            hedge = NULL;
         }
+    }
+
+    // A range of a shared list that failed is tried again, see shard_range_failed
+    if (!complete && !context->shard) {
+        download->failed = 1;
+    }
+
+    if ((task->result || hedge) && !download->ranges) {
 
-        snprintf(filename, FILE_SIZE, "%s/%s", download_dir, url_file);
-        FILE *fp = fopen(filename, "w");
+        chunk_path(download->dir, task->url, download->id, task->min_range, filename);
+        fp = fopen(filename, "w");
 
         if (fp == NULL) {
             fprintf(stderr, "error writing to: %s\n", filename);
-            exit(EXIT_FAILURE);
+            download->failed = 1;
         }
+    }
+
+    if (fp) {
 
-        char *data = http_get_content(task->result);
-        if (data) {
-            size_t length = task->result->length - (data - task->result->data);
+        if (task->result) {
+            char *data = http_get_content(task->result);
+            int64_t length = task_received(task);
 
+            if (hedge && length > hedge->min_range - task->min_range) {
+                length = hedge->min_range - task->min_range;
+            }
             fwrite(data, 1, length, fp);
-            fclose(fp);
 
            // printf("downloaded %d bytes from %s\n", (int)length, task->url);
         }
-        else {
-            printf("error in response from %s\n", task->url);
+        if (hedge) {
+            fwrite(http_get_content(hedge->result), 1, task_received(hedge), fp);
         }
+        fclose(fp);
     }
-    else {
+    else if (!task->result && !hedge) {
 
         fprintf(stderr, "error downloading: %s\n", task->url);
     }
 
+    // In a shared list the process finishing the file's last range merges it
+    if (context->shard && (complete ? shard_range_done(context->shard, task->shard_range)
+                                    : shard_range_failed(context->shard, task->shard_range))) {
+        download->merge = 1;
+    }
+
+    if (task->partner) {
+        free_task(task->partner);
+    }
     free_task(task);
+    if (--download->pending == 0) {
+        return download;
+    }
+
+    // Ranges of a shared list or a sparse download were all created up front
+    if (!context->shard && !download->ranges) {
+        submit_ranges(context, download);
+    }
+    return NULL;
 }
 
 
@@ -182,33 +936,36 @@ void wait_task(const char *download_dir, Context *context) {
  * by reading each file, and writing its contents to the dest file.
  * @param src - char pointer to src directory holding files to merge
  * @param dest - char pointer to name of file resulting from merge
+ * @param id - Identifies the download the chunks belong to
  * @param bytes - The maximum byte size downloaded
  * @param tasks - The tasks needed for the multipart download
+ * @return int - 0 on success, -1 if the file could not be written
  */
-void merge_files(char *src, char *dest, int bytes, int tasks) {
+int merge_files(char *src, char *dest, int id, int64_t bytes, int tasks) {
     int i;
-    for (i = 0; i < strlen(dest); ++i ){
-        if(dest[i] == '/'){dest[i] = '+';}      //  Replece "/" for naming a file
-    }
-
     char location[FILE_SIZE];
-    sprintf(location, "%s/%s", src, dest);      // File Directory with Name
+    output_path(src, dest, location);           // File Directory with Name
+
+    // Replace rather than append to an earlier download, which may be a
+    // link to a cached copy that must not be written through
+    unlink(location);
     int merged_file = open(location, O_CREAT|O_WRONLY|O_APPEND, 0777);  // Create a file for merging all chunk files
     if (merged_file == -1)
     {
         perror("Merged File Error");    // File check
-        exit(1);
+        return -1;
     }
     char chunk_names[FILE_SIZE];            // Save chunk files names
     char buffer[BUF_SIZE];
 
     for ( i = 0; i < tasks; ++i) {
-        sprintf(chunk_names, "%s/%d", src, i*bytes);    // located the specific chunk file
+        chunk_path(src, dest, id, i * bytes, chunk_names);    // located the specific chunk file
         int chunk_file = open(chunk_names, O_RDONLY);   //  Open Chunk File
         if (chunk_file == -1)
         {
         perror("Chunk File Error");     // File check
-        exit(1);
+        close(merged_file);
+        return -1;
         }
 
         while (1) {             // looping for combining all chunk files
@@ -220,101 +977,732 @@ void merge_files(char *src, char *dest, int bytes, int tasks) {
     }
 
     close(merged_file);     // Close file
+    return 0;
 }
 
 
 /**
  * Remove files caused by chunk downloading
  * @param dir - The directory holding the chunked files
+ * @param url - The URL the chunks were downloaded from
+ * @param id - Identifies the download the chunks belong to
  * @param bytes - The maximum byte size per file. Assumed to be filename
  * @param files - The number of chunked files to remove.
  */
-void remove_chunk_files(char *dir, int bytes, int files) {
+void remove_chunk_files(char *dir, char *url, int id, int64_t bytes, int files) {
     char chunk_name[FILE_SIZE];         // Each Chunk Name
-    int i = 0;                          // Start art 0
-    while(1) {
-        sprintf(chunk_name, "%s/%d", dir, i*bytes);     // Locate each chunk file
-        if (remove(chunk_name) != 0) break;     // Break Loop, until delete all chunk files
-        ++i;
+    int i;
+    for (i = 0; i < files; ++i) {
+        chunk_path(dir, url, id, i * bytes, chunk_name);      // Locate each chunk file
+        remove(chunk_name);     // A range that failed left no file
+    }
+}
+
+
+/**
+ * Probe a URL, or restore it to download_dir from the cache if it has
+ * not changed, see cache_probe
+ * @param cache - The download cache, or NULL
+ * @param download_dir - The directory the file is downloaded to
+ * @param url - The URL to download
+ * @param head - Filled in with the probe response
+ * @return int - 1 if the URL has to be downloaded, 0 if it was restored,
+ *               -1 if the server could not be reached
+ */
+int probe_url(Cache *cache, const char *download_dir, const char *url, HttpHead *head) {
+    char path[FILE_SIZE];
+
+    output_path(download_dir, url, path);
+    return cache_probe(cache, url, path, head);
+}
+
+
+/**
+ * Free a download once none of its ranges are scheduled any more
+ * @param context - The pool the ranges were downloaded by
+ * @param download - The download to free
+ */
+void free_download(Context *context, Download *download) {
+    if (download->sparse_fd != -1) {
+        close(download->sparse_fd);
+    }
+    sched_lane_free(context->todo, download->lane);
+    free(download->ranges);
+    free(download->rates);
+    free(download->url);
+    free(download->dir);
+    free(download);
+}
+
+
+// Index after the group of ranges starting at first, see schedule_sparse
+int next_group(Download *download, int first) {
+    int64_t bytes = download->ranges[first].length;
+    int next = first + 1;
+
+    while (next < download->num_ranges && next - first < SPARSE_MAX_PARTS &&
+           bytes + download->ranges[next].length <= download->bytes) {
+        bytes += download->ranges[next++].length;
+    }
+    return next;
+}
+
+
+// What probing the URLs of a list needs, see probe_entry
+typedef struct {
+    Cache *cache;
+    const char *download_dir;
+} ListProbeArgs;
+
+
+/**
+ * Probe a line of the URL list ahead of it being scheduled, see ListProbe
+ * @param entry - The line, whose head is filled in
+ * @param arg - The ListProbeArgs
+ * @return int - As probe_url returns
+ */
+int probe_entry(ListEntry *entry, void *arg) {
+    ListProbeArgs *args = (ListProbeArgs *)arg;
+
+    // A cached copy is of the whole file
+    return probe_url(entry->ranges[0] ? NULL : args->cache, args->download_dir, entry->url, &entry->head);
+}
+
+
+/**
+ * Open the output file of a sparse download, which is as long as the
+ * resource but takes no room where nothing is written
+ * @param dir - The directory the file is downloaded to
+ * @param url - The URL it is downloaded from
+ * @param content_length - Bytes of the resource, 0 if unknown
+ * @param create - Set to create the file, clear to open the one created
+ *                 by the process that planned it in a shared list
+ * @return int - The file descriptor, -1 if it could not be opened
+ */
+int open_sparse(const char *dir, const char *url, int64_t content_length, int create) {
+    char path[FILE_SIZE];
+
+    output_path(dir, url, path);
+    if (!create) {
+        int fd = open(path, O_WRONLY);
+        if (fd == -1) {
+            perror("Sparse File Error");
+        }
+        return fd;
+    }
+
+    // Replace rather than write through a link to a cached copy
+    unlink(path);
+    int fd = open(path, O_CREAT|O_WRONLY, 0777);
+    if (fd == -1) {
+        perror("Sparse File Error");
+        return -1;
+    }
+    if (content_length > 0 && ftruncate(fd, content_length) == -1) {
+        perror("Sparse File Error");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+/**
+ * Schedule some ranges of a probed URL. They are planned by plan_ranges,
+ * and neighbours grouped into one multipart request of up to
+ * SPARSE_MAX_PARTS ranges and a chunk of bytes. The output file is as long
+ * as the resource but sparse: the ranges are written into it as they
+ * arrive and the rest takes no room.
+ * @param context - The pool the ranges are downloaded by
+ * @param download - The download, planned here
+ * @param spec - The byte ranges wanted, see http_parse_ranges
+ * @param workers - The number of ranges downloaded at once, see plan_chunks
+ * @return int - 0 on success, -1 if the ranges are malformed or the output
+ *               file could not be created
+ */
+int schedule_sparse(Context *context, Download *download, const char *spec, int workers) {
+    HttpRange wanted[SPARSE_MAX_RANGES];
+    int64_t content_length = download->head.content_length;
+    int num_wanted = http_parse_ranges(spec, wanted, SPARSE_MAX_RANGES);
+    int i, next, index;
+
+    if (num_wanted > 0) {
+        download->ranges = plan_ranges(wanted, num_wanted, content_length, SPARSE_GAP_BYTES, workers,
+            PLANNED_IN_FLIGHT, &download->num_ranges, &download->bytes);
+    }
+    if (!download->ranges || download->num_ranges == 0) {
+        fprintf(stderr, "bad ranges for %s: %s\n", download->url, spec);
+        return -1;
+    }
+
+    download->sparse_fd = open_sparse(download->dir, download->url, content_length, 1);
+    if (download->sparse_fd == -1) {
+        return -1;
+    }
+    download->multipart = 1;
+
+    for (i = 0; i < download->num_ranges; i = next_group(download, i)) {
+        ++download->num_tasks;
+    }
+    download->pending = download->num_tasks;
+    download->rates = (double *)malloc(sizeof(double) * download->num_tasks);
+
+    for (i = 0, index = 0; i < download->num_ranges; i = next, ++index) {
+        next = next_group(download, i);
+        HttpRange *last = &download->ranges[next - 1];
+
+        Task *task = new_task(download, download->ranges[i].offset, last->offset + last->length - 1);
+        task->first_range = i;
+        task->num_ranges = next - i;
+        task->progress.weight = 256 - 255 * index / download->num_tasks;
+        submit_task(context, task);
+    }
+    return 0;
+}
+
+
+/**
+ * Schedule the ranges of a probed URL
+ * @param context - The pool the ranges are downloaded by
+ * @param download_dir - The directory the file is downloaded to
+ * @param url - The URL to download
+ * @param head - The probe response, see probe_url
+ * @param priority - Files with a higher priority are scheduled first
+ * @param ranges - The byte ranges wanted, e.g. 0-1023,-512, or NULL for
+ *                 the whole file, see schedule_sparse
+ * @param workers - The number of ranges downloaded at once, see plan_chunks
+ * @return download - The scheduled download, NULL if the ranges are malformed
+ */
+Download *schedule_download(Context *context, const char *download_dir, const char *url,
+                            const HttpHead *head, int priority, const char *ranges, int workers) {
+    static int next_id = 0;
+
+    Download *download = (Download *)calloc(1, sizeof(Download));
+    download->url = strdup(url);
+    download->dir = strdup(download_dir);
+    download->head = *head;
+    download->lane = sched_lane_alloc(context->todo, priority);
+    download->shard_file = -1;
+    download->merge = 1;
+    download->id = next_id++;
+    download->sparse_fd = -1;
+
+    if (ranges) {
+        if (schedule_sparse(context, download, ranges, workers) == -1) {
+            free_download(context, download);
+            return NULL;
+        }
+        return download;
+    }
+
+    // Get number of tasks, which is the times of a flie should download,
+    // and the maxmium chunk size for each task
+    download->num_tasks = plan_chunks(head->content_length, workers, PLANNED_IN_FLIGHT, &download->bytes);
+    download->pending = download->num_tasks;
+    download->rates = (double *)malloc(sizeof(double) * download->num_tasks);
+    download->num_rates = 0;
+    download->window = workers * FILE_WINDOW_FACTOR;
+    if (context->hedge) {
+        hedge_planned(context->hedge, head->content_length);
+    }
+
+    // Clarify range for mutiply tasks:
+    // i * bytes - (i+1) * bytes - 1
+    // 0 - 99
+    // 100 - 199
+    // 200 - 299 .....  to aviod overlap bytes, the last one ends at the end.
+    // Only the first window of them is created here, see submit_ranges.
+    sched_lane_plan(context->todo, download->lane, head->content_length);
+    submit_ranges(context, download);
+
+    return download;
+}
+
+
+/**
+ * Merge the chunks of a download whose ranges have all been written,
+ * record it in the cache and free it. A download with a range missing is
+ * not merged, nor is a file of a shared list that another process gave
+ * up on. A sparse download was written in place and is not cached.
+ * In daemon mode the job is reported either way.
+ * @param context - The pool the ranges were downloaded by
+ * @param cache - The download cache, or NULL
+ * @param download - The finished download
+ */
+void finish_download(Context *context, Cache *cache, Download *download) {
+    char path[FILE_SIZE];
+    char *dir = download->dir;
+
+    // Another process may have given up on a range of a shared file
+    if (context->shard && shard_file(context->shard, download->shard_file)->failed) {
+        download->failed = 1;
+    }
+
+    if (!download->ranges) {
+        // Merge the files -- simple synchronous method
+        if (!download->failed && merge_files(dir, download->url, download->id, download->bytes, download->num_tasks) == -1) {
+            download->failed = 1;
+        }
+        // Then remove the chunked download files
+        remove_chunk_files(dir, download->url, download->id, download->bytes, download->num_tasks);
+    }
+
+    output_path(dir, download->url, path);
+    if (download->failed) {
+        fprintf(stderr, "error downloading: %s\n", download->url);
+    }
+    else if (cache && !download->ranges && cache_store(cache, download->url, &download->head, path) == -1) {
+        fprintf(stderr, "error caching %s\n", download->url);
+    }
+
+    if (download->job) {
+        daemon_finish(context->daemon, download->job, download->failed ? "error" : "done",
+            download->failed ? "download failed" : path);
+    }
+    free_download(context, download);
+}
+
+
+/**
+ * Create the local record of a file from a shared list
+ * @param context - The pool its ranges are downloaded by
+ * @param download_dir - The directory the file is downloaded to
+ * @param file - Index of the file in the shared list
+ * @return download - The download, with nothing pending yet. A sparse
+ *                    file that could not be opened has a sparse_fd of -1.
+ */
+Download *shard_download(Context *context, const char *download_dir, int file) {
+    const ShardFile *shared = shard_file(context->shard, file);
+    Download *download = (Download *)calloc(1, sizeof(Download));
+
+    download->url = strdup(shared->url);
+    download->dir = strdup(download_dir);
+    download->bytes = shared->bytes;
+    download->num_tasks = shared->num_ranges;
+    download->rates = (double *)malloc(sizeof(double) * download->num_tasks);
+    download->num_rates = 0;
+    download->pending = 0;
+    download->head = shared->head;
+    download->lane = sched_lane_alloc(context->todo, shared->priority);
+    download->shard_file = file;
+    download->merge = 0;
+    download->id = file;
+    download->sparse_fd = -1;
+
+    // The file was created when it was planned, see plan_shared
+    if (shared->sparse) {
+        download->ranges = (HttpRange *)malloc(sizeof(HttpRange) * shared->num_ranges);
+        download->num_ranges = shared->num_ranges;
+        shard_ranges(context->shard, file, download->ranges);
+        download->sparse_fd = open_sparse(download_dir, download->url, download->head.content_length, 0);
+        download->multipart = 1;
+    }
+
+    return download;
+}
+
+
+/**
+ * Probe a file of a shared list claimed with SHARD_PLAN and publish its
+ * ranges. A file only wanted in part is planned by plan_ranges, and its
+ * sparse output file created before any other process can claim a range
+ * of it. Each planned range is claimed on its own, so unlike
+ * schedule_sparse neighbours are not grouped into a multipart request.
+ * A file that cannot be probed or downloaded is failed, so the list
+ * goes on without it.
+ * @param context - The pool ranges are downloaded by
+ * @param cache - The download cache, or NULL
+ * @param download_dir - The directory files are downloaded to
+ * @param file - Index of the file in the shared list
+ * @param workers - The number of ranges downloaded at once, see plan_chunks
+ */
+void plan_shared(Context *context, Cache *cache, const char *download_dir, int file, int workers) {
+    Shard *shard = context->shard;
+    const ShardFile *shared = shard_file(shard, file);
+    HttpRange wanted[SPARSE_MAX_RANGES];
+    HttpHead head;
+    int64_t bytes;
+    int num_ranges;
+
+    // A cached copy is of the whole file
+    int probed = probe_url(shared->ranges[0] ? NULL : cache, download_dir, shared->url, &head);
+    if (probed == -1) {
+        shard_fail(shard, file);
+        return;
+    }
+    if (probed == 0) {
+        shard_skip(shard, file);
+        return;
+    }
+    if (head.status < 200 || head.status >= 300) {
+        fprintf(stderr, "error downloading: %s (status %d)\n", shared->url, head.status);
+        shard_fail(shard, file);
+        return;
+    }
+
+    if (!shared->ranges[0]) {
+        num_ranges = plan_chunks(head.content_length, workers, PLANNED_IN_FLIGHT, &bytes);
+        shard_plan(shard, file, &head, bytes, num_ranges);
+        return;
+    }
+
+    int num_wanted = http_parse_ranges(shared->ranges, wanted, SPARSE_MAX_RANGES);
+    HttpRange *ranges = num_wanted > 0 ? plan_ranges(wanted, num_wanted, head.content_length, SPARSE_GAP_BYTES,
+        workers, PLANNED_IN_FLIGHT, &num_ranges, &bytes) : NULL;
+    if (!ranges || num_ranges == 0) {
+        fprintf(stderr, "bad ranges for %s: %s\n", shared->url, shared->ranges);
+        shard_fail(shard, file);
+    }
+    else {
+        int fd = open_sparse(download_dir, shared->url, head.content_length, 1);
+        if (fd == -1) {
+            shard_fail(shard, file);
+        }
+        else {
+            close(fd);
+            shard_plan_ranges(shard, file, &head, ranges, num_ranges);
+        }
+    }
+    free(ranges);
+}
+
+
+/**
+ * Work through a URL list shared with other processes, see shard.h.
+ * Ranges are claimed from the list as workers free up, and each file is
+ * merged by whichever process downloads its last range. A range that
+ * fails is handed back to be tried again, see shard_range_failed.
+ * @param context - The pool ranges are downloaded by
+ * @param cache - The download cache, or NULL
+ * @param download_dir - The directory files are downloaded to
+ * @param window - The most ranges to hold claims on at once
+ * @param workers - The number of ranges downloaded at once, see plan_chunks
+ */
+void run_sharded(Context *context, Cache *cache, char *download_dir, int window, int workers) {
+    Download **local = (Download **)calloc(SHARD_MAX_FILES, sizeof(Download *));
+    Shard *shard = context->shard;
+    ShardClaim claim;
+    int in_flight = 0;
+
+    while (!shard_finished(shard) || in_flight > 0) {
+        ShardClaimKind kind;
+
+        while (in_flight < window && (kind = shard_claim(shard, &claim)) != SHARD_NONE) {
+
+            if (kind == SHARD_PLAN) {
+                // First to reach this file, probe it and publish its ranges
+                plan_shared(context, cache, download_dir, claim.file, workers);
+                continue;
+            }
+
+            Download *download = local[claim.file];
+            if (!download) {
+                download = local[claim.file] = shard_download(context, download_dir, claim.file);
+            }
+
+            if (kind == SHARD_MERGE) {
+                // The process that should have merged it died
+                local[claim.file] = NULL;
+                finish_download(context, cache, download);
+                shard_file_done(shard, claim.file);
+                continue;
+            }
+
+            Task *task = new_task(download, claim.offset, claim.offset + claim.length - 1);
+            task->shard_range = claim.range;
+            if (download->ranges) {
+                task->first_range = claim.range - shard_file(shard, claim.file)->first_range;
+                task->num_ranges = 1;
+            }
+            ++download->pending;
+            ++in_flight;
+            if (context->hedge) {
+                hedge_planned(context->hedge, claim.length);
+            }
+            submit_task(context, task);
+        }
+
+        if (in_flight == 0) {
+            // What is left is claimed by other processes, check they are alive
+            shard_reclaim(shard);
+            usleep(SHARD_POLL_MS * 1000);
+            continue;
+        }
+
+        Download *download = wait_task(context);
+        --in_flight;
+
+        if (download) {
+            int file = download->shard_file;
+            local[file] = NULL;
+
+            if (download->merge) {
+                finish_download(context, cache, download);
+                shard_file_done(shard, file);
+            }
+            else {
+                free_download(context, download);   // Another process has ranges left
+            }
+        }
+    }
+
+    free(local);
+}
+
+
+// Wakes the main thread waiting in wait_task
+void wake_main(void *arg) {
+    Context *context = (Context *)arg;
+    queue_put(context->done, NULL);
+}
+
+
+/**
+ * Serve jobs from the daemon's clients until it has drained, see daemon.h.
+ * The workers, connection pool and cache stay warm between jobs.
+ * @param context - The pool ranges are downloaded by
+ * @param cache - The download cache, or NULL
+ * @param workers - The number of ranges downloaded at once, see plan_chunks
+ */
+void run_daemon(Context *context, Cache *cache, int workers) {
+    Daemon *daemon = context->daemon;
+    char path[FILE_SIZE];
+    HttpHead head;
+    Job *job;
+    int in_flight = 0;
+
+    daemon_run(daemon, wake_main, context);
+
+    while (!daemon_idle(daemon)) {
+
+        // Start jobs as they arrive, keeping up to MAX_FILES_IN_FLIGHT files scheduled
+        while (in_flight < MAX_FILES_IN_FLIGHT && (job = daemon_next(daemon))) {
+            if (create_directory(job->dir) == -1) {
+                daemon_finish(daemon, job, "error", "bad download_dir");
+                continue;
+            }
+
+            // A cached copy is of the whole file
+            const char *ranges = job->ranges[0] ? job->ranges : NULL;
+            int probed = probe_url(ranges ? NULL : cache, job->dir, job->url, &head);
+            if (probed == -1) {
+                daemon_finish(daemon, job, "error", "probe failed");
+            }
+            else if (probed == 0) {
+                output_path(job->dir, job->url, path);
+                daemon_finish(daemon, job, "cached", path);
+            }
+            else if (head.status < 200 || head.status >= 300) {
+                snprintf(path, sizeof(path), "status %d", head.status);
+                daemon_finish(daemon, job, "error", path);
+            }
+            else {
+                Download *download = schedule_download(context, job->dir, job->url, &head, job->priority, ranges, workers);
+                if (!download) {
+                    daemon_finish(daemon, job, "error", "bad ranges");
+                    continue;
+                }
+                download->job = job;
+                ++in_flight;
+            }
+        }
+
+        // Sleeps until a range finishes, a job arrives or a drain starts
+        Download *download = wait_task(context);
+        if (download) {
+            finish_download(context, cache, download);
+            --in_flight;
+        }
     }
 }
 
 
 int main(int argc, char **argv) {
-    if (argc != 4) {
-        fprintf(stderr, "usage: ./downloader url_file num_workers download_dir\n");
+    Cache *cache = NULL;
+    SchedPolicy policy = SCHED_FIFO;
+    char *shared = NULL;
+    char *socket_path = NULL;
+    char *ca_file = NULL;
+    Hedge *hedge = NULL;
+    int opt, coroutines = 0, http2 = 0;
+
+    while ((opt = getopt(argc, argv, "a:c:d:H:m:p:s:t:")) != -1) {
+        if (opt == 'a') {
+            ca_file = optarg;           // Trust these certificates for https too
+        }
+        else if (opt == 'c') {
+            cache = cache_open(optarg);     // Revalidate and deduplicate through a cache
+        }
+        else if (opt == 'm' && (strcmp(optarg, "threads") == 0 || strcmp(optarg, "coro") == 0)) {
+            coroutines = strcmp(optarg, "coro") == 0;   // Coroutines instead of a thread per worker
+        }
+        else if (opt == 'p' && strcmp(optarg, "fifo") == 0) {
+            policy = SCHED_FIFO;        // Files in the order they are listed
+        }
+        else if (opt == 'p' && strcmp(optarg, "shortest") == 0) {
+            policy = SCHED_SHORTEST;    // Files with the fewest bytes left first
+        }
+        else if (opt == 'p' && strcmp(optarg, "front") == 0) {
+            policy = SCHED_FRONT;       // Leading ranges of every file first
+        }
+        else if (opt == 's') {
+            shared = optarg;            // Share the list with other processes
+        }
+        else if (opt == 'd') {
+            socket_path = optarg;       // Serve jobs from a socket instead of a list
+        }
+        else if (opt == 't' && (strcmp(optarg, "http1") == 0 || strcmp(optarg, "h2") == 0 || strcmp(optarg, "h2c") == 0)) {
+            // Ranges as streams on a shared connection, h2c for http and h2 over TLS for https
+            http2 = strcmp(optarg, "http1") != 0;
+        }
+        else if (opt == 'H' && atof(optarg) > 0) {
+            // Duplicate straggling ranges, spending at most this percentage more bytes
+            hedge = hedge_alloc(atof(optarg) / 100, HEDGE_SLOW_FACTOR, HEDGE_MIN_SECONDS);
+        }
+        else {
+            argc = 0;   // Unknown option, print usage below
+        }
+    }
+
+    if (socket_path ? argc - optind != 1 || shared : argc - optind != 3) {
+        fprintf(stderr, "usage: ./downloader [-a ca_file] [-c cache_dir] [-H extra_percent] [-m threads|coro] [-p fifo|shortest|front] [-s name] [-t http1|h2|h2c] url_file num_workers|auto download_dir\n");
+        fprintf(stderr, "       ./downloader -d socket_path [-a ca_file] [-c cache_dir] [-H extra_percent] [-m threads|coro] [-p fifo|shortest|front] [-t http1|h2|h2c] num_workers|auto\n");
         exit(1);
     }
     // urls file, number of workers , download location
-    char *url_file = argv[1];
-    int num_workers = atoi(argv[2]);
-    char *download_dir = argv[3];
+    char *url_file = socket_path ? NULL : argv[optind];
+    char *workers = socket_path ? argv[optind] : argv[optind + 1];
+    int num_workers = atoi(workers);
+    char *download_dir = socket_path ? NULL : argv[optind + 2];
+
+    // In auto mode the pool is sized for the largest limit, and the
+    // controller decides how many of those workers may download at once
+    Control *control = NULL;
+    if (strcmp(workers, "auto") == 0 && coroutines) {
+        fprintf(stderr, "auto needs threads mode\n");
+        exit(1);
+    }
+    else if (strcmp(workers, "auto") == 0) {
+        num_workers = AUTO_MAX_WORKERS;
+        control = control_alloc(1, AUTO_MAX_WORKERS, CONTROL_INTERVAL_MS);
+    }
+    else if (num_workers <= 0) {
+        fprintf(stderr, "num_workers must be a positive number or auto\n");
+        exit(1);
+    }
+
+    // A peer closing a connection must not kill the process
+    signal(SIGPIPE, SIG_IGN);
 
-    create_directory(download_dir);
-    FILE *fp = fopen(url_file, "r");    // File descriptor for url_file
-    char *line = NULL;                  // Char pointer to locate the URL
-    size_t len = 0;                     // Length of URL
+    // Before any thread starts, so the signals are left to the daemon
+    Daemon *daemon = socket_path ? daemon_open(socket_path) : NULL;
 
-    if (fp == NULL) {
+    if (url_file && create_directory(download_dir) == -1) {
         exit(EXIT_FAILURE);
     }
 
+    // https URLs resume TLS sessions across the connections of their ranges
+    Tls *tls = tls_alloc(ca_file);
+    if (!tls) {
+        exit(1);
+    }
+    http_use_tls(tls);
+
+    // Reuse connections to a server and its resolved addresses across ranges
+    Pool *pool = pool_alloc(POOL_MAX_IDLE, POOL_IDLE_SECONDS, DNS_TTL_SECONDS);
+    http_use_pool(pool);
+    H2 *h2 = http2 ? h2_alloc(H2_CONNS_PER_HOST, H2_STREAM_WINDOW, H2_CONN_WINDOW, tls) : NULL;
+    http_use_h2(h2);
+
     // spawn threads and create work queue(s)
-    Context *context = spawn_workers(num_workers);
+    Context *context = coroutines ? spawn_coroutines(num_workers, policy) : spawn_workers(num_workers, control, policy);
+    if (hedge) {
+        start_hedging(context, hedge);
+    }
 
-    //
-    int work = 0, bytes = 0, num_tasks = 0;
+    int in_flight = 0, more = url_file && !shared;
+    ListProbeArgs probe_args = { cache, download_dir };
+    List *list = NULL;
+    ListEntry entry;
+    Download *download;
 
-    // looping for get each URL from fp (the file where urls located),
-    // and &line is to save specific URL, and using for later functions.
-    // The != -1 is to make sure there is a URL will get.
-    while ((len = getline(&line, &len, fp)) != -1) {
+    if (daemon) {
+        context->daemon = daemon;
+        run_daemon(context, cache, num_workers);
+    }
 
-        // Checking "\n" for a line of URL
-        if (line[len - 1] == '\n') {
-            // And using null byte to replace "\n"
-            line[len - 1] = '\0';
-        }
+    if (shared) {
+        context->shard = shard_open(shared, url_file);
+        run_sharded(context, cache, download_dir, num_workers * 2, num_workers);
+    }
 
-        // Get number of tasks, which is the times of a flie should download
-        num_tasks = get_num_tasks(line, num_workers);
-        if (num_tasks == -1){
-            perror("Number of Task Error"); // Get Task error check
-            exit(1);
-        }
-        // The maxmium chunk size for each task
-        bytes = get_max_chunk_size();
+    // The list is streamed and its URLs probed ahead, see list.h
+    if (more && !(list = list_open(url_file, LIST_LOOKAHEAD, LIST_PROBERS, probe_entry, &probe_args))) {
+        exit(EXIT_FAILURE);
+    }
 
-        // Loop multiply times until all
-        for (int i  = 0; i < num_tasks; i ++) {
-            // Record all available tasks
-            ++work;
-            // Put the task to TODO QUEUE for downloading
-            // Clarify range for mutiply tasks:
-            // i * bytes - (i+1) * bytes - 1
-            // 0 - 99
-            // 100 - 199
-            // 200 - 299 .....  to aviod overlap bytes.
-            queue_put(context->todo, new_task(line, i * bytes, (i+1) * bytes - 1));
-        }
+    // Keep up to MAX_FILES_IN_FLIGHT files scheduled, so the scheduler can
+    // choose between them, and start the next one as soon as one finishes
+    while (more || in_flight > 0) {
 
-        // Get results back
-        while (work > 0) {
-            // Decrease the tasks, and be able to let new task to add in.
-            --work;
-            // Download the context form task which is currently in TODO QUEUE
-            wait_task(download_dir, context);
+        while (more && in_flight < MAX_FILES_IN_FLIGHT) {
+            if (list_next(list, &entry) == -1) {
+                more = 0;
+                break;
+            }
+            if (entry.probed == -1) {
+                continue;       // Reported by probe_url
+            }
+            if (entry.probed && (entry.head.status < 200 || entry.head.status >= 300)) {
+                fprintf(stderr, "error downloading: %s (status %d)\n", entry.url, entry.head.status);
+                continue;
+            }
+
+            // Planned for the whole pool in auto mode too, so there are ranges
+            // waiting for every connection the controller may add
+            if (entry.probed && schedule_download(context, download_dir, entry.url, &entry.head, entry.priority,
+                                                  entry.ranges[0] ? entry.ranges : NULL, num_workers)) {
+                ++in_flight;
+            }
         }
 
-        // Merge the files -- simple synchronous method
-        merge_files(download_dir, line, bytes, num_tasks);
-        // Then remove the chunked download files
-        remove_chunk_files(download_dir, bytes, num_tasks);
+        // Get results back, finishing files as their last range arrives
+        if (in_flight > 0 && (download = wait_task(context))) {
+            finish_download(context, cache, download);
+            --in_flight;
+        }
     }
 
     // Clean up
-    fclose(fp);  // Close file descriptor
-    free(line);  // Free allocated memory
+    if (list) {
+        if (list_duplicates(list) > 0) {
+            fprintf(stderr, "skipped %" PRId64 " duplicate urls\n", list_duplicates(list));
+        }
+        list_close(list);
+    }
+    if (context->shard) {
+        shard_close(context->shard);
+    }
     free_workers(context);
+    if (daemon) {
+        daemon_close(daemon);
+    }
+    http_use_h2(NULL);
+    if (h2) {
+        h2_free(h2);
+    }
+    http_use_pool(NULL);
+    pool_free(pool);
+    http_use_tls(NULL);
+    tls_free(tls);
+    if (hedge) {
+        hedge_free(hedge);
+    }
+    if (control) {
+        control_free(control);
+    }
+    if (cache) {
+        cache_close(cache);
+    }
     return 0;
 }
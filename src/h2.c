@@ -0,0 +1,1046 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "h2.h"
+#include "hpack.h"
+#include "coro.h"
+#include "tls.h"
+
+#define PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define FRAME_HEADER_SIZE 9
+#define MAX_FRAME_SIZE (1 << 20)        // Largest frame accepted, large ranges need fewer
+#define DEFAULT_WINDOW 65535            // Windows before SETTINGS or WINDOW_UPDATE change them
+#define DEFAULT_MAX_STREAMS 100         // Until the server says otherwise
+#define HOST_SIZE 256
+#define BLOCK_SIZE 4096                 // Largest request header block
+#define MAX_RESERVE (16 * 1024 * 1024)  // Most content allocated ahead on the server's word
+
+// Frame types, see RFC 9113 6
+#define FRAME_DATA 0x0
+#define FRAME_HEADERS 0x1
+#define FRAME_RST_STREAM 0x3
+#define FRAME_SETTINGS 0x4
+#define FRAME_PING 0x6
+#define FRAME_GOAWAY 0x7
+#define FRAME_WINDOW_UPDATE 0x8
+#define FRAME_CONTINUATION 0x9
+
+// Frame flags
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+// Settings
+#define SETTINGS_ENABLE_PUSH 0x2
+#define SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define SETTINGS_MAX_FRAME_SIZE 0x5
+#define SETTINGS_NO_RFC7540_PRIORITIES 0x9
+
+#define ERROR_CANCEL 0x8
+
+// Stream states
+#define STREAM_OPEN 0
+#define STREAM_DONE 1
+#define STREAM_FAILED 2
+
+
+// A request in flight
+typedef struct StreamStruct {
+    uint32_t id;
+    int state;              // STREAM_OPEN, STREAM_DONE or STREAM_FAILED
+    int status;             // From :status, 0 until the response header arrived
+
+    // The response as HTTP/1 would have it, header lines then content
+    char *data;
+    size_t length;
+    size_t capacity;
+    size_t head_length;     // 0 until the response header arrived
+
+    int64_t unacked;        // Content received and not yet given back to the window
+    int head;               // Set for a HEAD request, whose response has no content
+    int reset;              // Set if it failed on our side, so the server must stop sending
+    HttpProgress *progress;
+    int notify[2];          // The reader writes to notify[1] when the stream ends
+    struct StreamStruct *next;
+} Stream;
+
+
+// A connection to a server
+typedef struct ConnStruct {
+    char host[HOST_SIZE];
+    int port;
+    int secure;
+    int address;
+    int fd;
+    TlsConn *tls;           // NULL for h2c
+    struct H2Struct *h2;
+    pthread_t reader;
+
+    // Guarded by the transport's lock
+    int num_streams;        // Streams using it, including ones about to start
+    int max_streams;        // As the server allows
+    int dead;               // Set once no new stream may start on it
+
+    // Guarded by mutex_lock
+    Stream *streams;
+    uint32_t next_id;
+    int priorities;         // Clear if the server ignores RFC 7540 priorities
+    int64_t unacked;        // Content received and not yet given back to the window
+    pthread_mutex_t mutex_lock;
+
+    // Frames go out whole. Taken before mutex_lock and never while
+    // holding it, so a blocked send never stops the reader.
+    pthread_mutex_t write_lock;
+
+    // Used by the reader only
+    Hpack *hpack;
+    uint8_t *frame;
+    uint8_t *block;         // A header block split over CONTINUATION frames
+    size_t block_length;
+    uint32_t block_stream;
+    int block_flags;
+
+    struct ConnStruct *next;
+} Conn;
+
+
+// A server that did not agree to h2 by ALPN, see h2_available
+typedef struct Http1HostStruct {
+    char host[HOST_SIZE];
+    int port;
+    struct Http1HostStruct *next;
+} Http1Host;
+
+
+/*
+ * H2 - an HTTP/2 transport.
+ * Hidden from the outside, see h2.h
+ */
+typedef struct H2Struct {
+    int conns_per_host;
+    int32_t stream_window;
+    int32_t conn_window;
+    Tls *tls;
+
+    Conn *conns;
+    Http1Host *http1;       // Servers to ask over HTTP/1 instead
+    pthread_mutex_t mutex_lock;
+} H2;
+
+
+/**
+ * Allocate an HTTP/2 transport
+ * @param conns_per_host - Connections a server's streams are spread over
+ * @param stream_window - Flow control window of each stream, in bytes
+ * @param conn_window - Flow control window of each connection, in bytes
+ * @param tls - The TLS context for https, see tls.h, or NULL
+ * @return h2 - Pointer to the allocated transport
+ */
+H2 *h2_alloc(int conns_per_host, int32_t stream_window, int32_t conn_window, Tls *tls) {
+    H2 *h2 = (H2 *)calloc(1, sizeof(H2));
+    h2->conns_per_host = conns_per_host;
+    h2->stream_window = stream_window;
+    h2->conn_window = conn_window;
+    h2->tls = tls;
+
+    pthread_mutex_init(&h2->mutex_lock, NULL);
+    return h2;
+}
+
+
+static void put_uint32(uint8_t *out, uint32_t value) {
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+
+static uint32_t get_uint32(const uint8_t *in) {
+    return (uint32_t)in[0] << 24 | (uint32_t)in[1] << 16 | (uint32_t)in[2] << 8 | in[3];
+}
+
+
+// Write all of a buffer, -1 if the connection failed
+static int write_all(Conn *conn, const void *data, size_t length) {
+    const char *pos = (const char *)data;
+
+    if (conn->tls) {
+        return tls_write(conn->tls, data, length) == length ? 0 : -1;
+    }
+    while (length > 0) {
+        ssize_t num_bytes = send(conn->fd, pos, length, MSG_NOSIGNAL);
+        if (num_bytes == -1 && errno == EINTR) continue;
+        if (num_bytes <= 0) return -1;
+        pos += num_bytes;
+        length -= num_bytes;
+    }
+    return 0;
+}
+
+
+// Read exactly length bytes, -1 if the connection closed first
+static int read_all(Conn *conn, void *data, size_t length) {
+    char *pos = (char *)data;
+
+    while (length > 0) {
+        ssize_t num_bytes = conn->tls ? tls_read(conn->tls, pos, length) : read(conn->fd, pos, length);
+        if (num_bytes == -1 && errno == EINTR) continue;
+        if (num_bytes <= 0) return -1;
+        pos += num_bytes;
+        length -= num_bytes;
+    }
+    return 0;
+}
+
+
+/**
+ * Write one frame. Caller holds the write_lock.
+ * @return int - 0 on success, -1 if the connection failed
+ */
+static int write_frame(Conn *conn, int type, int flags, uint32_t stream_id,
+                       const uint8_t *payload, size_t length) {
+    uint8_t header[FRAME_HEADER_SIZE];
+    header[0] = length >> 16;
+    header[1] = length >> 8;
+    header[2] = length;
+    header[3] = type;
+    header[4] = flags;
+    put_uint32(header + 5, stream_id & 0x7fffffff);
+
+    int result = write_all(conn, header, sizeof(header));
+    if (result == 0 && length > 0) {
+        result = write_all(conn, payload, length);
+    }
+    return result;
+}
+
+
+/**
+ * Send one frame. Caller must not hold the connection's mutex_lock, as
+ * the send blocks while the server's receive buffer is full.
+ * @return int - 0 on success, -1 if the connection failed
+ */
+static int send_frame(Conn *conn, int type, int flags, uint32_t stream_id,
+                      const uint8_t *payload, size_t length) {
+    pthread_mutex_lock(&conn->write_lock);
+    int result = write_frame(conn, type, flags, stream_id, payload, length);
+    pthread_mutex_unlock(&conn->write_lock);
+    return result;
+}
+
+
+// Give bytes back to a stream's or the connection's window
+static void window_update(Conn *conn, uint32_t stream_id, int64_t bytes) {
+    uint8_t payload[4];
+    put_uint32(payload, bytes & 0x7fffffff);
+    send_frame(conn, FRAME_WINDOW_UPDATE, 0, stream_id, payload, sizeof(payload));
+}
+
+
+// End a stream and wake its requester. Caller holds the connection's lock.
+static void end_stream(Stream *stream, int state) {
+    if (stream->state == STREAM_OPEN) {
+        stream->state = state;
+        if (write(stream->notify[1], "", 1) != 1) {
+            perror("notify");
+        }
+    }
+}
+
+
+// Find an open stream. Caller holds the connection's lock.
+static Stream *find_stream(Conn *conn, uint32_t id) {
+    Stream *stream;
+    for (stream = conn->streams; stream; stream = stream->next) {
+        if (stream->id == id) return stream->state == STREAM_OPEN ? stream : NULL;
+    }
+    return NULL;
+}
+
+
+/**
+ * Make room for length more bytes of a stream's response
+ * @return int - 0 on success, -1 if there is not enough memory
+ */
+static int reserve(Stream *stream, size_t length) {
+    size_t needed = stream->length + length;
+
+    if (needed > stream->capacity) {
+        size_t capacity = stream->capacity * 2 > needed ? stream->capacity * 2 : needed;
+        char *data = (char *)realloc(stream->data, capacity + 1);    // Room for a null byte
+        if (!data) {
+            fprintf(stderr, "out of memory for a %zu byte response\n", capacity);
+            return -1;
+        }
+        stream->data = data;
+        stream->capacity = capacity;
+    }
+    return 0;
+}
+
+
+// Add to a stream's response, -1 if there is not enough memory
+static int append(Stream *stream, const char *data, size_t length) {
+    if (reserve(stream, length) == -1) {
+        return -1;
+    }
+    memcpy(stream->data + stream->length, data, length);
+    stream->length += length;
+    return 0;
+}
+
+
+// The response header of a stream being decoded
+typedef struct {
+    Stream *stream;     // NULL if it was reset, the block is still decoded
+    int64_t content_length;
+    int failed;         // Set if the header did not fit in memory
+} Decoding;
+
+
+// Add a decoded field to the response header in HTTP/1 form
+static void add_field(const char *name, const char *value, void *arg) {
+    Decoding *decoding = (Decoding *)arg;
+    Stream *stream = decoding->stream;
+    char line[HOST_SIZE];
+
+    if (!stream || stream->head_length) {
+        return;     // Reset, or trailers after the content
+    }
+    if (strcmp(name, ":status") == 0) {
+        stream->status = atoi(value);
+        stream->length = 0;
+        int length = snprintf(line, sizeof(line), "HTTP/2.0 %d\r\n", stream->status);
+        decoding->failed |= append(stream, line, length) == -1;
+        return;
+    }
+    if (name[0] == ':') {
+        return;
+    }
+    if (strcmp(name, "content-length") == 0) {
+        decoding->content_length = strtoll(value, NULL, 10);
+    }
+    if (append(stream, name, strlen(name)) == -1 || append(stream, ": ", 2) == -1 ||
+        append(stream, value, strlen(value)) == -1 || append(stream, "\r\n", 2) == -1) {
+        decoding->failed = 1;
+    }
+}
+
+
+/**
+ * Decode a complete header block and end the header of its stream.
+ * Caller holds the connection's lock.
+ * @return int - 0 on success, -1 on a compression error
+ */
+static int end_headers(Conn *conn, uint32_t stream_id, int flags) {
+    Decoding decoding = { find_stream(conn, stream_id), -1, 0 };
+    Stream *stream = decoding.stream;
+
+    if (hpack_decode(conn->hpack, conn->block, conn->block_length, add_field, &decoding) == -1) {
+        return -1;
+    }
+    conn->block_length = 0;
+
+    if (!stream) {
+        return 0;
+    }
+    if (decoding.failed) {
+        stream->reset = 1;
+        end_stream(stream, STREAM_FAILED);
+        return 0;
+    }
+    if (stream->head_length) {
+        if (flags & FLAG_END_STREAM) {
+            end_stream(stream, STREAM_DONE);    // Trailers end the stream
+        }
+        return 0;
+    }
+    if (stream->status >= 100 && stream->status < 200) {
+        stream->status = 0;     // Informational, the response follows
+        stream->length = 0;
+        return 0;
+    }
+
+    if (append(stream, "\r\n", 2) == -1) {
+        stream->reset = 1;
+        end_stream(stream, STREAM_FAILED);
+        return 0;
+    }
+    stream->head_length = stream->length;
+
+    // Most content in one allocation, but not more than MAX_RESERVE ahead
+    // of it arriving. If this fails the content is refused as it arrives.
+    if (decoding.content_length > 0 && !stream->head) {
+        reserve(stream, decoding.content_length < MAX_RESERVE ? decoding.content_length : MAX_RESERVE);
+    }
+    if (flags & FLAG_END_STREAM) {
+        end_stream(stream, STREAM_DONE);
+    }
+    return 0;
+}
+
+
+// Add a fragment of a header block, -1 if it is too large
+static int add_fragment(Conn *conn, const uint8_t *data, size_t length) {
+    if (conn->block_length + length > MAX_FRAME_SIZE) {
+        return -1;
+    }
+    memcpy(conn->block + conn->block_length, data, length);
+    conn->block_length += length;
+    return 0;
+}
+
+
+/**
+ * Handle one frame read from the server
+ * @return int - 0 on success, -1 if the connection can not be used any more
+ */
+static int handle_frame(Conn *conn, int type, int flags, uint32_t stream_id,
+                        uint8_t *payload, size_t length) {
+    H2 *h2 = conn->h2;
+    Stream *stream;
+    size_t pad = 0, i;
+    int result = 0;
+
+    if (conn->block_stream && type != FRAME_CONTINUATION) {
+        return -1;      // A header block must not be interrupted
+    }
+
+    if ((type == FRAME_DATA || type == FRAME_HEADERS) && (flags & FLAG_PADDED)) {
+        if (length < 1 || payload[0] >= length) return -1;
+        pad = payload[0];
+        ++payload;
+        length -= 1 + pad;
+    }
+
+    switch (type) {
+    case FRAME_DATA: {
+        int64_t stream_update = 0, conn_update = 0;
+
+        pthread_mutex_lock(&conn->mutex_lock);
+        conn->unacked += length + pad + (pad ? 1 : 0);   // Padding counts against the window too
+        if ((stream = find_stream(conn, stream_id)) && stream->head_length &&
+            append(stream, (const char *)payload, length) == -1) {
+            stream->reset = 1;
+            end_stream(stream, STREAM_FAILED);
+        }
+        else if (stream && stream->head_length) {
+            stream->unacked += length + pad + (pad ? 1 : 0);
+
+            if (stream->progress) {
+                __atomic_store_n(&stream->progress->received, (int64_t)(stream->length - stream->head_length), __ATOMIC_RELAXED);
+            }
+            if (flags & FLAG_END_STREAM) {
+                end_stream(stream, STREAM_DONE);
+            }
+            else if (stream->unacked >= h2->stream_window / 2) {
+                stream_update = stream->unacked;
+                stream->unacked = 0;
+            }
+        }
+        if (conn->unacked >= h2->conn_window / 2) {
+            conn_update = conn->unacked;
+            conn->unacked = 0;
+        }
+        pthread_mutex_unlock(&conn->mutex_lock);
+
+        // Sent without the lock, requests may be waiting on it
+        if (stream_update) {
+            window_update(conn, stream_id, stream_update);
+        }
+        if (conn_update) {
+            window_update(conn, 0, conn_update);
+        }
+        break;
+    }
+
+    case FRAME_HEADERS:
+        if (flags & FLAG_PRIORITY) {
+            if (length < 5) return -1;
+            payload += 5;
+            length -= 5;
+        }
+        // Fall through to the header block
+    case FRAME_CONTINUATION:
+        if (type == FRAME_CONTINUATION && stream_id != conn->block_stream) {
+            return -1;
+        }
+        if (add_fragment(conn, payload, length) == -1) {
+            return -1;
+        }
+        if (type == FRAME_HEADERS) {
+            conn->block_flags = flags;
+        }
+        if (!(flags & FLAG_END_HEADERS)) {
+            conn->block_stream = stream_id;     // CONTINUATION frames follow
+            break;
+        }
+        conn->block_stream = 0;
+
+        pthread_mutex_lock(&conn->mutex_lock);
+        result = end_headers(conn, stream_id, conn->block_flags);
+        pthread_mutex_unlock(&conn->mutex_lock);
+        break;
+
+    case FRAME_RST_STREAM:
+        pthread_mutex_lock(&conn->mutex_lock);
+        if ((stream = find_stream(conn, stream_id))) {
+            end_stream(stream, STREAM_FAILED);
+        }
+        pthread_mutex_unlock(&conn->mutex_lock);
+        break;
+
+    case FRAME_SETTINGS:
+        if (flags & FLAG_ACK) {
+            break;
+        }
+        for (i = 0; i + 6 <= length; i += 6) {
+            int id = payload[i] << 8 | payload[i + 1];
+            uint32_t value = get_uint32(payload + i + 2);
+
+            if (id == SETTINGS_MAX_CONCURRENT_STREAMS) {
+                pthread_mutex_lock(&h2->mutex_lock);
+                conn->max_streams = value;
+                pthread_mutex_unlock(&h2->mutex_lock);
+            }
+            else if (id == SETTINGS_NO_RFC7540_PRIORITIES) {
+                pthread_mutex_lock(&conn->mutex_lock);
+                conn->priorities = !value;
+                pthread_mutex_unlock(&conn->mutex_lock);
+            }
+        }
+        send_frame(conn, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+        break;
+
+    case FRAME_PING:
+        if (!(flags & FLAG_ACK)) {
+            send_frame(conn, FRAME_PING, FLAG_ACK, 0, payload, length);
+        }
+        break;
+
+    case FRAME_GOAWAY:
+        if (length < 8) return -1;
+        uint32_t last_id = get_uint32(payload) & 0x7fffffff;
+
+        // Streams after the last one were never processed, the rest may finish
+        pthread_mutex_lock(&h2->mutex_lock);
+        conn->dead = 1;
+        pthread_mutex_unlock(&h2->mutex_lock);
+
+        pthread_mutex_lock(&conn->mutex_lock);
+        for (stream = conn->streams; stream; stream = stream->next) {
+            if (stream->id > last_id) end_stream(stream, STREAM_FAILED);
+        }
+        pthread_mutex_unlock(&conn->mutex_lock);
+        break;
+
+    default:
+        break;      // PRIORITY, WINDOW_UPDATE and unknown frames need nothing
+    }
+    return result;
+}
+
+
+// Read frames until the connection closes, then fail what is left on it
+static void *reader_thread(void *arg) {
+    Conn *conn = (Conn *)arg;
+    uint8_t header[FRAME_HEADER_SIZE];
+    Stream *stream;
+
+    while (read_all(conn, header, sizeof(header)) == 0) {
+        size_t length = header[0] << 16 | header[1] << 8 | header[2];
+        uint32_t stream_id = get_uint32(header + 5) & 0x7fffffff;
+
+        if (length > MAX_FRAME_SIZE || read_all(conn, conn->frame, length) == -1) {
+            break;
+        }
+        if (handle_frame(conn, header[3], header[4], stream_id, conn->frame, length) == -1) {
+            fprintf(stderr, "HTTP/2 protocol error from %s\n", conn->host);
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&conn->h2->mutex_lock);
+    conn->dead = 1;
+    pthread_mutex_unlock(&conn->h2->mutex_lock);
+
+    pthread_mutex_lock(&conn->mutex_lock);
+    for (stream = conn->streams; stream; stream = stream->next) {
+        end_stream(stream, STREAM_FAILED);
+    }
+    pthread_mutex_unlock(&conn->mutex_lock);
+    return NULL;
+}
+
+
+// Stop a connection's reader and free it
+static void free_conn(Conn *conn) {
+    shutdown(conn->fd, SHUT_RDWR);
+    pthread_join(conn->reader, NULL);
+    if (conn->tls) {
+        tls_close(conn->tls);
+    }
+    close(conn->fd);
+
+    hpack_free(conn->hpack);
+    pthread_mutex_destroy(&conn->mutex_lock);
+    pthread_mutex_destroy(&conn->write_lock);
+    free(conn->frame);
+    free(conn->block);
+    free(conn);
+}
+
+
+/**
+ * Start a connection on a connected socket: send the preface and our
+ * settings, open the connection's window and start its reader
+ * @param tls - TLS on the socket, or NULL for h2c
+ * @return conn - The connection, NULL if the server went away
+ */
+static Conn *start_conn(H2 *h2, const char *host, int port, int address, int fd, TlsConn *tls) {
+    uint8_t settings[18];
+
+    // Reads and writes block, the reader is a thread of its own
+    if (tls) {
+        tls_block(tls);
+    }
+    else {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+        // A frame's header and payload are separate small writes, which
+        // Nagle would hold back until the server's delayed ACK
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+
+    Conn *conn = (Conn *)calloc(1, sizeof(Conn));
+    snprintf(conn->host, HOST_SIZE, "%s", host);
+    conn->port = port;
+    conn->secure = tls != NULL;
+    conn->address = address;
+    conn->fd = fd;
+    conn->tls = tls;
+    conn->h2 = h2;
+    conn->max_streams = DEFAULT_MAX_STREAMS;
+    conn->next_id = 1;
+    conn->priorities = 1;
+    conn->hpack = hpack_alloc(HPACK_TABLE_SIZE);
+    conn->frame = (uint8_t *)malloc(MAX_FRAME_SIZE);
+    conn->block = (uint8_t *)malloc(MAX_FRAME_SIZE);
+    pthread_mutex_init(&conn->mutex_lock, NULL);
+    pthread_mutex_init(&conn->write_lock, NULL);
+
+    // No pushes, a wide window per stream and larger frames
+    settings[0] = 0; settings[1] = SETTINGS_ENABLE_PUSH;
+    put_uint32(settings + 2, 0);
+    settings[6] = 0; settings[7] = SETTINGS_INITIAL_WINDOW_SIZE;
+    put_uint32(settings + 8, h2->stream_window);
+    settings[12] = 0; settings[13] = SETTINGS_MAX_FRAME_SIZE;
+    put_uint32(settings + 14, MAX_FRAME_SIZE);
+
+    if (write_all(conn, PREFACE, strlen(PREFACE)) == -1 ||
+        send_frame(conn, FRAME_SETTINGS, 0, 0, settings, sizeof(settings)) == -1) {
+        hpack_free(conn->hpack);
+        pthread_mutex_destroy(&conn->mutex_lock);
+        pthread_mutex_destroy(&conn->write_lock);
+        free(conn->frame);
+        free(conn->block);
+        free(conn);
+        if (tls) {
+            tls_close(tls);
+        }
+        close(fd);
+        return NULL;
+    }
+    if (h2->conn_window > DEFAULT_WINDOW) {
+        window_update(conn, 0, h2->conn_window - DEFAULT_WINDOW);
+    }
+
+    if (pthread_create(&conn->reader, NULL, reader_thread, conn) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+    return conn;
+}
+
+
+/**
+ * Find a connection to the server with room for another stream and take
+ * a place on it, spreading streams over conns_per_host connections.
+ * Caller holds the transport's lock.
+ * @return conn - The connection, NULL if a new one is needed
+ */
+static Conn *take_stream(H2 *h2, const char *host, int port, int secure, int address) {
+    Conn *conn, *best = NULL;
+    int count = 0;
+
+    for (conn = h2->conns; conn; conn = conn->next) {
+        if (conn->dead || conn->port != port || conn->secure != secure || conn->address != address ||
+            strcmp(conn->host, host) != 0) {
+            continue;
+        }
+        ++count;
+        if (conn->num_streams < conn->max_streams && (!best || conn->num_streams < best->num_streams)) {
+            best = conn;
+        }
+    }
+
+    if (best && (best->num_streams == 0 || count >= h2->conns_per_host)) {
+        ++best->num_streams;
+        return best;
+    }
+    return NULL;
+}
+
+
+// Unlink the dead connections nothing uses any more. Caller holds the transport's lock.
+static Conn *unlink_dead(H2 *h2) {
+    Conn **link = &h2->conns, *dead = NULL;
+
+    while (*link) {
+        Conn *conn = *link;
+        if (conn->dead && conn->num_streams == 0) {
+            *link = conn->next;
+            conn->next = dead;
+            dead = conn;
+        }
+        else {
+            link = &conn->next;
+        }
+    }
+    return dead;
+}
+
+
+// As h2_available. Caller holds the transport's lock.
+static int available_locked(H2 *h2, const char *host, int port, int secure) {
+    Http1Host *http1;
+
+    if (!secure) {
+        return 1;       // h2c is spoken with prior knowledge
+    }
+    for (http1 = h2->http1; http1; http1 = http1->next) {
+        if (http1->port == port && strcmp(http1->host, host) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/**
+ * Whether requests to a server may go over HTTP/2. An https server that
+ * did not agree to h2 by ALPN is remembered, and h2_request fails for it
+ * from then on, so the caller asks it over HTTP/1 instead.
+ * @param h2 - Pointer to the transport
+ * @param host - The host name
+ * @param port - The port
+ * @param secure - Non zero for https
+ * @return int - 1 if HTTP/2 may be used, 0 if the server does not speak it
+ */
+int h2_available(H2 *h2, const char *host, int port, int secure) {
+    pthread_mutex_lock(&h2->mutex_lock);
+    int available = available_locked(h2, host, port, secure);
+    pthread_mutex_unlock(&h2->mutex_lock);
+    return available;
+}
+
+
+/**
+ * Take a place for a stream on a connection to the server, opening a new
+ * connection if none has room or there are fewer than conns_per_host
+ * @return conn - The connection, NULL if the server could not be reached
+ */
+static Conn *acquire(H2 *h2, const char *host, int port, int secure, int address) {
+    pthread_mutex_lock(&h2->mutex_lock);
+    Conn *conn = take_stream(h2, host, port, secure, address);
+    Conn *dead = unlink_dead(h2);
+    pthread_mutex_unlock(&h2->mutex_lock);
+
+    while (dead) {
+        Conn *next = dead->next;
+        free_conn(dead);
+        dead = next;
+    }
+    if (conn) {
+        return conn;
+    }
+
+    if (secure && !h2->tls) {
+        fprintf(stderr, "https is not enabled for HTTP/2\n");
+        return NULL;
+    }
+    if (!h2_available(h2, host, port, secure)) {
+        return NULL;
+    }
+
+    // Connect without the lock, a coroutine may yield in here
+    TlsConn *tls = NULL;
+    int fd = client_socket(host, port, address);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (secure && !(tls = tls_connect(h2->tls, fd, host, port, "h2"))) {
+        close(fd);
+        return NULL;
+    }
+    if (tls && strcmp(tls_protocol(tls), "h2") != 0) {
+        // Remembered, so later requests go over HTTP/1 without trying again
+        pthread_mutex_lock(&h2->mutex_lock);
+        if (available_locked(h2, host, port, secure)) {
+            Http1Host *http1 = (Http1Host *)calloc(1, sizeof(Http1Host));
+            snprintf(http1->host, HOST_SIZE, "%s", host);
+            http1->port = port;
+            http1->next = h2->http1;
+            h2->http1 = http1;
+            fprintf(stderr, "%s does not speak HTTP/2 over TLS, using HTTP/1\n", host);
+        }
+        pthread_mutex_unlock(&h2->mutex_lock);
+        tls_close(tls);
+        close(fd);
+        return NULL;
+    }
+
+    // Requests starting together each connect, all but the first use its connection
+    pthread_mutex_lock(&h2->mutex_lock);
+    if ((conn = take_stream(h2, host, port, secure, address))) {
+        pthread_mutex_unlock(&h2->mutex_lock);
+        if (tls) {
+            tls_close(tls);
+        }
+        close(fd);
+        return conn;
+    }
+    if ((conn = start_conn(h2, host, port, address, fd, tls))) {
+        conn->num_streams = 1;
+        conn->next = h2->conns;
+        h2->conns = conn;
+    }
+    pthread_mutex_unlock(&h2->mutex_lock);
+    return conn;
+}
+
+
+// Give back a place taken by acquire
+static void release(H2 *h2, Conn *conn) {
+    pthread_mutex_lock(&h2->mutex_lock);
+    --conn->num_streams;
+    pthread_mutex_unlock(&h2->mutex_lock);
+}
+
+
+/**
+ * Encode the request header block
+ * @return size_t - Length of the block, 0 if it did not fit
+ */
+static size_t encode_request(uint8_t *block, size_t size, const char *host, int port, int secure, const char *method,
+                             const char *page, const char **headers, int num_headers, int urgency) {
+    char authority[HOST_SIZE + 8], path[BLOCK_SIZE], priority[16];
+    size_t length = 0, part;
+    int i;
+
+    snprintf(authority, sizeof(authority), port == (secure ? 443 : 80) ? "%s" : "%s:%d", host, port);
+    snprintf(path, sizeof(path), "/%s", page);
+
+    const char *fields[] = { ":method", method, ":scheme", secure ? "https" : "http", ":authority", authority, ":path", path };
+    for (i = 0; i < 8; i += 2) {
+        if (!(part = hpack_encode(fields[i], fields[i + 1], block + length, size - length))) return 0;
+        length += part;
+    }
+    for (i = 0; i < num_headers * 2; i += 2) {
+        if (!(part = hpack_encode(headers[i], headers[i + 1], block + length, size - length))) return 0;
+        length += part;
+    }
+
+    // Extensible priorities, for servers that ignore the weight in the frame
+    if (urgency >= 0) {
+        snprintf(priority, sizeof(priority), "u=%d", urgency);
+        if (!(part = hpack_encode("priority", priority, block + length, size - length))) return 0;
+        length += part;
+    }
+    return length;
+}
+
+
+/**
+ * Make one attempt at a request
+ * @param retry - Set if it failed before any response arrived and may be retried
+ * @return Buffer - The response, NULL if there is none
+ */
+static Buffer *attempt(H2 *h2, const char *host, int port, int secure, const char *method, const char *page,
+                       const char **headers, int num_headers, HttpProgress *progress, int *retry) {
+    int address = progress ? progress->address : 0;
+    int weight = progress ? progress->weight : 0;
+    uint8_t block[5 + BLOCK_SIZE];
+    char byte;
+
+    *retry = 0;
+
+    // Weight 256 is the most urgent, 0 leaves the default
+    size_t length = encode_request(block + 5, BLOCK_SIZE, host, port, secure, method, page, headers, num_headers,
+        weight ? (256 - weight) * 8 / 257 : -1);
+    if (!length) {
+        fprintf(stderr, "request header too large for %s\n", host);
+        return NULL;
+    }
+
+    Conn *conn = acquire(h2, host, port, secure, address);
+    if (!conn) {
+        return NULL;
+    }
+
+    Stream *stream = (Stream *)calloc(1, sizeof(Stream));
+    stream->head = strcmp(method, "HEAD") == 0;
+    stream->progress = progress;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, stream->notify) == -1) {
+        perror("socketpair");
+        exit(1);
+    }
+
+    // Stream ids must go out in order, so they are taken under the write lock
+    pthread_mutex_lock(&conn->write_lock);
+    pthread_mutex_lock(&conn->mutex_lock);
+    stream->id = conn->next_id;
+    conn->next_id += 2;
+    stream->next = conn->streams;
+    conn->streams = stream;
+    int priorities = conn->priorities;
+    pthread_mutex_unlock(&conn->mutex_lock);
+
+    int flags = FLAG_END_HEADERS | FLAG_END_STREAM;    // Requests have no content
+    uint8_t *payload = block + 5;
+    if (weight && priorities) {
+        put_uint32(block, 0);           // Depends on no other stream
+        block[4] = weight - 1;
+        payload = block;
+        length += 5;
+        flags |= FLAG_PRIORITY;
+    }
+    int sent = write_frame(conn, FRAME_HEADERS, flags, stream->id, payload, length);
+    pthread_mutex_unlock(&conn->write_lock);
+
+    if (sent == -1) {
+        pthread_mutex_lock(&conn->mutex_lock);
+        end_stream(stream, STREAM_FAILED);
+        pthread_mutex_unlock(&conn->mutex_lock);
+    }
+
+    // Publish the notify socket so http_cancel can wake the wait
+    int cancelled = 0;
+    if (progress) {
+        pthread_mutex_lock(&progress->mutex_lock);
+        cancelled = progress->cancelled;
+        progress->fd = stream->notify[0];
+        pthread_mutex_unlock(&progress->mutex_lock);
+    }
+    if (!cancelled) {
+        coro_read(stream->notify[0], &byte, 1);     // Yields inside a coroutine
+    }
+    if (progress) {
+        pthread_mutex_lock(&progress->mutex_lock);
+        progress->fd = -1;
+        pthread_mutex_unlock(&progress->mutex_lock);
+    }
+
+    // Take the stream off the connection, resetting it if it was cancelled
+    pthread_mutex_lock(&conn->mutex_lock);
+    Stream **link = &conn->streams;
+    while (*link != stream) {
+        link = &(*link)->next;
+    }
+    *link = stream->next;
+    int reset = stream->state == STREAM_OPEN || stream->reset;
+    pthread_mutex_unlock(&conn->mutex_lock);
+
+    // Off the connection, so the reader ignores what still arrives for it
+    if (reset) {
+        uint8_t code[4];
+        put_uint32(code, ERROR_CANCEL);
+        send_frame(conn, FRAME_RST_STREAM, 0, stream->id, code, sizeof(code));
+    }
+    release(h2, conn);
+
+    close(stream->notify[0]);
+    close(stream->notify[1]);
+
+    Buffer *buffer = NULL;
+    if (stream->head_length) {
+        buffer = (Buffer *)malloc(sizeof(Buffer));
+        buffer->data = stream->data;
+        buffer->length = stream->length;
+        buffer->data[buffer->length] = '\0';
+    }
+    else {
+        *retry = stream->state == STREAM_FAILED && !(progress && progress->cancelled);
+        free(stream->data);
+    }
+    free(stream);
+    return buffer;
+}
+
+
+/**
+ * Make a request as a stream on a connection to the server, opening one
+ * if needed. The response is returned in the form of an HTTP/1 response,
+ * so http_get_status and http_get_content read it as they would any
+ * other. Once cancelled the stream is reset and what was received so far
+ * is returned.
+ * @param h2 - Pointer to the transport
+ * @param host - The host name
+ * @param port - The port
+ * @param secure - Non zero for https
+ * @param method - e.g. GET
+ * @param page - The path without its leading /
+ * @param headers - Names and values of further request headers, with
+ *                  names in lower case
+ * @param num_headers - The number of name and value pairs in headers
+ * @param progress - Progress of the request, or NULL. Its weight is used
+ *                   as the stream's priority.
+ * @return Buffer - The response, NULL if the server could not be reached
+ *                  or no response header arrived
+ */
+Buffer *h2_request(H2 *h2, const char *host, int port, int secure, const char *method, const char *page,
+                   const char **headers, int num_headers, HttpProgress *progress) {
+    int retry;
+    Buffer *buffer = attempt(h2, host, port, secure, method, page, headers, num_headers, progress, &retry);
+
+    // The connection closed or went away before the server answered, which
+    // an idle connection may do at any time
+    if (retry) {
+        buffer = attempt(h2, host, port, secure, method, page, headers, num_headers, progress, &retry);
+    }
+    return buffer;
+}
+
+
+/**
+ * Close every connection and free the transport. No request may be in
+ * flight.
+ * @param h2 - Pointer to the transport to free
+ */
+void h2_free(H2 *h2) {
+    while (h2->conns) {
+        Conn *conn = h2->conns;
+        h2->conns = conn->next;
+        free_conn(conn);
+    }
+    while (h2->http1) {
+        Http1Host *http1 = h2->http1;
+        h2->http1 = http1->next;
+        free(http1);
+    }
+    pthread_mutex_destroy(&h2->mutex_lock);
+    free(h2);
+}
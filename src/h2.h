@@ -0,0 +1,77 @@
+#ifndef H2_H
+#define H2_H
+
+#include <stdint.h>
+
+#include "http.h"
+
+
+/*
+ * H2 - an HTTP/2 transport, over cleartext TCP (h2c with prior knowledge)
+ * or over TLS for https, where the server must agree to h2 by ALPN. An
+ * https server that does not is asked over HTTP/1 instead, see
+ * h2_available.
+ * Requests to a server become streams multiplexed on one or a few
+ * connections to it, rather than a connection per request, so ranges share
+ * one congestion window that is already open. A thread per connection
+ * reads its frames and hands each stream its response.
+ */
+typedef struct H2Struct H2;
+
+
+/**
+ * Allocate an HTTP/2 transport
+ * @param conns_per_host - Connections a server's streams are spread over
+ * @param stream_window - Flow control window of each stream, in bytes
+ * @param conn_window - Flow control window of each connection, in bytes
+ * @param tls - The TLS context for https, see tls.h, or NULL
+ * @return h2 - Pointer to the allocated transport
+ */
+H2 *h2_alloc(int conns_per_host, int32_t stream_window, int32_t conn_window, Tls *tls);
+
+
+/**
+ * Close every connection and free the transport. No request may be in
+ * flight.
+ * @param h2 - Pointer to the transport to free
+ */
+void h2_free(H2 *h2);
+
+
+/**
+ * Whether requests to a server may go over HTTP/2. An https server that
+ * did not agree to h2 by ALPN is remembered, and h2_request fails for it
+ * from then on, so the caller asks it over HTTP/1 instead.
+ * @param h2 - Pointer to the transport
+ * @param host - The host name
+ * @param port - The port
+ * @param secure - Non zero for https
+ * @return int - 1 if HTTP/2 may be used, 0 if the server does not speak it
+ */
+int h2_available(H2 *h2, const char *host, int port, int secure);
+
+
+/**
+ * Make a request as a stream on a connection to the server, opening one
+ * if needed. The response is returned in the form of an HTTP/1 response,
+ * so http_get_status and http_get_content read it as they would any
+ * other. Once cancelled the stream is reset and what was received so far
+ * is returned.
+ * @param h2 - Pointer to the transport
+ * @param host - The host name
+ * @param port - The port
+ * @param secure - Non zero for https
+ * @param method - e.g. GET
+ * @param page - The path without its leading /
+ * @param headers - Names and values of further request headers, with
+ *                  names in lower case
+ * @param num_headers - The number of name and value pairs in headers
+ * @param progress - Progress of the request, or NULL. Its weight is used
+ *                   as the stream's priority.
+ * @return Buffer - The response, NULL if the server could not be reached
+ *                  or no response header arrived
+ */
+Buffer *h2_request(H2 *h2, const char *host, int port, int secure, const char *method, const char *page,
+                   const char **headers, int num_headers, HttpProgress *progress);
+
+#endif
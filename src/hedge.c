@@ -0,0 +1,136 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hedge.h"
+
+#define MIN_SAMPLES 2       // Rates needed before a median means anything
+
+
+/*
+ * Hedge - decides when a straggling range is worth downloading twice.
+ * Hidden from the outside, see hedge.h
+ */
+typedef struct HedgeStruct {
+    double max_extra;
+    double slow_factor;
+    double min_seconds;
+
+    int64_t planned;        // Bytes scheduled so far
+    int64_t extra;          // Bytes charged for duplicates so far
+
+    pthread_mutex_t mutex_lock;
+} Hedge;
+
+
+/**
+ * Allocate a hedging policy
+ * @param max_extra - Extra bytes allowed, as a share of the bytes planned
+ * @param slow_factor - A range slower than this share of the median is a straggler
+ * @param min_seconds - How long a range runs before its rate is judged
+ * @return hedge - Pointer to the allocated policy
+ */
+Hedge *hedge_alloc(double max_extra, double slow_factor, double min_seconds) {
+    Hedge *hedge = (Hedge *)calloc(1, sizeof(Hedge));
+    hedge->max_extra = max_extra;
+    hedge->slow_factor = slow_factor;
+    hedge->min_seconds = min_seconds;
+
+    pthread_mutex_init(&hedge->mutex_lock, NULL);
+    return hedge;
+}
+
+
+/**
+ * Free a hedging policy
+ * @param hedge - Pointer to the policy to free
+ */
+void hedge_free(Hedge *hedge) {
+    pthread_mutex_destroy(&hedge->mutex_lock);
+    free(hedge);
+}
+
+
+/**
+ * Record bytes scheduled for download, which grows the budget
+ * @param hedge - Pointer to the policy
+ * @param bytes - The number of bytes planned
+ */
+void hedge_planned(Hedge *hedge, int64_t bytes) {
+    pthread_mutex_lock(&hedge->mutex_lock);
+    hedge->planned += bytes;
+    pthread_mutex_unlock(&hedge->mutex_lock);
+}
+
+
+static int compare_rates(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+static double median(const double *rates, int num_rates) {
+    double *sorted = (double *)malloc(sizeof(double) * num_rates);
+    memcpy(sorted, rates, sizeof(double) * num_rates);
+    qsort(sorted, num_rates, sizeof(double), compare_rates);
+
+    double middle = num_rates % 2 ? sorted[num_rates / 2]
+        : (sorted[num_rates / 2 - 1] + sorted[num_rates / 2]) / 2;
+    free(sorted);
+    return middle;
+}
+
+
+/**
+ * Decide whether to hedge a range, charging the budget if so
+ * @param hedge - Pointer to the policy
+ * @param rate - The rate of the range in bytes/second
+ * @param rates - The rates of the ranges of its file, running or finished
+ * @param num_rates - The number of rates
+ * @param elapsed - Seconds since the range started
+ * @param remaining - Bytes of the range still to download
+ * @return int - 1 if the rest of the range should be requested again
+ */
+int hedge_decide(Hedge *hedge, double rate, const double *rates, int num_rates,
+                 double elapsed, int64_t remaining) {
+    int decided = 0;
+
+    if (elapsed < hedge->min_seconds || num_rates < MIN_SAMPLES || remaining <= 0) {
+        return 0;
+    }
+    if (rate >= hedge->slow_factor * median(rates, num_rates)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&hedge->mutex_lock);
+    if (hedge->extra + remaining <= hedge->max_extra * hedge->planned) {
+        hedge->extra += remaining;
+        decided = 1;
+    }
+    pthread_mutex_unlock(&hedge->mutex_lock);
+    return decided;
+}
+
+
+/**
+ * Give back the charge of a duplicate that was never sent
+ * @param hedge - Pointer to the policy
+ * @param bytes - The bytes charged for it
+ */
+void hedge_refund(Hedge *hedge, int64_t bytes) {
+    pthread_mutex_lock(&hedge->mutex_lock);
+    hedge->extra -= bytes;
+    pthread_mutex_unlock(&hedge->mutex_lock);
+}
+
+
+/**
+ * @param hedge - Pointer to the policy
+ * @return extra - The extra bytes charged so far
+ */
+int64_t hedge_extra(Hedge *hedge) {
+    pthread_mutex_lock(&hedge->mutex_lock);
+    int64_t extra = hedge->extra;
+    pthread_mutex_unlock(&hedge->mutex_lock);
+    return extra;
+}
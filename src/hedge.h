@@ -0,0 +1,71 @@
+#ifndef HEDGE_H
+#define HEDGE_H
+
+#include <stdint.h>
+
+
+/*
+ * Hedge - decides when a straggling range is worth downloading twice.
+ * Once a file has nothing left to schedule, a range whose rate has fallen
+ * well below the median rate of the file's ranges is hedged: the rest of
+ * it is requested again on another connection and whichever copy finishes
+ * first is kept. Every duplicate is charged against a budget of extra
+ * bytes, a share of the bytes planned so far.
+ */
+typedef struct HedgeStruct Hedge;
+
+
+/**
+ * Allocate a hedging policy
+ * @param max_extra - Extra bytes allowed, as a share of the bytes planned
+ * @param slow_factor - A range slower than this share of the median is a straggler
+ * @param min_seconds - How long a range runs before its rate is judged
+ * @return hedge - Pointer to the allocated policy
+ */
+Hedge *hedge_alloc(double max_extra, double slow_factor, double min_seconds);
+
+
+/**
+ * Free a hedging policy
+ * @param hedge - Pointer to the policy to free
+ */
+void hedge_free(Hedge *hedge);
+
+
+/**
+ * Record bytes scheduled for download, which grows the budget
+ * @param hedge - Pointer to the policy
+ * @param bytes - The number of bytes planned
+ */
+void hedge_planned(Hedge *hedge, int64_t bytes);
+
+
+/**
+ * Decide whether to hedge a range, charging the budget if so
+ * @param hedge - Pointer to the policy
+ * @param rate - The rate of the range in bytes/second
+ * @param rates - The rates of the ranges of its file, running or finished
+ * @param num_rates - The number of rates
+ * @param elapsed - Seconds since the range started
+ * @param remaining - Bytes of the range still to download
+ * @return int - 1 if the rest of the range should be requested again
+ */
+int hedge_decide(Hedge *hedge, double rate, const double *rates, int num_rates,
+                 double elapsed, int64_t remaining);
+
+
+/**
+ * Give back the charge of a duplicate that was never sent
+ * @param hedge - Pointer to the policy
+ * @param bytes - The bytes charged for it
+ */
+void hedge_refund(Hedge *hedge, int64_t bytes);
+
+
+/**
+ * @param hedge - Pointer to the policy
+ * @return extra - The extra bytes charged so far
+ */
+int64_t hedge_extra(Hedge *hedge);
+
+#endif
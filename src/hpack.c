@@ -0,0 +1,481 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hpack.h"
+
+#define STATIC_ENTRIES 61
+#define ENTRY_OVERHEAD 32       // Counted for every dynamic table entry, see RFC 7541 4.1
+#define HUFFMAN_NODES 512
+
+
+// The static table, see RFC 7541 Appendix A
+static const char *static_table[][2] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+
+// The Huffman code, see RFC 7541 Appendix B. EOS is left out, it must
+// never appear in a string.
+static const uint32_t huffman_codes[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+
+static const uint8_t huffman_lengths[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+
+// A dynamic table entry
+typedef struct {
+    char *name;
+    char *value;
+} Field;
+
+
+/*
+ * Hpack - the decoding side of HPACK header compression.
+ * Hidden from the outside, see hpack.h
+ */
+typedef struct HpackStruct {
+    Field *fields;          // Newest first
+    int num_fields;
+    int capacity;
+    size_t size;            // Size of the entries as RFC 7541 counts it
+    size_t max_size;        // Set by the peer's encoder
+    size_t max_table_size;  // The most the encoder may set
+} Hpack;
+
+
+// Children of the decoding tree's nodes, a leaf is -(symbol + 1) and
+// 0 no child at all. Built once from the code table.
+static int16_t huffman_tree[HUFFMAN_NODES][2];
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+
+static void build_huffman_tree(void) {
+    int symbol, bit, num_nodes = 1;
+
+    for (symbol = 0; symbol < 256; ++symbol) {
+        uint32_t code = huffman_codes[symbol];
+        int node = 0;
+
+        for (bit = huffman_lengths[symbol] - 1; bit > 0; --bit) {
+            int branch = (code >> bit) & 1;
+            if (!huffman_tree[node][branch]) {
+                huffman_tree[node][branch] = num_nodes++;
+            }
+            node = huffman_tree[node][branch];
+        }
+        huffman_tree[node][code & 1] = -(symbol + 1);
+    }
+}
+
+
+/**
+ * Allocate a decoder
+ * @param max_table_size - The largest dynamic table the peer may ask for,
+ *                         as sent in SETTINGS_HEADER_TABLE_SIZE
+ * @return hpack - Pointer to the allocated decoder
+ */
+Hpack *hpack_alloc(size_t max_table_size) {
+    pthread_once(&huffman_once, build_huffman_tree);
+
+    Hpack *hpack = (Hpack *)calloc(1, sizeof(Hpack));
+    hpack->max_size = max_table_size;
+    hpack->max_table_size = max_table_size;
+    return hpack;
+}
+
+
+// Drop the oldest entries until the table fits in limit
+static void evict(Hpack *hpack, size_t limit) {
+    while (hpack->size > limit) {
+        Field *oldest = &hpack->fields[--hpack->num_fields];
+        hpack->size -= strlen(oldest->name) + strlen(oldest->value) + ENTRY_OVERHEAD;
+        free(oldest->name);
+        free(oldest->value);
+    }
+}
+
+
+/**
+ * Free a decoder
+ * @param hpack - Pointer to the decoder to free
+ */
+void hpack_free(Hpack *hpack) {
+    evict(hpack, 0);
+    free(hpack->fields);
+    free(hpack);
+}
+
+
+// Add a field to the dynamic table, which takes the strings
+static void insert(Hpack *hpack, char *name, char *value) {
+    size_t size = strlen(name) + strlen(value) + ENTRY_OVERHEAD;
+
+    if (size > hpack->max_size) {
+        evict(hpack, 0);        // Too big for the table, which ends up empty
+        free(name);
+        free(value);
+        return;
+    }
+    evict(hpack, hpack->max_size - size);
+
+    if (hpack->num_fields == hpack->capacity) {
+        hpack->capacity = hpack->capacity ? hpack->capacity * 2 : 16;
+        hpack->fields = (Field *)realloc(hpack->fields, sizeof(Field) * hpack->capacity);
+    }
+    memmove(hpack->fields + 1, hpack->fields, sizeof(Field) * hpack->num_fields);
+    hpack->fields[0].name = name;
+    hpack->fields[0].value = value;
+    ++hpack->num_fields;
+    hpack->size += size;
+}
+
+
+// The field at a static or dynamic table index, -1 if there is none
+static int lookup(Hpack *hpack, size_t index, const char **name, const char **value) {
+    if (index >= 1 && index <= STATIC_ENTRIES) {
+        *name = static_table[index - 1][0];
+        *value = static_table[index - 1][1];
+        return 0;
+    }
+    if (index > STATIC_ENTRIES && index <= STATIC_ENTRIES + (size_t)hpack->num_fields) {
+        *name = hpack->fields[index - STATIC_ENTRIES - 1].name;
+        *value = hpack->fields[index - STATIC_ENTRIES - 1].value;
+        return 0;
+    }
+    return -1;
+}
+
+
+// Read an integer with a prefix of the given number of bits, see RFC 7541 5.1
+static int decode_integer(const uint8_t **pos, const uint8_t *end, int prefix, size_t *value) {
+    const uint8_t *p = *pos;
+    size_t max = (1 << prefix) - 1;
+    int shift = 0;
+    uint8_t byte;
+
+    if (p >= end) {
+        return -1;
+    }
+    *value = *p++ & max;
+    if (*value == max) {
+        do {
+            if (p >= end || shift > 28) {
+                return -1;      // Truncated, or larger than any sane length
+            }
+            byte = *p++;
+            *value += (size_t)(byte & 0x7f) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+    }
+    *pos = p;
+    return 0;
+}
+
+
+// Decode a Huffman coded string, NULL if the coding is invalid
+static char *huffman_decode(const uint8_t *data, size_t length) {
+    char *out = (char *)malloc(length * 8 / 5 + 1);     // The shortest code has 5 bits
+    size_t num_chars = 0, i;
+    int node = 0, depth = 0, ones = 1;
+
+    for (i = 0; i < length; ++i) {
+        int bit;
+        for (bit = 7; bit >= 0; --bit) {
+            int branch = (data[i] >> bit) & 1;
+            int child = huffman_tree[node][branch];
+
+            if (child < 0) {
+                out[num_chars++] = -child - 1;
+                node = depth = 0;
+                ones = 1;
+            }
+            else if (child == 0) {
+                free(out);      // EOS, or no code at all
+                return NULL;
+            }
+            else {
+                node = child;
+                ++depth;
+                ones &= branch;
+            }
+        }
+    }
+
+    // What is left must be padding, the start of EOS and under a byte
+    if (depth > 7 || !ones) {
+        free(out);
+        return NULL;
+    }
+    out[num_chars] = '\0';
+    return out;
+}
+
+
+// Read a string literal, see RFC 7541 5.2. NULL if it is invalid.
+static char *decode_string(const uint8_t **pos, const uint8_t *end) {
+    size_t length;
+
+    if (*pos >= end) {
+        return NULL;
+    }
+    int huffman = **pos & 0x80;
+    if (decode_integer(pos, end, 7, &length) == -1 || length > (size_t)(end - *pos)) {
+        return NULL;
+    }
+
+    char *string = huffman ? huffman_decode(*pos, length) : strndup((const char *)*pos, length);
+    *pos += length;
+    return string;
+}
+
+
+/**
+ * Decode a complete header block, calling emit for each field in order.
+ * @param hpack - Pointer to the decoder
+ * @param block - The header block
+ * @param length - Length of the block
+ * @param emit - Called with the name and value of each field
+ * @param arg - Passed to emit
+ * @return int - 0 on success, -1 on a compression error, after which the
+ *               connection can not be used any more
+ */
+int hpack_decode(Hpack *hpack, const uint8_t *block, size_t length,
+                 void (*emit)(const char *name, const char *value, void *arg), void *arg) {
+    const uint8_t *pos = block, *end = block + length;
+    const char *name, *value;
+    size_t index;
+
+    while (pos < end) {
+        uint8_t first = *pos;
+
+        if (first & 0x80) {
+            // Indexed field
+            if (decode_integer(&pos, end, 7, &index) == -1 || lookup(hpack, index, &name, &value) == -1) {
+                return -1;
+            }
+            emit(name, value, arg);
+        }
+        else if ((first & 0xe0) == 0x20) {
+            // Dynamic table size update
+            if (decode_integer(&pos, end, 5, &index) == -1 || index > hpack->max_table_size) {
+                return -1;
+            }
+            hpack->max_size = index;
+            evict(hpack, index);
+        }
+        else {
+            // Literal, added to the table or not
+            int indexing = first & 0x40;
+            if (decode_integer(&pos, end, indexing ? 6 : 4, &index) == -1) {
+                return -1;
+            }
+
+            char *new_name;
+            if (index) {
+                if (lookup(hpack, index, &name, &value) == -1) {
+                    return -1;
+                }
+                new_name = strdup(name);
+            }
+            else if (!(new_name = decode_string(&pos, end))) {
+                return -1;
+            }
+
+            char *new_value = decode_string(&pos, end);
+            if (!new_value) {
+                free(new_name);
+                return -1;
+            }
+
+            emit(new_name, new_value, arg);
+            if (indexing) {
+                insert(hpack, new_name, new_value);
+            }
+            else {
+                free(new_name);
+                free(new_value);
+            }
+        }
+    }
+    return 0;
+}
+
+
+// Write an integer with a prefix of the given number of bits, 0 if it did not fit
+static size_t encode_integer(size_t value, int prefix, uint8_t flags, uint8_t *out, size_t size) {
+    size_t max = (1 << prefix) - 1;
+    size_t written = 0;
+
+    if (size == 0) {
+        return 0;
+    }
+    if (value < max) {
+        out[written++] = flags | value;
+        return written;
+    }
+
+    out[written++] = flags | max;
+    value -= max;
+    while (value >= 0x80) {
+        if (written == size) return 0;
+        out[written++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    if (written == size) return 0;
+    out[written++] = value;
+    return written;
+}
+
+
+// Write a string literal without Huffman coding, 0 if it did not fit
+static size_t encode_string(const char *string, uint8_t *out, size_t size) {
+    size_t length = strlen(string);
+    size_t written = encode_integer(length, 7, 0, out, size);
+
+    if (!written || written + length > size) {
+        return 0;
+    }
+    memcpy(out + written, string, length);
+    return written + length;
+}
+
+
+/**
+ * Encode a header field as a literal that is never added to the dynamic
+ * table, naming it by its static table index where it has one
+ * @param name - The name, in lower case
+ * @param value - The value
+ * @param out - Where the encoding is written
+ * @param size - Room left at out
+ * @return size_t - Bytes written, 0 if it did not fit
+ */
+size_t hpack_encode(const char *name, const char *value, uint8_t *out, size_t size) {
+    size_t index = 0, written, part;
+
+    for (index = STATIC_ENTRIES; index > 0; --index) {
+        if (strcmp(static_table[index - 1][0], name) == 0) break;
+    }
+
+    // Literal without indexing, with an indexed or a new name
+    if (!(written = encode_integer(index, 4, 0x00, out, size))) {
+        return 0;
+    }
+    if (!index) {
+        if (!(part = encode_string(name, out + written, size - written))) return 0;
+        written += part;
+    }
+    if (!(part = encode_string(value, out + written, size - written))) {
+        return 0;
+    }
+    return written + part;
+}
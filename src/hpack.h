@@ -0,0 +1,61 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HPACK_TABLE_SIZE 4096   // Dynamic table size until a peer sets another
+
+
+/*
+ * Hpack - the decoding side of HPACK header compression (RFC 7541) for
+ * one HTTP/2 connection. Header blocks must be decoded in the order they
+ * arrive, as each may change the dynamic table the next ones refer to.
+ * Requests are encoded without the dynamic table, so encoding needs no
+ * state.
+ */
+typedef struct HpackStruct Hpack;
+
+
+/**
+ * Allocate a decoder
+ * @param max_table_size - The largest dynamic table the peer may ask for,
+ *                         as sent in SETTINGS_HEADER_TABLE_SIZE
+ * @return hpack - Pointer to the allocated decoder
+ */
+Hpack *hpack_alloc(size_t max_table_size);
+
+
+/**
+ * Free a decoder
+ * @param hpack - Pointer to the decoder to free
+ */
+void hpack_free(Hpack *hpack);
+
+
+/**
+ * Decode a complete header block, calling emit for each field in order.
+ * @param hpack - Pointer to the decoder
+ * @param block - The header block
+ * @param length - Length of the block
+ * @param emit - Called with the name and value of each field
+ * @param arg - Passed to emit
+ * @return int - 0 on success, -1 on a compression error, after which the
+ *               connection can not be used any more
+ */
+int hpack_decode(Hpack *hpack, const uint8_t *block, size_t length,
+                 void (*emit)(const char *name, const char *value, void *arg), void *arg);
+
+
+/**
+ * Encode a header field as a literal that is never added to the dynamic
+ * table, naming it by its static table index where it has one
+ * @param name - The name, in lower case
+ * @param value - The value
+ * @param out - Where the encoding is written
+ * @param size - Room left at out
+ * @return size_t - Bytes written, 0 if it did not fit
+ */
+size_t hpack_encode(const char *name, const char *value, uint8_t *out, size_t size);
+
+#endif
@@ -4,24 +4,63 @@
 #include <stdlib.h>
 #include <netdb.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <assert.h>
 
 #include "http.h"
+#include "coro.h"
+#include "pool.h"
+#include "h2.h"
+#include "tls.h"
 
 #define BUF_SIZE 1024
+#define MAX_RESERVE (16 * 1024 * 1024)  // Most content allocated ahead on the server's word
 
-int client_socket(char *host, char *addrport_string) // Execute socket() and connect() and return the socket ID
+static Pool *pool = NULL;       // Keeps connections between requests, see http_use_pool
+static H2 *h2 = NULL;           // Carries requests over HTTP/2, see http_use_h2
+static Tls *tls = NULL;         // Makes https:// URLs possible, see http_use_tls
+
+
+/**
+ * Connect to the address-th address of host, wrapping around if it has fewer.
+ * Addresses are resolved through the pool when there is one.
+ * @return int - The socket ID, or -1 on failure
+ */
+int client_socket(const char *host, int port, int address)
 {
-    struct addrinfo their_addrinfo;         // Server address info
-    struct addrinfo *their_addr = NULL;     // Connector's address information
-    memset(&their_addrinfo, 0, sizeof(struct addrinfo));    //  Zero inf
-    their_addrinfo.ai_family = AF_INET;         // Use an internet address
-    their_addrinfo.ai_socktype = SOCK_STREAM;   // Use TCP rather than datagram
-     if ((getaddrinfo(host, addrport_string, &their_addrinfo, &their_addr)) == -1)  //  Get IP address information
-    {
-        perror("AddressInf Error");  // IP address error check
-        exit(1);
+    struct sockaddr_storage addr;           // Server address
+    socklen_t addrlen;
+
+    if (pool) {
+        if (pool_resolve(pool, host, port, address, &addr, &addrlen) == -1) {
+            fprintf(stderr, "could not resolve %s\n", host);
+            return -1;
+        }
+    }
+    else {
+        struct addrinfo their_addrinfo;         // Server address info
+        struct addrinfo *their_addr = NULL;     // Connector's address information
+        char addrport_string[12];
+        sprintf(addrport_string, "%d", port);   // Address Port
+
+        memset(&their_addrinfo, 0, sizeof(struct addrinfo));    //  Zero inf
+        their_addrinfo.ai_family = AF_INET;         // Use an internet address
+        their_addrinfo.ai_socktype = SOCK_STREAM;   // Use TCP rather than datagram
+        if (getaddrinfo(host, addrport_string, &their_addrinfo, &their_addr) != 0)  //  Get IP address information
+        {
+            fprintf(stderr, "could not resolve %s\n", host);
+            return -1;
+        }
+
+        struct addrinfo *chosen;
+        int count = 0;
+        for (chosen = their_addr; chosen; chosen = chosen->ai_next) ++count;
+        for (chosen = their_addr, address %= count; address > 0; --address) chosen = chosen->ai_next;
+
+        memcpy(&addr, chosen->ai_addr, chosen->ai_addrlen);
+        addrlen = chosen->ai_addrlen;
+        freeaddrinfo(their_addr);
     }
 
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);  // Socket descriptor with IPV4, TCP
@@ -31,18 +70,348 @@ int client_socket(char *host, char *addrport_string) // Execute socket() and con
         exit(1);
     }
 
-    if (connect(sockfd, their_addr->ai_addr, their_addr->ai_addrlen)  == -1)    // Connect to their IP adress (Server)
+    if (coro_connect(sockfd, (struct sockaddr *)&addr, addrlen)  == -1)    // Connect to their IP adress (Server), yields inside a coroutine
     {
         perror("Connect Error");    // Connection error check
-        exit(1);
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+// Length of the header block including the blank line, 0 if incomplete
+static size_t header_end(const char *data, size_t length) {
+    size_t i;
+    for (i = 3; i < length; ++i) {
+        if (data[i] == '\n' && data[i - 1] == '\r' && data[i - 2] == '\n' && data[i - 3] == '\r') {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * Work out where a response ends from its header block, if the server
+ * keeps the connection alive. Without keep-alive it ends when the server
+ * closes the connection.
+ * @return size_t - Length of the whole response, 0 if it runs to the close
+ */
+static size_t response_end(const char *data, size_t header_length, int head) {
+    char *headers = strndup(data, header_length);
+    char value[HEADER_SIZE];
+    size_t end = 0;
+
+    if (http_header(headers, "Connection", value, sizeof(value)) == 0 && strcasecmp(value, "keep-alive") == 0) {
+        if (head) {
+            end = header_length;        // A HEAD response never has content
+        }
+        else if (http_header(headers, "Content-Length", value, sizeof(value)) == 0) {
+            end = header_length + strtoll(value, NULL, 10);
+        }
+    }
+    free(headers);
+    return end;
+}
+
+
+// Read from a connection, through TLS if it has it
+static ssize_t conn_read(int sockfd, TlsConn *conn, void *buf, size_t count) {
+    return conn ? tls_read(conn, buf, count) : coro_read(sockfd, buf, count);
+}
+
+
+// Write to a connection, through TLS if it has it
+static ssize_t conn_write(int sockfd, TlsConn *conn, const void *buf, size_t count) {
+    return conn ? tls_write(conn, buf, count) : coro_write(sockfd, buf, count);
+}
+
+
+// Close a connection and its TLS, if it has it
+static void conn_close(int sockfd, TlsConn *conn) {
+    if (conn) {
+        tls_close(conn);
     }
+    close(sockfd);
+}
 
-    //Clean up and close everything
-    freeaddrinfo(their_addr);
 
+/**
+ * Connect to a server, over TLS if secure is set
+ * @param conn - Set to the TLS of the connection, NULL for a plain one
+ * @return int - The socket ID, or -1 on failure
+ */
+static int open_conn(const char *host, int port, int secure, int address, TlsConn **conn) {
+    *conn = NULL;
+    if (secure && !tls) {
+        fprintf(stderr, "https is not enabled, see http_use_tls\n");
+        return -1;
+    }
+
+    int sockfd = client_socket(host, port, address);
+    if (sockfd == -1 || !secure) {
+        return sockfd;
+    }
+    if (!(*conn = tls_connect(tls, sockfd, host, port, "http/1.1"))) {
+        close(sockfd);
+        return -1;
+    }
     return sockfd;
 }
 
+
+// Grow a response buffer to capacity bytes, -1 if there is not enough memory
+static int resize(Buffer *buffer, size_t capacity) {
+    char *data = (char *)realloc(buffer->data, capacity + 1);     // Room for a null byte
+    if (!data) {
+        fprintf(stderr, "out of memory for a %zu byte response\n", capacity);
+        return -1;
+    }
+    buffer->data = data;
+    return 0;
+}
+
+
+/**
+ * Send a request and read its response, over an idle pooled connection
+ * to the server if there is one. A pooled connection the server has
+ * closed meanwhile is replaced by a new one. If the server keeps the
+ * connection alive it goes back to the pool once the response is read.
+ * Content goes to the progress's sink instead of the buffer if it has one.
+ * @param host - The host name
+ * @param port - The port
+ * @param secure - Non zero to use TLS
+ * @param request - The request
+ * @param request_length - Length of the request
+ * @param head - Non zero for a HEAD request, whose response has no content
+ * @param progress - Progress of the query, or NULL
+ * @return Buffer - The response, NULL if no connection could be made, the
+ *                  query was cancelled before it started or there was not
+ *                  enough memory for the response
+ */
+static Buffer *exchange(const char *host, int port, int secure, const char *request, size_t request_length,
+                        int head, HttpProgress *progress) {
+    int address = progress ? progress->address : 0;
+    HttpSink sink = progress ? progress->sink : NULL;
+    int attempt;
+
+    for (attempt = 0; attempt < 2; ++attempt) {
+        TlsConn *conn = NULL;
+        int sockfd = pool && attempt == 0 ? pool_get(pool, host, port, address, secure ? &conn : NULL) : -1;
+        int reused = sockfd != -1;
+
+        if (!reused && (sockfd = open_conn(host, port, secure, address, &conn)) == -1) {
+            return NULL;
+        }
+
+        Buffer* buffer = (Buffer *)calloc(1, sizeof(Buffer));  //  Allocate memory for the buffer
+        size_t capacity = BUF_SIZE;
+        if (!buffer || resize(buffer, capacity) == -1) {
+            free(buffer);
+            conn_close(sockfd, conn);
+            return NULL;
+        }
+
+        // Publish the socket so http_cancel can wake reads on it
+        if (progress) {
+            pthread_mutex_lock(&progress->mutex_lock);
+            if (progress->cancelled) {
+                pthread_mutex_unlock(&progress->mutex_lock);
+                conn_close(sockfd, conn);
+                buffer_free(buffer);
+                return NULL;
+            }
+            progress->fd = sockfd;
+            pthread_mutex_unlock(&progress->mutex_lock);
+        }
+
+        size_t recvd_file = 0;                  //  Record total received data
+        size_t header_length = 0;              //  Known once the end of the header arrived
+        size_t end = 0;                         //  Known if the server keeps the connection alive
+        size_t sunk = 0;                        //  Content handed to the sink, no longer in the buffer
+        char *header = NULL;                    //  The header block for the sink
+        int failed = 0;                         //  Set if the response did not fit in memory
+
+        if (conn_write(sockfd, conn, request, request_length) == request_length) {
+            while (!end || recvd_file + sunk < end)     //  Looping recieve data
+            {
+                if (recvd_file == capacity)     //  Full, double it as ranges may be many megabytes
+                {
+                    capacity *= 2;
+                    if ((failed = resize(buffer, capacity) == -1)) break;
+                }
+
+                // Never read past the response, the connection may be reused
+                size_t wanted = end ? end - recvd_file - sunk : capacity - recvd_file;
+                if (wanted > capacity - recvd_file) wanted = capacity - recvd_file;
+
+                ssize_t num_bytes = conn_read(sockfd, conn, buffer->data + recvd_file, wanted);  // Record the number of bytes
+                if (num_bytes <= 0) break;      //  Break loop, if no more data recieved
+                recvd_file += num_bytes;
+
+                if (!header_length && (header_length = header_end(buffer->data, recvd_file))) {
+                    end = pool ? response_end(buffer->data, header_length, head) : 0;
+                    if (sink) {
+                        header = strndup(buffer->data, header_length);
+                    }
+                    else if (end > capacity && capacity < MAX_RESERVE) {
+                        //  Make room for the whole response at once, but not more than
+                        //  MAX_RESERVE ahead of it arriving
+                        capacity = end < MAX_RESERVE ? end : MAX_RESERVE;
+                        if ((failed = resize(buffer, capacity) == -1)) break;
+                    }
+                }
+                if (progress) {
+                    if (header_length) {
+                        __atomic_store_n(&progress->received, (int64_t)(recvd_file + sunk - header_length), __ATOMIC_RELAXED);
+                    }
+                    if (header) {
+                        // Hand the content on and reuse its room
+                        int stop = sink(header, buffer->data + header_length, recvd_file - header_length, progress->sink_arg);
+                        sunk += recvd_file - header_length;
+                        recvd_file = header_length;
+                        if (stop == -1) break;
+                    }
+                    if (__atomic_load_n(&progress->cancelled, __ATOMIC_RELAXED)) break;
+                }
+            }
+        }
+
+        buffer->length = recvd_file;  // Updata the final length
+        buffer->data[recvd_file] = '\0';
+        free(header);
+
+        int cancelled = 0;
+        if (progress) {
+            pthread_mutex_lock(&progress->mutex_lock);
+            progress->fd = -1;
+            cancelled = progress->cancelled;
+            pthread_mutex_unlock(&progress->mutex_lock);
+        }
+
+        if (failed) {
+            conn_close(sockfd, conn);
+            buffer_free(buffer);
+            return NULL;
+        }
+
+        if (reused && recvd_file == 0 && !cancelled) {
+            // The server closed it while it was idle, try a new connection
+            conn_close(sockfd, conn);
+            buffer_free(buffer);
+            continue;
+        }
+
+        if (end && recvd_file + sunk == end && !cancelled) {
+            pool_put(pool, host, port, address, sockfd, conn);
+        }
+        else {
+            conn_close(sockfd, conn);
+        }
+        return buffer;
+    }
+    return NULL;
+}
+
+
+/**
+ * Use a pool to keep connections and resolved addresses between requests.
+ * Requests then ask the server to keep the connection alive, and a
+ * connection goes back to the pool once its response is read in full.
+ * @param new_pool - The pool, or NULL to open a connection per request
+ */
+void http_use_pool(Pool *new_pool) {
+    pool = new_pool;
+}
+
+
+/**
+ * Make requests over HTTP/2 instead, as streams on shared connections.
+ * @param new_h2 - The transport, see h2.h, or NULL for HTTP/1.0
+ */
+void http_use_h2(H2 *new_h2) {
+    h2 = new_h2;
+}
+
+
+/**
+ * Make https:// URLs possible, as requests over TLS
+ * @param new_tls - The TLS context, see tls.h, or NULL
+ */
+void http_use_tls(Tls *new_tls) {
+    tls = new_tls;
+}
+
+
+/**
+ * Split a URL into host, port and page
+ * @param url - e.g. www.canterbury.ac.nz:8080/index.html, optionally
+ *              starting with http:// or https://. The port is 80, or 443
+ *              for https, if it has none.
+ * @param host - Buffer of size bytes receiving the host, then the page
+ * @param page - Set to the page, without its leading /
+ * @param port - Set to the port
+ * @param secure - Set for an https:// URL
+ * @return int - 0 on success, -1 if there is no page
+ */
+static int split_url(const char *url, char *host, size_t size, char **page, int *port, int *secure) {
+    *secure = strncasecmp(url, "https://", 8) == 0;
+    if (*secure) {
+        url += 8;
+    }
+    else if (strncasecmp(url, "http://", 7) == 0) {
+        url += 7;
+    }
+    snprintf(host, size, "%s", url);
+
+    *page = strchr(host, '/');
+    if (!*page) {
+        fprintf(stderr, "could not split url into host/page %s\n", url);
+        return -1;
+    }
+    *(*page)++ = '\0';
+
+    char *colon = strchr(host, ':');
+    *port = *secure ? 443 : 80;
+    if (colon) {
+        *colon = '\0';
+        *port = atoi(colon + 1);
+    }
+    return 0;
+}
+
+
+// Query a range of a page, over TLS if secure is set, see http_query_progress
+static Buffer *query(const char *host, const char *page, const char *range, int port, int secure,
+                     HttpProgress *progress) {
+    Buffer *response;
+
+    // A range may list many ranges, so size the request to it
+    if (h2 && h2_available(h2, host, port, secure)) {
+        char *value = (char *)malloc(strlen(range) + 7);
+        sprintf(value, "bytes=%s", range);
+        const char *headers[] = { "range", value, "user-agent", "getter" };
+        response = h2_request(h2, host, port, secure, "GET", page, headers, 2, progress);
+        free(value);
+
+        // A server that turned out not to speak HTTP/2 is asked below
+        if (response || h2_available(h2, host, port, secure)) {
+            return response;
+        }
+    }
+
+    size_t size = strlen(page) + strlen(host) + strlen(range) + BUF_SIZE;
+    char *request = (char *)malloc(size);
+    int length = snprintf(request, size, "GET /%s HTTP/1.0\r\nHost: %s\r\nRange: bytes=%s\r\nUser-Agent: getter\r\n%s\r\n",
+        page, host, range, pool ? "Connection: keep-alive\r\n" : ""); // HTTP Header
+
+    response = exchange(host, port, secure, request, length, 0, progress);
+    free(request);
+    return response;
+}
+
+
 /**
  * Perform an HTTP 1.0 query to a given host and page and port number.
  * host is a hostname and page is a path on the remote server. The query
@@ -58,43 +427,25 @@ int client_socket(char *host, char *addrport_string) // Execute socket() and con
  */
 
 Buffer* http_query(char *host, char *page, const char *range, int port) {
+    return http_query_progress(host, page, range, port, NULL);
+}
 
-    Buffer* buffer = (Buffer *)malloc(sizeof(Buffer));  //  Allocate memory for the buffer
-    buffer->data = (char *)calloc(BUF_SIZE, sizeof(char));
-    buffer->length = BUF_SIZE;
-
-    char addrport_string[12];
-    sprintf(addrport_string, "%d", port);       //  Address Port
-
-    int sockfd = client_socket(host, addrport_string);
-
-    int received_buffer_strlen = BUF_SIZE;         //   Maximum Buffer size for Recieve data
-    char* received_buffer = (char *)calloc(received_buffer_strlen, sizeof(char));  //   Allocated space for Recieved data
-    sprintf(received_buffer, "GET /%s HTTP/1.0\r\nHost: %s\r\nRange: bytes=%s\r\nUser-Agent: getter\r\n\r\n", page, host, range); // HTTP Header
-    write(sockfd, received_buffer, received_buffer_strlen);         //  Send the recieved Buffer to Server
-
-    int recvd_file = 0;                     //  Record total received data
-    while(1)    //  Looping recieve data
-    {
-
-        if (recvd_file > buffer->length - BUF_SIZE)    //  The size of recved_file larger then buffer length need to add extra 1024
-        {
-            buffer->length += BUF_SIZE;                 // Add 1024
-            buffer->data = realloc(buffer->data, buffer->length); //  Realloc space for buffer context
-        }
-
-        int num_bytes = read(sockfd, buffer->data + recvd_file, BUF_SIZE);  // Record the number of bytes
-        if (num_bytes == 0) break;      //  Break loop, if no more data recieved
-        recvd_file += num_bytes;
-    }
-
-    buffer->length = recvd_file;  // Updata the final length
-
-    //Clean up and Close everything
-    close(sockfd);
-    free(received_buffer);
 
-    return buffer;
+/**
+ * Perform an HTTP 1.0 query as http_query does, reporting progress as
+ * content arrives. Once cancelled the query stops and returns what it
+ * received so far.
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param page - e.g. /index.html
+ * @param range - Byte range e.g. 0-500. NOTE: A server may not respect this
+ * @param port - e.g. 80
+ * @param progress - Progress of the query, or NULL
+ * @return Buffer - Pointer to a buffer holding response data from query
+ *                  NULL is returned on failure or if it was cancelled
+ *                  before connecting.
+ */
+Buffer* http_query_progress(char *host, char *page, const char *range, int port, HttpProgress *progress) {
+    return query(host, page, range, port, 0, progress);
 }
 
 
@@ -119,86 +470,387 @@ char* http_get_content(Buffer *response) {
 }
 
 
+/**
+ * Read the status code from the status line of an http response.
+ * @param response - Buffer containing the HTTP response
+ * @return int - The status code e.g. 206, or -1 if there is no status line
+ */
+int http_get_status(Buffer *response) {
+    int status;
+
+    if (response->length < 12 || strncmp(response->data, "HTTP/", 5) != 0) {
+        return -1;
+    }
+    if (sscanf(response->data, "HTTP/%*d.%*d %d", &status) != 1) {
+        return -1;
+    }
+    return status;
+}
+
+
 /**
  * Splits an HTTP url into host, page. On success, calls http_query
- * to execute the query against the url.
+ * to execute the query against the url, over TLS for an https:// url.
  * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
  * @param range - The desired byte range of data to retrieve from the page
  * @return Buffer pointer holding raw string data or NULL on failure
  */
 Buffer *http_url(const char *url, const char *range) {
+    return http_url_progress(url, range, NULL);
+}
+
+
+/**
+ * As http_url, reporting progress of the query, see http_query_progress
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
+ * @param range - The desired byte range of data to retrieve from the page
+ * @param progress - Progress of the query, or NULL
+ * @return Buffer pointer holding raw string data or NULL on failure
+ */
+Buffer *http_url_progress(const char *url, const char *range, HttpProgress *progress) {
     char host[BUF_SIZE];
-    strncpy(host, url, BUF_SIZE);
+    char *page;
+    int port, secure;
 
-    char *page = strstr(host, "/");
+    if (split_url(url, host, sizeof(host), &page, &port, &secure) == -1) {
+        return NULL;
+    }
+    return query(host, page, range, port, secure, progress);
+}
+
+
+/**
+ * Prepare the progress of a query not started yet
+ * @param progress - The progress to initialise
+ * @param address - Which of the host's addresses to connect to, wrapping
+ *                  around if it has fewer
+ */
+void http_progress_init(HttpProgress *progress, int address) {
+    progress->address = address;
+    progress->weight = 0;
+    progress->sink = NULL;
+    progress->sink_arg = NULL;
+    progress->received = 0;
+    progress->cancelled = 0;
+    progress->fd = -1;
+    pthread_mutex_init(&progress->mutex_lock, NULL);
+}
 
-    if (page) {
-        page[0] = '\0';
-        ++page;
 
-        return http_query(host, page, range, 80);
+/**
+ * Release what http_progress_init set up
+ * @param progress - The progress of a finished query
+ */
+void http_progress_destroy(HttpProgress *progress) {
+    pthread_mutex_destroy(&progress->mutex_lock);
+}
+
+
+/**
+ * Cancel a query, waking it if it is waiting for data
+ * @param progress - The progress of the query
+ */
+void http_cancel(HttpProgress *progress) {
+    pthread_mutex_lock(&progress->mutex_lock);
+    __atomic_store_n(&progress->cancelled, 1, __ATOMIC_RELAXED);
+    if (progress->fd != -1) {
+        shutdown(progress->fd, SHUT_RDWR);      // The read returns at once, the owner closes it
     }
-    else {
+    pthread_mutex_unlock(&progress->mutex_lock);
+}
 
-        fprintf(stderr, "could not split url into host/page %s\n", url);
-        return NULL;
+
+/**
+ * Copy the value of a header from the header block of a response
+ * @param headers - The header block, null terminated
+ * @param name - The header name e.g. Content-Range
+ * @param value - Set to the value
+ * @param size - Size of value
+ * @return int - 0 if the header was found, -1 otherwise
+ */
+int http_header(const char *headers, const char *name, char *value, size_t size) {
+    size_t name_len = strlen(name);
+    const char *line = headers;
+
+    while (line && *line) {
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char *start = line + name_len + 1;
+            while (*start == ' ' || *start == '\t') ++start;
+
+            size_t len = strcspn(start, "\r\n");
+            if (len >= size) len = size - 1;
+            memcpy(value, start, len);
+            value[len] = '\0';
+            return 0;
+        }
+        line = strstr(line, "\r\n");
+        if (line) line += 2;
     }
+    return -1;
 }
 
 
 /**
- * Makes a HEAD request to a given URL and gets the content length
- * Then determines max_chunk_size and number of split downloads needed
- * @param url   The URL of the resource to download
- * @param threads   The number of threads to be used for the download
- * @return int  The number of downloads needed satisfying max_chunk_size
- *              to download the resource
+ * Read the parts of a HEAD response http_head returns
+ * @param response - The response, freed here, or NULL on failure
+ * @param head - Filled in with the response
+ * @return int - The status code of the response or -1 on failure
  */
+static int read_head(Buffer *response, HttpHead *head) {
+    if (!response) {
+        return -1;
+    }
 
+    head->status = http_get_status(response);
 
+    char value[HEADER_SIZE];
+    if (http_header(response->data, "Content-Length", value, sizeof(value)) == 0) {
+        head->content_length = strtoll(value, NULL, 10);
+    }
+    http_header(response->data, "ETag", head->etag, sizeof(head->etag));
+    http_header(response->data, "Last-Modified", head->last_modified, sizeof(head->last_modified));
 
-int get_num_tasks(char *url, int threads) {
+    buffer_free(response);
+    return head->status;
+}
+
+
+/**
+ * Makes a HEAD request to a given URL and reads the status, the content
+ * length and the validators of the resource. If etag or last_modified are
+ * given the request is conditional, and a 304 status means the copy
+ * described by them is still current.
+ * @param url   The URL of the resource
+ * @param etag   ETag of a cached copy sent as If-None-Match, or NULL
+ * @param last_modified   Last-Modified of a cached copy sent as
+ *                        If-Modified-Since, or NULL
+ * @param head   Filled in with the response
+ * @return int  The status code of the response or -1 on failure
+ */
+int http_head(const char *url, const char *etag, const char *last_modified, HttpHead *head) {
     char host[BUF_SIZE];
-    strncpy(host, url, BUF_SIZE);   // Copy url pointer to host pointer
-    char *page = strstr(host, "/"); // Get Page form url
+    char *page;
+    int port, secure;
+    Buffer *response;
 
-    if (page) {
-        page[0] = '\0';
-        ++page;
+    memset(head, 0, sizeof(HttpHead));
+    head->status = -1;
 
-        int port = 80;
-        char addrport_string[12];
-        sprintf(addrport_string, "%d", port);                   // Address Port
-        int sockfd = client_socket(host, addrport_string);      // Call sockfd
-        int received_buffer_strlen = BUF_SIZE;                  // Maximum Buffer size for Recieve data
-        char* received_buffer = (char *)calloc(received_buffer_strlen, sizeof(char));  // Allocated space for Recieved data
-
-        sprintf(received_buffer, "HEAD /%s HTTP/1.0\r\nHOST: %s\r\nUser-Agent: getter\r\n\r\n", page, host);  // HTTP Header
-        write(sockfd, received_buffer, received_buffer_strlen);         // Send the recieved Buffer to Server
-
-        char recv_buffer[BUF_SIZE] = "\0";         // Received buffer from Server
-        int content_length = 0;                    // Recorded Content Length
-        int content_len = strlen("Content-Length:");
-        int num_bytes;                             // Record the number of bytes from Server
-        while (1) {         // Break loop, if no more data recieved
-            char *current_position = strstr(recv_buffer, "Content-Length:");  // Pointer for Content-Length's position
-            if (current_position) {
-                content_length = atoi(current_position + content_len);        // Pointer to Specific Number of Length
-            }
-            num_bytes = read(sockfd, recv_buffer, BUF_SIZE);       // Record the number of bytes from Server
-            if (num_bytes == 0) break;         // Break loop, if no more data recieved
+    if (split_url(url, host, sizeof(host), &page, &port, &secure) == -1) {
+        return -1;
+    }
+
+    if (h2 && h2_available(h2, host, port, secure)) {
+        const char *headers[6] = { "user-agent", "getter" };
+        int num_headers = 1;
+        if (etag && etag[0]) {
+            headers[2 * num_headers] = "if-none-match";
+            headers[2 * num_headers++ + 1] = etag;
+        }
+        if (last_modified && last_modified[0]) {
+            headers[2 * num_headers] = "if-modified-since";
+            headers[2 * num_headers++ + 1] = last_modified;
         }
-        max_chunk_size = content_length  / threads + 1 ;   // Max Chunk Size add extra 1 byte for just in case of losing bytes
+        response = h2_request(h2, host, port, secure, "HEAD", page, headers, num_headers, NULL);
+        if (response || h2_available(h2, host, port, secure)) {
+            return read_head(response, head);
+        }
+    }
 
-        //Clean up and Close everything
-        close(sockfd);
-        free(received_buffer);
-        return threads;
+    char request[3 * BUF_SIZE];
+    int length = snprintf(request, sizeof(request), "HEAD /%s HTTP/1.0\r\nHost: %s\r\nUser-Agent: getter\r\n", page, host);
+    if (etag && etag[0]) {
+        length += snprintf(request + length, sizeof(request) - length, "If-None-Match: %s\r\n", etag);
     }
-    return -1;
+    if (last_modified && last_modified[0]) {
+        length += snprintf(request + length, sizeof(request) - length, "If-Modified-Since: %s\r\n", last_modified);
+    }
+    if (pool) {
+        length += snprintf(request + length, sizeof(request) - length, "Connection: keep-alive\r\n");
+    }
+    length += snprintf(request + length, sizeof(request) - length, "\r\n");
+
+    response = exchange(host, port, secure, request, length, 1, NULL);     // A HEAD response is only headers
+    return read_head(response, head);
 }
 
 
-int get_max_chunk_size() {
-    return max_chunk_size;
+/**
+ * Plans how to split a resource into ranges. There are CHUNKS_PER_WORKER
+ * ranges for every worker where the size allows, but no range is larger
+ * than the worker's share of max_in_flight, so a resource of any size is
+ * fetched as many bounded ranges.
+ * @param content_length   The size of the resource to download, 0 if unknown
+ * @param workers   The number of ranges downloaded at once
+ * @param max_in_flight   Bytes of range data that may be held in memory at once
+ * @param chunk_size   Set to the size of every range but the last, which
+ *                     may be shorter. 0 if the length is unknown.
+ * @return int  The number of ranges
+ */
+int plan_chunks(int64_t content_length, int workers, int64_t max_in_flight, int64_t *chunk_size) {
+    if (content_length <= 0) {
+        *chunk_size = 0;        // Fetch it whole
+        return 1;
+    }
+    if (workers < 1) workers = 1;
+
+    int64_t size = content_length / ((int64_t)workers * CHUNKS_PER_WORKER);
+    int64_t largest = max_in_flight / workers;
+
+    if (size > largest) size = largest;
+    if (size < MIN_CHUNK_SIZE) size = MIN_CHUNK_SIZE;
+    if (size > content_length) size = content_length;
+
+    *chunk_size = size;
+    return (content_length + size - 1) / size;
+}
+
+
+/**
+ * Parse a list of byte ranges as a Range header gives them
+ * @param spec - e.g. 0-1023,4096-,-512
+ * @param ranges - Filled in with the ranges, see HttpRange
+ * @param max_ranges - Room in ranges
+ * @return int - The number of ranges, -1 if spec is malformed or too long
+ */
+int http_parse_ranges(const char *spec, HttpRange *ranges, int max_ranges) {
+    int num_ranges = 0;
+
+    while (*spec) {
+        char *end;
+        int64_t first = -1, last = -1;
+
+        if (num_ranges == max_ranges) {
+            return -1;
+        }
+        if (*spec != '-') {
+            first = strtoll(spec, &end, 10);
+            if (end == spec || first < 0) return -1;
+            spec = end;
+        }
+        if (*spec++ != '-') {
+            return -1;
+        }
+        if (*spec >= '0' && *spec <= '9') {
+            last = strtoll(spec, &end, 10);
+            spec = end;
+        }
+
+        if (first == -1) {
+            if (last <= 0) return -1;           // A suffix of last bytes
+            ranges[num_ranges].offset = -1;
+            ranges[num_ranges].length = last;
+        }
+        else {
+            if (last != -1 && last < first) return -1;
+            ranges[num_ranges].offset = first;
+            ranges[num_ranges].length = last == -1 ? -1 : last - first + 1;
+        }
+        ++num_ranges;
+
+        if (*spec == ',') {
+            ++spec;
+        }
+        else if (*spec) {
+            return -1;
+        }
+    }
+    return num_ranges;
+}
+
+
+// Order ranges by offset
+static int compare_ranges(const void *a, const void *b) {
+    int64_t left = ((const HttpRange *)a)->offset;
+    int64_t right = ((const HttpRange *)b)->offset;
+    return left < right ? -1 : left > right;
+}
+
+
+/**
+ * Plans how to fetch parts of a resource. The wanted ranges are resolved
+ * against its length and sorted, and those less than gap bytes apart are
+ * coalesced, as fetching the gap costs less than another range. Ranges
+ * are then split no larger than plan_chunks would make them for their
+ * total size.
+ * @param wanted   The ranges as parsed, see http_parse_ranges
+ * @param num_wanted   The number of wanted ranges
+ * @param content_length   The size of the resource, 0 if unknown
+ * @param gap   Ranges closer than this are fetched as one
+ * @param workers   The number of ranges downloaded at once
+ * @param max_in_flight   Bytes of range data that may be held in memory at once
+ * @param num_ranges   Set to the number of ranges planned
+ * @param chunk_size   Set to the largest a range may be
+ * @return HttpRange  The planned ranges to free, NULL if a range runs from
+ *                    the end of a resource of unknown length
+ */
+HttpRange *plan_ranges(const HttpRange *wanted, int num_wanted, int64_t content_length, int64_t gap,
+                       int workers, int64_t max_in_flight, int *num_ranges, int64_t *chunk_size) {
+    HttpRange *merged = (HttpRange *)malloc((num_wanted + 1) * sizeof(HttpRange));
+    int num_merged = 0;
+    int64_t total = 0;
+    int i;
+
+    // Resolve against the length, dropping what lies past the end
+    for (i = 0; i < num_wanted; ++i) {
+        HttpRange range = wanted[i];
+
+        if (content_length <= 0 && (range.offset == -1 || range.length == -1)) {
+            free(merged);
+            return NULL;
+        }
+        if (range.offset == -1) {
+            range.offset = range.length < content_length ? content_length - range.length : 0;
+            range.length = content_length - range.offset;
+        }
+        else if (range.length == -1) {
+            range.length = content_length - range.offset;
+        }
+        else if (content_length > 0 && range.offset + range.length > content_length) {
+            range.length = content_length - range.offset;
+        }
+        if (range.length > 0) {
+            merged[num_merged++] = range;
+        }
+    }
+
+    // Coalesce overlapping and nearby ranges
+    qsort(merged, num_merged, sizeof(HttpRange), compare_ranges);
+    int count = 0;
+    for (i = 0; i < num_merged; ++i) {
+        if (count > 0) {
+            HttpRange *last = &merged[count - 1];
+            int64_t end = last->offset + last->length;
+            if (merged[i].offset <= end + gap) {
+                if (merged[i].offset + merged[i].length > end) {
+                    last->length = merged[i].offset + merged[i].length - last->offset;
+                }
+                continue;
+            }
+        }
+        merged[count++] = merged[i];
+    }
+    for (i = 0; i < count; ++i) {
+        total += merged[i].length;
+    }
+
+    // Split the large ones, as plan_chunks splits a whole resource
+    plan_chunks(total, workers, max_in_flight, chunk_size);
+    int split = 0;
+    for (i = 0; i < count; ++i) {
+        split += (merged[i].length + *chunk_size - 1) / *chunk_size;
+    }
+
+    HttpRange *ranges = (HttpRange *)malloc((split + 1) * sizeof(HttpRange));
+    *num_ranges = 0;
+    for (i = 0; i < count; ++i) {
+        int64_t offset;
+        for (offset = 0; offset < merged[i].length; offset += *chunk_size) {
+            HttpRange *range = &ranges[(*num_ranges)++];
+            range->offset = merged[i].offset + offset;
+            range->length = merged[i].length - offset < *chunk_size ? merged[i].length - offset : *chunk_size;
+        }
+    }
+    free(merged);
+    return ranges;
 }
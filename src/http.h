@@ -1,6 +1,16 @@
 #ifndef HTTP_H
 #define HTTP_H
 
+#include <stdint.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+#define HEADER_SIZE 256
+
+#define CHUNKS_PER_WORKER 4             // Ranges per worker, so fast workers pick up the slack
+#define MIN_CHUNK_SIZE (256 * 1024)     // Smaller ranges cost more in requests than they save
+
 
 // A buffer object with data, and a length
 typedef struct {
@@ -10,6 +20,91 @@ typedef struct {
 } Buffer;
 
 
+// The parts of a HEAD response needed to plan and revalidate a download
+typedef struct {
+    int status;
+    int64_t content_length;     // 0 if the server did not say
+    char etag[HEADER_SIZE];
+    char last_modified[HEADER_SIZE];
+
+} HttpHead;
+
+
+// A byte range of a resource. As parsed, before plan_ranges resolves it,
+// an offset of -1 counts length bytes back from the end and a length of
+// -1 runs to the end.
+typedef struct {
+    int64_t offset;
+    int64_t length;
+
+} HttpRange;
+
+
+/**
+ * Takes the content of a response as it arrives, instead of it being kept
+ * in the returned buffer. Over HTTP/2 the content is still kept.
+ * @param header - The response header block, null terminated
+ * @param data - The next piece of content, which may be empty
+ * @param length - Bytes of data
+ * @param arg - The progress's sink_arg
+ * @return int - 0 to go on, -1 to stop the query
+ */
+typedef int (*HttpSink)(const char *header, const char *data, size_t length, void *arg);
+
+
+// Progress of a query in flight, so another thread can watch or cancel it.
+// Initialise with http_progress_init.
+typedef struct {
+    int address;                // Which of the host's addresses to connect to
+    int weight;                 // HTTP/2 stream weight from 1 to 256, 0 for the default
+    HttpSink sink;              // Takes the content as it arrives, or NULL
+    void *sink_arg;
+    int64_t received;           // Content bytes received so far
+    int cancelled;
+    int fd;                     // The socket, -1 when not connected
+    pthread_mutex_t mutex_lock; // Guards fd against being closed while cancelling
+
+} HttpProgress;
+
+
+struct H2Struct;
+
+
+/**
+ * Connect to one of the addresses of a host, resolving it through the
+ * pool if there is one, see http_use_pool
+ * @param host - The host name
+ * @param port - The port
+ * @param address - Which of the host's addresses, wrapping around if it
+ *                  has fewer
+ * @return int - The socket, or -1 on failure
+ */
+int client_socket(const char *host, int port, int address);
+
+
+/**
+ * Make requests over HTTP/2 instead, as streams on shared connections.
+ * @param h2 - The transport, see h2.h, or NULL for HTTP/1.0
+ */
+void http_use_h2(struct H2Struct *h2);
+
+
+/**
+ * Use a pool to keep connections and resolved addresses between requests.
+ * Requests then ask the server to keep the connection alive, and a
+ * connection goes back to the pool once its response is read in full.
+ * @param pool - The pool, or NULL to open a connection per request
+ */
+void http_use_pool(Pool *pool);
+
+
+/**
+ * Make https:// URLs possible, as requests over TLS
+ * @param tls - The TLS context, see tls.h, or NULL
+ */
+void http_use_tls(Tls *tls);
+
+
 /**
  * Perform an HTTP 1.0 query to a given host and page and port number.
  * host is a hostname and page is a path on the remote server. The query
@@ -26,6 +121,21 @@ typedef struct {
 Buffer* http_query(char *host, char *page, const char *range, int port);
 
 
+/**
+ * Perform an HTTP 1.0 query as http_query does, reporting progress as
+ * content arrives. Once cancelled the query stops and returns what it
+ * received so far.
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param page - e.g. /index.html
+ * @param range - Byte range e.g. 0-500. NOTE: A server may not respect this
+ * @param port - e.g. 80
+ * @param progress - Progress of the query, or NULL
+ * @return Buffer - Pointer to a buffer holding response data from query
+ *                  NULL is returned if it was cancelled before connecting.
+ */
+Buffer* http_query_progress(char *host, char *page, const char *range, int port, HttpProgress *progress);
+
+
 /**
  * Separate the content from the header of an http request.
  * NOTE: returned string is an offset into the response, so
@@ -37,9 +147,28 @@ Buffer* http_query(char *host, char *page, const char *range, int port);
 char* http_get_content(Buffer *response);
 
 
+/**
+ * Read the status code from the status line of an http response.
+ * @param response - Buffer containing the HTTP response
+ * @return int - The status code e.g. 206, or -1 if there is no status line
+ */
+int http_get_status(Buffer *response);
+
+
+/**
+ * Copy the value of a header from the header block of a response
+ * @param headers - The header block, null terminated
+ * @param name - The header name e.g. Content-Range
+ * @param value - Set to the value
+ * @param size - Size of value
+ * @return int - 0 if the header was found, -1 otherwise
+ */
+int http_header(const char *headers, const char *name, char *value, size_t size);
+
+
 /**
  * Splits an HTTP url into host, page. On success, calls http_query
- * to execute the query against the url. 
+ * to execute the query against the url, over TLS for an https:// url. 
  * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
  * @param range - The desired byte range of data to retrieve from the page
  * @return Buffer pointer holding raw string data or NULL on failure
@@ -47,6 +176,39 @@ char* http_get_content(Buffer *response);
 Buffer *http_url(const char *url, const char *range);
 
 
+/**
+ * As http_url, reporting progress of the query, see http_query_progress
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
+ * @param range - The desired byte range of data to retrieve from the page
+ * @param progress - Progress of the query, or NULL
+ * @return Buffer pointer holding raw string data or NULL on failure
+ */
+Buffer *http_url_progress(const char *url, const char *range, HttpProgress *progress);
+
+
+/**
+ * Prepare the progress of a query not started yet
+ * @param progress - The progress to initialise
+ * @param address - Which of the host's addresses to connect to, wrapping
+ *                  around if it has fewer
+ */
+void http_progress_init(HttpProgress *progress, int address);
+
+
+/**
+ * Release what http_progress_init set up
+ * @param progress - The progress of a finished query
+ */
+void http_progress_destroy(HttpProgress *progress);
+
+
+/**
+ * Cancel a query, waking it if it is waiting for data
+ * @param progress - The progress of the query
+ */
+void http_cancel(HttpProgress *progress);
+
+
 /**
  * Free a buffer
  * @param buffer - Pointer to a buffer to free
@@ -58,17 +220,63 @@ inline static void buffer_free(Buffer *buffer) {
 
 
 /**
- * Makes a HEAD request to a given URL and gets the content length
- * maxByteSize is set from this, and number of split downloads determined
- * @param url   The URL of the resource to download
- * @param threads   The number of threads to be used for the download
- * @return int  The number of downloads needed satisfying maxByteSize
- *              to download the resource
+ * Makes a HEAD request to a given URL and reads the status, the content
+ * length and the validators of the resource. If etag or last_modified are
+ * given the request is conditional, and a 304 status means the copy
+ * described by them is still current.
+ * @param url   The URL of the resource
+ * @param etag   ETag of a cached copy sent as If-None-Match, or NULL
+ * @param last_modified   Last-Modified of a cached copy sent as
+ *                        If-Modified-Since, or NULL
+ * @param head   Filled in with the response
+ * @return int  The status code of the response or -1 on failure
  */
-int get_num_tasks(char *url, int threads);
+int http_head(const char *url, const char *etag, const char *last_modified, HttpHead *head);
 
-int max_chunk_size; // The maximum size in bytes of a chunk to download
 
-int get_max_chunk_size(void);
+/**
+ * Plans how to split a resource into ranges. There are CHUNKS_PER_WORKER
+ * ranges for every worker where the size allows, but no range is larger
+ * than the worker's share of max_in_flight, so a resource of any size is
+ * fetched as many bounded ranges.
+ * @param content_length   The size of the resource to download, 0 if unknown
+ * @param workers   The number of ranges downloaded at once
+ * @param max_in_flight   Bytes of range data that may be held in memory at once
+ * @param chunk_size   Set to the size of every range but the last, which
+ *                     may be shorter. 0 if the length is unknown.
+ * @return int  The number of ranges
+ */
+int plan_chunks(int64_t content_length, int workers, int64_t max_in_flight, int64_t *chunk_size);
+
+
+/**
+ * Parse a list of byte ranges as a Range header gives them
+ * @param spec - e.g. 0-1023,4096-,-512
+ * @param ranges - Filled in with the ranges, see HttpRange
+ * @param max_ranges - Room in ranges
+ * @return int - The number of ranges, -1 if spec is malformed or too long
+ */
+int http_parse_ranges(const char *spec, HttpRange *ranges, int max_ranges);
+
+
+/**
+ * Plans how to fetch parts of a resource. The wanted ranges are resolved
+ * against its length and sorted, and those less than gap bytes apart are
+ * coalesced, as fetching the gap costs less than another range. Ranges
+ * are then split no larger than plan_chunks would make them for their
+ * total size.
+ * @param wanted   The ranges as parsed, see http_parse_ranges
+ * @param num_wanted   The number of wanted ranges
+ * @param content_length   The size of the resource, 0 if unknown
+ * @param gap   Ranges closer than this are fetched as one
+ * @param workers   The number of ranges downloaded at once
+ * @param max_in_flight   Bytes of range data that may be held in memory at once
+ * @param num_ranges   Set to the number of ranges planned
+ * @param chunk_size   Set to the largest a range may be
+ * @return HttpRange  The planned ranges to free, NULL if a range runs from
+ *                    the end of a resource of unknown length
+ */
+HttpRange *plan_ranges(const HttpRange *wanted, int num_wanted, int64_t content_length, int64_t gap,
+                       int workers, int64_t max_in_flight, int *num_ranges, int64_t *chunk_size);
 
 #endif
@@ -0,0 +1,354 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "list.h"
+
+#define LINE_SIZE (LIST_URL_SIZE + LIST_RANGES_SIZE + 64)   // Longest line
+#define DROP_BYTES (16 * 1024 * 1024)   // Parsed pages are dropped this many at a time
+#define SEEN_BUCKETS (32 * 1024)        // Buckets of the URLs remembered, a power of two
+#define SEEN_WAYS 8                     // URLs remembered per bucket, the oldest is forgotten first
+
+
+// A URL remembered by where its line starts, hash 0 for a free slot
+typedef struct {
+    uint64_t hash;
+    size_t line;
+} Seen;
+
+
+/*
+ * List - streams a URL list of any length.
+ * Hidden from the outside, see list.h
+ */
+typedef struct ListStruct {
+    char *map;              // The file, NULL if it is empty
+    size_t size;
+    size_t cursor;          // Start of the next line
+    size_t dropped;         // Pages before this were handed back
+    int eof;
+
+    Seen *seen;             // SEEN_BUCKETS buckets of SEEN_WAYS URLs each
+    int64_t duplicates;
+
+    ListEntry *slots;       // Lines in the window, from head onwards
+    int *ready;             // Set on a slot once its line is probed
+    int window;
+    int head;
+    int filled;
+
+    ListProbe probe;
+    void *arg;
+    pthread_t *probers;
+    int num_probers;
+    int closing;
+
+    pthread_mutex_t mutex_lock;
+    pthread_cond_t room;    // A slot was freed, or the list is closing
+    pthread_cond_t probed;  // A line was probed, or the list ended
+} List;
+
+
+// FNV-1a, then mixed so every bit of the fingerprint depends on the URL
+static uint64_t fingerprint(const char *url) {
+    uint64_t hash = 14695981039346656037ULL;
+
+    while (*url) {
+        hash = (hash ^ (unsigned char)*url++) * 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash ? hash : 1;
+}
+
+
+/**
+ * Parse a line of a URL list into an entry, without probing it
+ * @param line - The line, which need not be null terminated
+ * @param length - Bytes of line, without its newline
+ * @param entry - Filled in with the URL, priority and ranges
+ * @return int - 0 on success, -1 for a blank line or one too long
+ */
+int list_parse_line(const char *line, size_t length, ListEntry *entry) {
+    char copy[LINE_SIZE];
+    char *save = NULL;
+    char *field;
+
+    if (length >= sizeof(copy)) {
+        fprintf(stderr, "url_file line too long, skipped\n");
+        return -1;
+    }
+    memcpy(copy, line, length);
+    copy[length] = '\0';
+
+    char *url = strtok_r(copy, " \t\r\n", &save);
+    if (!url) {
+        return -1;
+    }
+    if (strlen(url) >= sizeof(entry->url)) {
+        fprintf(stderr, "url too long, skipped\n");
+        return -1;
+    }
+
+    memset(entry, 0, sizeof(ListEntry));
+    strcpy(entry->url, url);
+    while ((field = strtok_r(NULL, " \t\r\n", &save))) {
+        if (strncmp(field, "ranges=", 7) == 0) {
+            snprintf(entry->ranges, sizeof(entry->ranges), "%s", field + 7);
+        }
+        else {
+            entry->priority = atoi(field);
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * Record the URL of the line at offset as seen. The fingerprint only
+ * finds candidates: their lines are parsed again from the file, so two
+ * URLs are only taken for the same if they are. Once a bucket is full
+ * the oldest URL in it is forgotten, so memory stays bounded and a URL
+ * listed again much later is downloaded again.
+ * Caller holds the mutex_lock.
+ * @return int - 1 if it is new, 0 if it was seen before
+ */
+static int remember(List *list, const ListEntry *entry, size_t offset) {
+    uint64_t hash = fingerprint(entry->url);
+    Seen *bucket = &list->seen[(hash & (SEEN_BUCKETS - 1)) * SEEN_WAYS];
+    Seen *oldest = bucket;
+    ListEntry before;
+    int i;
+
+    for (i = 0; i < SEEN_WAYS; ++i) {
+        if (bucket[i].hash == 0) {
+            oldest = &bucket[i];
+            break;
+        }
+        if (bucket[i].line < oldest->line) {
+            oldest = &bucket[i];
+        }
+        if (bucket[i].hash != hash) {
+            continue;
+        }
+
+        const char *line = list->map + bucket[i].line;
+        const char *newline = memchr(line, '\n', list->size - bucket[i].line);
+        size_t length = (newline ? newline : list->map + list->size) - line;
+        if (list_parse_line(line, length, &before) == -1 || strcmp(before.url, entry->url) != 0) {
+            continue;
+        }
+        if (strcmp(before.ranges, entry->ranges) != 0) {
+            fprintf(stderr, "%s listed again with other ranges, skipped\n", entry->url);
+        }
+        return 0;
+    }
+
+    oldest->hash = hash;
+    oldest->line = offset;
+    return 1;
+}
+
+
+/**
+ * Parse the next line with a URL not seen before into an entry.
+ * Caller holds the mutex_lock.
+ * @return int - 0 on success, -1 at the end of the list
+ */
+static int read_line(List *list, ListEntry *entry) {
+    while (list->cursor < list->size) {
+        const char *start = list->map + list->cursor;
+        const char *newline = memchr(start, '\n', list->size - list->cursor);
+        size_t length = (newline ? newline : list->map + list->size) - start;
+
+        list->cursor += length + (newline != NULL);
+
+        // Hand back the pages parsed so far, the file keeps them
+        if (list->cursor - list->dropped >= DROP_BYTES) {
+            size_t end = list->cursor & ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+            madvise(list->map + list->dropped, end - list->dropped, MADV_DONTNEED);
+            list->dropped = end;
+        }
+
+        if (list_parse_line(start, length, entry) == -1) {
+            continue;
+        }
+
+        if (!remember(list, entry, start - list->map)) {
+            ++list->duplicates;
+            continue;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+
+/**
+ * Claim the next line of the window and probe it, until the list ends
+ * @param arg - The List
+ */
+static void *prober_thread(void *arg) {
+    List *list = (List *)arg;
+
+    pthread_mutex_lock(&list->mutex_lock);
+    while (!list->closing && !list->eof) {
+        if (list->filled == list->window) {
+            pthread_cond_wait(&list->room, &list->mutex_lock);
+            continue;
+        }
+
+        int slot = (list->head + list->filled) % list->window;
+        ListEntry *entry = &list->slots[slot];
+        if (read_line(list, entry) == -1) {
+            list->eof = 1;
+            pthread_cond_broadcast(&list->room);
+            pthread_cond_broadcast(&list->probed);
+            break;
+        }
+        ++list->filled;
+
+        // The slot is not reused until its line is taken
+        pthread_mutex_unlock(&list->mutex_lock);
+        entry->probed = list->probe(entry, list->arg);
+        pthread_mutex_lock(&list->mutex_lock);
+
+        list->ready[slot] = 1;
+        pthread_cond_broadcast(&list->probed);
+    }
+    pthread_mutex_unlock(&list->mutex_lock);
+    return NULL;
+}
+
+
+/**
+ * Open a URL list and start probing its first lines
+ * @param path - Path of the list
+ * @param window - The most lines probed ahead of those taken
+ * @param num_probers - The number of probes in flight at once
+ * @param probe - Probes each line
+ * @param arg - Passed to probe
+ * @return list - Pointer to the opened list, NULL if it could not be read
+ */
+List *list_open(const char *path, int window, int num_probers, ListProbe probe, void *arg) {
+    struct stat st;
+    int i;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror("url_file");
+        if (fd != -1) close(fd);
+        return NULL;
+    }
+
+    List *list = (List *)calloc(1, sizeof(List));
+    list->size = st.st_size;
+    if (list->size > 0) {
+        list->map = mmap(NULL, list->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (list->map == MAP_FAILED) {
+            perror("url_file");
+            close(fd);
+            free(list);
+            return NULL;
+        }
+        madvise(list->map, list->size, MADV_SEQUENTIAL);
+    }
+    close(fd);      // The mapping keeps the file
+
+    list->seen = (Seen *)calloc(SEEN_BUCKETS * SEEN_WAYS, sizeof(Seen));
+
+    list->window = window;
+    list->slots = (ListEntry *)malloc(sizeof(ListEntry) * window);
+    list->ready = (int *)calloc(window, sizeof(int));
+
+    list->probe = probe;
+    list->arg = arg;
+    pthread_mutex_init(&list->mutex_lock, NULL);
+    pthread_cond_init(&list->room, NULL);
+    pthread_cond_init(&list->probed, NULL);
+
+    list->num_probers = num_probers;
+    list->probers = (pthread_t *)malloc(sizeof(pthread_t) * num_probers);
+    for (i = 0; i < num_probers; ++i) {
+        if (pthread_create(&list->probers[i], NULL, prober_thread, list) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    return list;
+}
+
+
+/**
+ * Take the next line of the list once it has been probed
+ * @param list - Pointer to the list
+ * @param entry - Filled in with the line
+ * @return int - 0 on success, -1 once the list is finished
+ */
+int list_next(List *list, ListEntry *entry) {
+    pthread_mutex_lock(&list->mutex_lock);
+    while (list->filled ? !list->ready[list->head] : !list->eof) {
+        pthread_cond_wait(&list->probed, &list->mutex_lock);
+    }
+    if (list->filled == 0) {
+        pthread_mutex_unlock(&list->mutex_lock);
+        return -1;
+    }
+
+    *entry = list->slots[list->head];
+    list->ready[list->head] = 0;
+    list->head = (list->head + 1) % list->window;
+    --list->filled;
+    pthread_cond_signal(&list->room);
+    pthread_mutex_unlock(&list->mutex_lock);
+    return 0;
+}
+
+
+/**
+ * The number of lines skipped so far as their URL was listed before
+ * @param list - Pointer to the list
+ * @return int64_t - The number of duplicates
+ */
+int64_t list_duplicates(List *list) {
+    pthread_mutex_lock(&list->mutex_lock);
+    int64_t duplicates = list->duplicates;
+    pthread_mutex_unlock(&list->mutex_lock);
+    return duplicates;
+}
+
+
+/**
+ * Close a list, waiting for probes in flight. Lines left are not probed.
+ * @param list - Pointer to the list to close
+ */
+void list_close(List *list) {
+    int i;
+
+    pthread_mutex_lock(&list->mutex_lock);
+    list->closing = 1;
+    pthread_cond_broadcast(&list->room);
+    pthread_mutex_unlock(&list->mutex_lock);
+
+    for (i = 0; i < list->num_probers; ++i) {
+        pthread_join(list->probers[i], NULL);
+    }
+
+    if (list->map) {
+        munmap(list->map, list->size);
+    }
+    pthread_mutex_destroy(&list->mutex_lock);
+    pthread_cond_destroy(&list->room);
+    pthread_cond_destroy(&list->probed);
+    free(list->probers);
+    free(list->slots);
+    free(list->ready);
+    free(list->seen);
+    free(list);
+}
@@ -0,0 +1,91 @@
+#ifndef LIST_H
+#define LIST_H
+
+#include <stdint.h>
+
+#include "http.h"
+
+#define LIST_URL_SIZE 1024
+#define LIST_RANGES_SIZE 1024
+
+
+/*
+ * List - streams a URL list of any length. The file is mapped rather than
+ * read, and pages already parsed are dropped again, so memory stays flat
+ * however long the list is. A URL listed again is skipped: a fixed table
+ * of recent URLs is kept by fingerprint and the offset of their line, so
+ * a fingerprint match is checked against the line itself.
+ * A window of the lines ahead is probed by a few threads at once, so the
+ * probe of one URL waits on the network while others are being
+ * downloaded, and lines still come out in the order they are listed.
+ */
+typedef struct ListStruct List;
+
+
+// A line of the list: a URL optionally followed by its priority and the
+// byte ranges wanted of it, e.g. ranges=0-1023,-512
+typedef struct {
+    char url[LIST_URL_SIZE];
+    int priority;
+    char ranges[LIST_RANGES_SIZE];  // "" for the whole file
+    HttpHead head;                  // Filled in by the probe
+    int probed;                     // What the probe returned
+
+} ListEntry;
+
+
+/**
+ * Probes a line of the list ahead of it being taken, on a probe thread
+ * @param entry - The line, whose head the probe fills in
+ * @param arg - As given to list_open
+ * @return int - Stored in the entry's probed
+ */
+typedef int (*ListProbe)(ListEntry *entry, void *arg);
+
+
+/**
+ * Parse a line of a URL list into an entry, without probing it
+ * @param line - The line, which need not be null terminated
+ * @param length - Bytes of line, without its newline
+ * @param entry - Filled in with the URL, priority and ranges
+ * @return int - 0 on success, -1 for a blank line or one too long
+ */
+int list_parse_line(const char *line, size_t length, ListEntry *entry);
+
+
+/**
+ * Open a URL list and start probing its first lines
+ * @param path - Path of the list
+ * @param window - The most lines probed ahead of those taken
+ * @param num_probers - The number of probes in flight at once
+ * @param probe - Probes each line
+ * @param arg - Passed to probe
+ * @return list - Pointer to the opened list, NULL if it could not be read
+ */
+List *list_open(const char *path, int window, int num_probers, ListProbe probe, void *arg);
+
+
+/**
+ * Take the next line of the list once it has been probed
+ * @param list - Pointer to the list
+ * @param entry - Filled in with the line
+ * @return int - 0 on success, -1 once the list is finished
+ */
+int list_next(List *list, ListEntry *entry);
+
+
+/**
+ * The number of lines skipped so far as their URL was listed before
+ * @param list - Pointer to the list
+ * @return int64_t - The number of duplicates
+ */
+int64_t list_duplicates(List *list);
+
+
+/**
+ * Close a list, waiting for probes in flight. Lines left are not probed.
+ * @param list - Pointer to the list to close
+ */
+void list_close(List *list);
+
+#endif
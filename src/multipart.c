@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+
+#include "multipart.h"
+
+#define LINE_SIZE 1024      // Longest boundary or part header line
+
+enum { BOUNDARY, HEADERS, CONTENT, DONE, FAILED };
+
+
+/*
+ * Multipart - reads a multipart/byteranges response body as it arrives.
+ * Hidden from the outside, see multipart.h
+ */
+typedef struct MultipartStruct {
+    char *boundary;         // With its leading --
+    size_t boundary_length;
+    MultipartEmit emit;
+    void *arg;
+
+    int state;
+    char line[LINE_SIZE];   // The line read so far, outside content
+    size_t line_length;
+
+    int64_t offset;         // Of the next content byte of the current part
+    int64_t remaining;      // Content bytes left in the current part, -1 without a Content-Range
+} Multipart;
+
+
+/**
+ * Read the boundary from a Content-Type header value
+ * @param content_type - e.g. multipart/byteranges; boundary=3d6b6a416f9b5
+ * @param boundary - Set to the boundary
+ * @param size - Size of boundary
+ * @return int - 0 on success, -1 if it is not multipart/byteranges
+ */
+int multipart_boundary(const char *content_type, char *boundary, size_t size) {
+    if (strncasecmp(content_type, "multipart/byteranges", 20) != 0) {
+        return -1;
+    }
+
+    const char *param = strchr(content_type, ';');
+    while (param) {
+        param += strspn(param, "; \t");
+        if (strncasecmp(param, "boundary=", 9) == 0) break;
+        param = strchr(param, ';');
+    }
+    if (!param) {
+        return -1;
+    }
+    param += 9;
+
+    size_t length;
+    if (*param == '"') {
+        ++param;
+        length = strcspn(param, "\"");
+    }
+    else {
+        length = strcspn(param, "; \t\r\n");
+    }
+    if (length == 0 || length >= size) {
+        return -1;
+    }
+    memcpy(boundary, param, length);
+    boundary[length] = '\0';
+    return 0;
+}
+
+
+/**
+ * Allocate a parser for a body with the given boundary
+ * @param boundary - The boundary, from multipart_boundary
+ * @param emit - Called with the content of each part
+ * @param arg - Passed to emit
+ * @return multipart - Pointer to the allocated parser
+ */
+Multipart *multipart_alloc(const char *boundary, MultipartEmit emit, void *arg) {
+    Multipart *multipart = (Multipart *)calloc(1, sizeof(Multipart));
+
+    multipart->boundary_length = strlen(boundary) + 2;
+    multipart->boundary = (char *)malloc(multipart->boundary_length + 1);
+    sprintf(multipart->boundary, "--%s", boundary);
+
+    multipart->emit = emit;
+    multipart->arg = arg;
+    multipart->state = BOUNDARY;
+    return multipart;
+}
+
+
+/**
+ * Free a parser
+ * @param multipart - Pointer to the parser to free
+ */
+void multipart_free(Multipart *multipart) {
+    free(multipart->boundary);
+    free(multipart);
+}
+
+
+/**
+ * Act on a complete line outside content, without its line ending
+ * @return int - 0 on success, -1 if it is malformed
+ */
+static int end_line(Multipart *multipart, const char *line, size_t length) {
+    if (multipart->state == BOUNDARY) {
+        // Blank lines and a preamble may come before a boundary
+        if (length >= multipart->boundary_length && memcmp(line, multipart->boundary, multipart->boundary_length) == 0) {
+            const char *rest = line + multipart->boundary_length;
+            multipart->state = strncmp(rest, "--", 2) == 0 ? DONE : HEADERS;
+            multipart->remaining = -1;
+        }
+        return 0;
+    }
+
+    // Part headers, of which only Content-Range matters
+    if (length == 0) {
+        if (multipart->remaining < 0) {
+            return -1;
+        }
+        multipart->state = multipart->remaining ? CONTENT : BOUNDARY;
+        return 0;
+    }
+    if (strncasecmp(line, "Content-Range:", 14) == 0) {
+        int64_t first, last;
+        if (sscanf(line + 14, " bytes %" SCNd64 "-%" SCNd64, &first, &last) != 2 || last < first) {
+            return -1;
+        }
+        multipart->offset = first;
+        multipart->remaining = last - first + 1;
+    }
+    return 0;
+}
+
+
+/**
+ * Feed the next piece of the body, which may split lines and parts anywhere
+ * @param multipart - Pointer to the parser
+ * @param data - The next bytes of the body
+ * @param length - Bytes of data
+ * @return int - 0 on success, -1 if the body is malformed or emit failed
+ */
+int multipart_feed(Multipart *multipart, const char *data, size_t length) {
+    const char *end = data + length;
+
+    while (data < end) {
+        switch (multipart->state) {
+        case CONTENT: {
+            // Hand content on straight from the input
+            size_t count = end - data;
+            if ((int64_t)count > multipart->remaining) count = multipart->remaining;
+
+            if (multipart->emit(multipart->offset, data, count, multipart->arg) == -1) {
+                multipart->state = FAILED;
+                return -1;
+            }
+            multipart->offset += count;
+            multipart->remaining -= count;
+            data += count;
+            if (multipart->remaining == 0) {
+                multipart->state = BOUNDARY;
+            }
+            break;
+        }
+
+        case BOUNDARY:
+        case HEADERS: {
+            const char *newline = memchr(data, '\n', end - data);
+            size_t count = (newline ? newline + 1 : end) - data;
+
+            if (multipart->line_length + count > sizeof(multipart->line)) {
+                multipart->state = FAILED;
+                return -1;
+            }
+            memcpy(multipart->line + multipart->line_length, data, count);
+            multipart->line_length += count;
+            data += count;
+
+            if (newline) {
+                size_t line_length = multipart->line_length - 1;
+                if (line_length && multipart->line[line_length - 1] == '\r') --line_length;
+                multipart->line[line_length] = '\0';
+                multipart->line_length = 0;
+
+                if (end_line(multipart, multipart->line, line_length) == -1) {
+                    multipart->state = FAILED;
+                    return -1;
+                }
+            }
+            break;
+        }
+
+        case DONE:
+            return 0;       // The epilogue is ignored
+
+        default:
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * Whether the closing boundary was read
+ * @param multipart - Pointer to the parser
+ * @return int - Non zero once the body is complete
+ */
+int multipart_done(Multipart *multipart) {
+    return multipart->state == DONE;
+}
@@ -0,0 +1,73 @@
+#ifndef MULTIPART_H
+#define MULTIPART_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+ * Multipart - reads a multipart/byteranges response body as it arrives.
+ * A server answers a request for several ranges with one part per range,
+ * each with its own Content-Range header. The content of every part is
+ * handed on as it is fed in, with its offset in the resource, so no part
+ * has to be held whole.
+ */
+typedef struct MultipartStruct Multipart;
+
+
+/**
+ * Receives the content of a part
+ * @param offset - Offset in the resource of the first byte of data
+ * @param data - The content
+ * @param length - Bytes of content
+ * @param arg - As given to multipart_alloc
+ * @return int - 0 to go on, -1 to stop with an error
+ */
+typedef int (*MultipartEmit)(int64_t offset, const char *data, size_t length, void *arg);
+
+
+/**
+ * Read the boundary from a Content-Type header value
+ * @param content_type - e.g. multipart/byteranges; boundary=3d6b6a416f9b5
+ * @param boundary - Set to the boundary
+ * @param size - Size of boundary
+ * @return int - 0 on success, -1 if it is not multipart/byteranges
+ */
+int multipart_boundary(const char *content_type, char *boundary, size_t size);
+
+
+/**
+ * Allocate a parser for a body with the given boundary
+ * @param boundary - The boundary, from multipart_boundary
+ * @param emit - Called with the content of each part
+ * @param arg - Passed to emit
+ * @return multipart - Pointer to the allocated parser
+ */
+Multipart *multipart_alloc(const char *boundary, MultipartEmit emit, void *arg);
+
+
+/**
+ * Free a parser
+ * @param multipart - Pointer to the parser to free
+ */
+void multipart_free(Multipart *multipart);
+
+
+/**
+ * Feed the next piece of the body, which may split lines and parts anywhere
+ * @param multipart - Pointer to the parser
+ * @param data - The next bytes of the body
+ * @param length - Bytes of data
+ * @return int - 0 on success, -1 if the body is malformed or emit failed
+ */
+int multipart_feed(Multipart *multipart, const char *data, size_t length);
+
+
+/**
+ * Whether the closing boundary was read
+ * @param multipart - Pointer to the parser
+ * @return int - Non zero once the body is complete
+ */
+int multipart_done(Multipart *multipart);
+
+#endif
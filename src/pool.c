@@ -0,0 +1,261 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+
+#include "pool.h"
+
+#define HOST_SIZE 256
+#define MAX_ADDRESSES 16
+
+
+// A resolved host
+typedef struct HostStruct {
+    char host[HOST_SIZE];
+    int port;
+    struct sockaddr_storage addrs[MAX_ADDRESSES];
+    socklen_t addrlens[MAX_ADDRESSES];
+    int num_addrs;
+    time_t expires;
+    struct HostStruct *next;
+} Host;
+
+
+// An idle connection
+typedef struct IdleStruct {
+    char host[HOST_SIZE];
+    int port;
+    int address;
+    int fd;
+    TlsConn *tls;       // NULL for a plain connection
+    time_t since;
+    struct IdleStruct *next;
+} Idle;
+
+
+/*
+ * Pool - keeps connections and resolved addresses alive between requests.
+ * Hidden from the outside, see pool.h
+ */
+typedef struct PoolStruct {
+    int max_idle;
+    int idle_seconds;
+    int dns_ttl;
+
+    Host *hosts;
+    Idle *idle;         // Most recently used first
+    int num_idle;
+
+    pthread_mutex_t mutex_lock;
+} Pool;
+
+
+// Close an idle connection and free it
+static void discard(Idle *idle) {
+    if (idle->tls) {
+        tls_close(idle->tls);
+    }
+    close(idle->fd);
+    free(idle);
+}
+
+
+/**
+ * Allocate a connection pool
+ * @param max_idle - The most idle connections kept, over all hosts
+ * @param idle_seconds - How long an idle connection is kept
+ * @param dns_ttl - How long a resolved host is kept, in seconds
+ * @return pool - Pointer to the allocated pool
+ */
+Pool *pool_alloc(int max_idle, int idle_seconds, int dns_ttl) {
+    Pool *pool = (Pool *)calloc(1, sizeof(Pool));
+    pool->max_idle = max_idle;
+    pool->idle_seconds = idle_seconds;
+    pool->dns_ttl = dns_ttl;
+
+    pthread_mutex_init(&pool->mutex_lock, NULL);
+    return pool;
+}
+
+
+/**
+ * Free a pool, closing its idle connections
+ * @param pool - Pointer to the pool to free
+ */
+void pool_free(Pool *pool) {
+    while (pool->hosts) {
+        Host *host = pool->hosts;
+        pool->hosts = host->next;
+        free(host);
+    }
+    while (pool->idle) {
+        Idle *idle = pool->idle;
+        pool->idle = idle->next;
+        discard(idle);
+    }
+    pthread_mutex_destroy(&pool->mutex_lock);
+    free(pool);
+}
+
+
+// Copy the chosen address of a host. Caller holds the lock.
+static void choose(Host *host, int address, struct sockaddr_storage *addr, socklen_t *addrlen) {
+    address %= host->num_addrs;
+    memcpy(addr, &host->addrs[address], host->addrlens[address]);
+    *addrlen = host->addrlens[address];
+}
+
+
+/**
+ * Resolve a host through the pool's DNS cache
+ * @param pool - Pointer to the pool
+ * @param host - The host name
+ * @param port - The port to connect to
+ * @param address - Which of the host's addresses to return, wrapping
+ *                  around if it has fewer
+ * @param addr - Filled in with the address
+ * @param addrlen - Filled in with the length of the address
+ * @return int - 0 on success, -1 if the host could not be resolved
+ */
+int pool_resolve(Pool *pool, const char *host, int port, int address,
+                 struct sockaddr_storage *addr, socklen_t *addrlen) {
+    time_t now = time(NULL);
+    Host *entry;
+
+    pthread_mutex_lock(&pool->mutex_lock);
+    for (entry = pool->hosts; entry; entry = entry->next) {
+        if (entry->port == port && strcmp(entry->host, host) == 0 && entry->expires > now) {
+            choose(entry, address, addr, addrlen);
+            pthread_mutex_unlock(&pool->mutex_lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex_lock);
+
+    // Resolve without holding the lock, lookups can take a while
+    struct addrinfo hints, *result, *info;
+    char port_string[12];
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;          // Use an internet address
+    hints.ai_socktype = SOCK_STREAM;    // Use TCP rather than datagram
+    snprintf(port_string, sizeof(port_string), "%d", port);
+
+    if (getaddrinfo(host, port_string, &hints, &result) != 0) {
+        return -1;
+    }
+
+    Host *resolved = (Host *)calloc(1, sizeof(Host));
+    snprintf(resolved->host, HOST_SIZE, "%s", host);
+    resolved->port = port;
+    resolved->expires = now + pool->dns_ttl;
+    for (info = result; info && resolved->num_addrs < MAX_ADDRESSES; info = info->ai_next) {
+        memcpy(&resolved->addrs[resolved->num_addrs], info->ai_addr, info->ai_addrlen);
+        resolved->addrlens[resolved->num_addrs++] = info->ai_addrlen;
+    }
+    freeaddrinfo(result);
+
+    if (resolved->num_addrs == 0) {
+        free(resolved);
+        return -1;
+    }
+
+    // Replace an expired entry for the host, if any
+    pthread_mutex_lock(&pool->mutex_lock);
+    Host **link = &pool->hosts;
+    while (*link) {
+        if ((*link)->port == port && strcmp((*link)->host, host) == 0) {
+            Host *stale = *link;
+            *link = stale->next;
+            free(stale);
+        }
+        else {
+            link = &(*link)->next;
+        }
+    }
+    resolved->next = pool->hosts;
+    pool->hosts = resolved;
+    choose(resolved, address, addr, addrlen);
+    pthread_mutex_unlock(&pool->mutex_lock);
+    return 0;
+}
+
+
+/**
+ * Take an idle connection to a server out of the pool
+ * @param pool - Pointer to the pool
+ * @param host - The host name
+ * @param port - The port
+ * @param address - Which of the host's addresses, as for pool_resolve
+ * @param tls - NULL for a plain connection. For a TLS one, set to the
+ *              connection's TLS.
+ * @return fd - A connected socket, or -1 if there is none
+ */
+int pool_get(Pool *pool, const char *host, int port, int address, TlsConn **tls) {
+    time_t now = time(NULL);
+    int fd = -1;
+
+    pthread_mutex_lock(&pool->mutex_lock);
+    Idle **link = &pool->idle;
+    while (*link) {
+        Idle *idle = *link;
+
+        if (now - idle->since > pool->idle_seconds) {
+            // The server has most likely closed it by now
+            *link = idle->next;
+            discard(idle);
+            --pool->num_idle;
+            continue;
+        }
+        if (fd == -1 && idle->port == port && idle->address == address && (idle->tls != NULL) == (tls != NULL) &&
+            strcmp(idle->host, host) == 0) {
+            *link = idle->next;
+            fd = idle->fd;
+            if (tls) *tls = idle->tls;
+            free(idle);
+            --pool->num_idle;
+            continue;
+        }
+        link = &idle->next;
+    }
+    pthread_mutex_unlock(&pool->mutex_lock);
+    return fd;
+}
+
+
+/**
+ * Give a connection whose response has been read in full back to the pool
+ * @param pool - Pointer to the pool
+ * @param host - The host name
+ * @param port - The port
+ * @param address - Which of the host's addresses, as for pool_resolve
+ * @param fd - The socket, closed if the pool is full
+ * @param tls - TLS on the socket, or NULL for a plain connection
+ */
+void pool_put(Pool *pool, const char *host, int port, int address, int fd, TlsConn *tls) {
+    Idle *idle = (Idle *)malloc(sizeof(Idle));
+    snprintf(idle->host, HOST_SIZE, "%s", host);
+    idle->port = port;
+    idle->address = address;
+    idle->fd = fd;
+    idle->tls = tls;
+    idle->since = time(NULL);
+
+    pthread_mutex_lock(&pool->mutex_lock);
+    idle->next = pool->idle;
+    pool->idle = idle;
+
+    // Over the limit, close the connection idle the longest
+    if (++pool->num_idle > pool->max_idle) {
+        Idle **link = &pool->idle;
+        while ((*link)->next) {
+            link = &(*link)->next;
+        }
+        discard(*link);
+        *link = NULL;
+        --pool->num_idle;
+    }
+    pthread_mutex_unlock(&pool->mutex_lock);
+}
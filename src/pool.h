@@ -0,0 +1,76 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <sys/socket.h>
+
+#include "tls.h"
+
+
+/*
+ * Pool - keeps connections and resolved addresses alive between requests.
+ * Idle keep-alive connections are kept per host, port and address, so the
+ * next request to the same server skips the TCP handshake, and each host
+ * is resolved once per DNS time to live rather than once per request.
+ * A TLS connection is kept with its TLS state, so it is reused without a
+ * handshake of any kind.
+ */
+typedef struct PoolStruct Pool;
+
+
+/**
+ * Allocate a connection pool
+ * @param max_idle - The most idle connections kept, over all hosts
+ * @param idle_seconds - How long an idle connection is kept
+ * @param dns_ttl - How long a resolved host is kept, in seconds
+ * @return pool - Pointer to the allocated pool
+ */
+Pool *pool_alloc(int max_idle, int idle_seconds, int dns_ttl);
+
+
+/**
+ * Free a pool, closing its idle connections
+ * @param pool - Pointer to the pool to free
+ */
+void pool_free(Pool *pool);
+
+
+/**
+ * Resolve a host through the pool's DNS cache
+ * @param pool - Pointer to the pool
+ * @param host - The host name
+ * @param port - The port to connect to
+ * @param address - Which of the host's addresses to return, wrapping
+ *                  around if it has fewer
+ * @param addr - Filled in with the address
+ * @param addrlen - Filled in with the length of the address
+ * @return int - 0 on success, -1 if the host could not be resolved
+ */
+int pool_resolve(Pool *pool, const char *host, int port, int address,
+                 struct sockaddr_storage *addr, socklen_t *addrlen);
+
+
+/**
+ * Take an idle connection to a server out of the pool
+ * @param pool - Pointer to the pool
+ * @param host - The host name
+ * @param port - The port
+ * @param address - Which of the host's addresses, as for pool_resolve
+ * @param tls - NULL for a plain connection. For a TLS one, set to the
+ *              connection's TLS.
+ * @return fd - A connected socket, or -1 if there is none
+ */
+int pool_get(Pool *pool, const char *host, int port, int address, TlsConn **tls);
+
+
+/**
+ * Give a connection whose response has been read in full back to the pool
+ * @param pool - Pointer to the pool
+ * @param host - The host name
+ * @param port - The port
+ * @param address - Which of the host's addresses, as for pool_resolve
+ * @param fd - The socket, closed if the pool is full
+ * @param tls - TLS on the socket, or NULL for a plain connection
+ */
+void pool_put(Pool *pool, const char *host, int port, int address, int fd, TlsConn *tls);
+
+#endif
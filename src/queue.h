@@ -1,62 +1,72 @@
-#ifndef QUEUE_H
-#define QUEUE_H
-
-
-/*
- * Queue - the abstract type of a concurrent queue.
- * You must provide an implementation of this type but it is hidden from the outside.
- *
- */
-typedef struct QueueStruct Queue;
-
-
-/**
- * Allocate a concurrent queue of a specific size
- * @param size - The size of memory to allocate to the queue
- * @return queue - Pointer to the allocated queue
- */
-Queue *queue_alloc(int size);
-
-
-/**
- * Free a concurrent queue and associated memory 
- *
- * Don't call this function while the queue is still in use.
- * (Note, this is a pre-condition to the function and does not need
- * to be checked)
- * 
- * @param queue - Pointer to the queue to free
- */
-void queue_free(Queue *queue);
-
-
-/**
- * Place an item into the concurrent queue.
- * If no space available then queue will block
- * until a space is available when it will
- * put the item into the queue and immediatly return
- *  
- * @param queue - Pointer to the queue to add an item to
- * @param item - An item to add to queue. Uses void* to hold an arbitrary
- *               type. User's responsibility to manage memory and ensure
- *               it is correctly typed.
- */
-void queue_put(Queue *queue, void *item);
-
-
-/**
- * Get an item from the concurrent queue
- * 
- * If there is no item available then queue_get
- * will block until an item becomes avaible when
- * it will immediately return that item.
- * 
- * @param queue - Pointer to queue to get item from
- * @return item - item retrieved from queue. void* type since it can be 
- *                arbitrary 
- */
-void *queue_get(Queue *queue);
-
-
-#endif
-
+#ifndef QUEUE_H
+#define QUEUE_H
+
+
+/*
+ * Queue - the abstract type of a concurrent queue.
+ * You must provide an implementation of this type but it is hidden from the outside.
+ *
+ */
+typedef struct QueueStruct Queue;
+
+
+/**
+ * Allocate a concurrent queue of a specific size
+ * @param size - The size of memory to allocate to the queue
+ * @return queue - Pointer to the allocated queue
+ */
+Queue *queue_alloc(int size);
+
+
+/**
+ * Allocate a concurrent queue that grows instead of blocking, so putting
+ * an item never waits for a reader
+ * @param size - The number of items it has room for at first
+ * @return queue - Pointer to the allocated queue
+ */
+Queue *queue_alloc_unbounded(int size);
+
+
+/**
+ * Free a concurrent queue and associated memory 
+ *
+ * Don't call this function while the queue is still in use.
+ * (Note, this is a pre-condition to the function and does not need
+ * to be checked)
+ * 
+ * @param queue - Pointer to the queue to free
+ */
+void queue_free(Queue *queue);
+
+
+/**
+ * Place an item into the concurrent queue.
+ * If no space available then queue will block
+ * until a space is available when it will
+ * put the item into the queue and immediatly return.
+ * An unbounded queue grows instead.
+ *  
+ * @param queue - Pointer to the queue to add an item to
+ * @param item - An item to add to queue. Uses void* to hold an arbitrary
+ *               type. User's responsibility to manage memory and ensure
+ *               it is correctly typed.
+ */
+void queue_put(Queue *queue, void *item);
+
+
+/**
+ * Get an item from the concurrent queue
+ * 
+ * If there is no item available then queue_get
+ * will block until an item becomes avaible when
+ * it will immediately return that item.
+ * 
+ * @param queue - Pointer to queue to get item from
+ * @return item - item retrieved from queue. void* type since it can be 
+ *                arbitrary 
+ */
+void *queue_get(Queue *queue);
+
+
+#endif
+
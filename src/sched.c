@@ -0,0 +1,272 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "sched.h"
+
+
+// A queued range
+typedef struct ItemStruct {
+    void *item;
+    int64_t offset;
+    int64_t length;
+    struct ItemStruct *next;
+} Item;
+
+
+struct LaneStruct {
+    int priority;
+    long seq;           // Order the lane was added in
+    int64_t remaining;  // Bytes planned, queued or in flight
+    int64_t planned;    // Bytes planned but not queued yet, see sched_lane_plan
+    Item *head;         // Queued ranges, in the order they were put
+    Item *tail;
+    Lane *next;
+};
+
+
+/*
+ * Sched - a concurrent priority scheduler for download ranges.
+ * Hidden from the outside, see sched.h
+ */
+typedef struct SchedStruct {
+    SchedPolicy policy;
+    Lane *lanes;        // Every lane, including ones with nothing queued
+    long next_seq;
+    int closed;
+
+    pthread_mutex_t mutex_lock;
+    pthread_cond_t ready;   // Signalled when a range is queued or on close
+} Sched;
+
+
+/**
+ * Allocate a scheduler
+ * @param policy - How to order lanes of equal priority
+ * @return sched - Pointer to the allocated scheduler
+ */
+Sched *sched_alloc(SchedPolicy policy) {
+    Sched *sched = (Sched *)calloc(1, sizeof(Sched));
+    sched->policy = policy;
+
+    pthread_mutex_init(&sched->mutex_lock, NULL);
+    pthread_cond_init(&sched->ready, NULL);
+    return sched;
+}
+
+
+/**
+ * Free a scheduler and any lanes left in it
+ * Don't call this function while the scheduler is still in use.
+ * @param sched - Pointer to the scheduler to free
+ */
+void sched_free(Sched *sched) {
+    while (sched->lanes) {
+        sched_lane_free(sched, sched->lanes);
+    }
+    pthread_mutex_destroy(&sched->mutex_lock);
+    pthread_cond_destroy(&sched->ready);
+    free(sched);
+}
+
+
+/**
+ * Add a lane for the ranges of one file
+ * @param sched - Pointer to the scheduler
+ * @param priority - Lanes with a higher priority are always served first
+ * @return lane - Pointer to the new lane
+ */
+Lane *sched_lane_alloc(Sched *sched, int priority) {
+    Lane *lane = (Lane *)calloc(1, sizeof(Lane));
+    lane->priority = priority;
+
+    pthread_mutex_lock(&sched->mutex_lock);
+    lane->seq = sched->next_seq++;
+    lane->next = sched->lanes;
+    sched->lanes = lane;
+    pthread_mutex_unlock(&sched->mutex_lock);
+    return lane;
+}
+
+
+/**
+ * Remove a lane once all of its ranges are done
+ * @param sched - Pointer to the scheduler
+ * @param lane - Pointer to the lane to remove
+ */
+void sched_lane_free(Sched *sched, Lane *lane) {
+    pthread_mutex_lock(&sched->mutex_lock);
+    Lane **link = &sched->lanes;
+    while (*link && *link != lane) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = lane->next;
+    }
+    pthread_mutex_unlock(&sched->mutex_lock);
+
+    while (lane->head) {
+        Item *item = lane->head;
+        lane->head = item->next;
+        free(item);
+    }
+    free(lane);
+}
+
+
+/**
+ * Count bytes of a file whose ranges are queued later towards what is
+ * left of it, so its lane is ordered as if they were queued already
+ * @param sched - Pointer to the scheduler
+ * @param lane - The lane of the file
+ * @param length - Bytes the later sched_put calls add up to
+ */
+void sched_lane_plan(Sched *sched, Lane *lane, int64_t length) {
+    pthread_mutex_lock(&sched->mutex_lock);
+    lane->planned += length;
+    lane->remaining += length;
+    pthread_mutex_unlock(&sched->mutex_lock);
+}
+
+
+/**
+ * Queue a range. Never blocks.
+ * @param sched - Pointer to the scheduler
+ * @param lane - The lane of the file the range belongs to
+ * @param item - The range, returned by sched_get
+ * @param offset - Offset of the range in its file
+ * @param length - Length of the range in bytes
+ */
+void sched_put(Sched *sched, Lane *lane, void *item, int64_t offset, int64_t length) {
+    Item *queued = (Item *)malloc(sizeof(Item));
+    queued->item = item;
+    queued->offset = offset;
+    queued->length = length;
+    queued->next = NULL;
+
+    pthread_mutex_lock(&sched->mutex_lock);
+    if (lane->tail) {
+        lane->tail->next = queued;
+    }
+    else {
+        lane->head = queued;
+    }
+    lane->tail = queued;
+
+    // Bytes that were planned already count towards what is left
+    int64_t counted = length < lane->planned ? length : lane->planned;
+    lane->planned -= counted;
+    lane->remaining += length - counted;
+
+    pthread_cond_signal(&sched->ready);
+    pthread_mutex_unlock(&sched->mutex_lock);
+}
+
+
+// Non zero if lane a should be served before lane b
+static int before(SchedPolicy policy, Lane *a, Lane *b) {
+    if (a->priority != b->priority) {
+        return a->priority > b->priority;
+    }
+    if (policy == SCHED_SHORTEST && a->remaining != b->remaining) {
+        return a->remaining < b->remaining;
+    }
+    if (policy == SCHED_FRONT && a->head->offset != b->head->offset) {
+        return a->head->offset < b->head->offset;
+    }
+    return a->seq < b->seq;
+}
+
+
+// Pop the most urgent range. Caller holds the lock.
+static void *take_locked(Sched *sched) {
+    Lane *best = NULL, *lane;
+
+    // There are only as many lanes as files in flight, so a scan is cheap
+    // and lets the shortest remaining order follow progress as it happens
+    for (lane = sched->lanes; lane; lane = lane->next) {
+        if (lane->head && (!best || before(sched->policy, lane, best))) {
+            best = lane;
+        }
+    }
+    if (!best) {
+        return NULL;
+    }
+
+    Item *queued = best->head;
+    best->head = queued->next;
+    if (!best->head) best->tail = NULL;
+
+    void *item = queued->item;
+    free(queued);
+    return item;
+}
+
+
+/**
+ * Get the most urgent range, blocking until one is queued
+ * @param sched - Pointer to the scheduler
+ * @return item - The range, or NULL once the scheduler is closed and empty
+ */
+void *sched_get(Sched *sched) {
+    pthread_mutex_lock(&sched->mutex_lock);
+    void *item = take_locked(sched);
+    while (!item && !sched->closed) {
+        pthread_cond_wait(&sched->ready, &sched->mutex_lock);
+        item = take_locked(sched);
+    }
+    pthread_mutex_unlock(&sched->mutex_lock);
+    return item;
+}
+
+
+/**
+ * Get the most urgent range without blocking
+ * @param sched - Pointer to the scheduler
+ * @return item - The range, or NULL if nothing is queued
+ */
+void *sched_try_get(Sched *sched) {
+    pthread_mutex_lock(&sched->mutex_lock);
+    void *item = take_locked(sched);
+    pthread_mutex_unlock(&sched->mutex_lock);
+    return item;
+}
+
+
+/**
+ * @param sched - Pointer to the scheduler
+ * @param lane - Pointer to a lane
+ * @return int - 1 if the lane has ranges no worker has taken yet,
+ *               including planned ones not queued yet
+ */
+int sched_lane_queued(Sched *sched, Lane *lane) {
+    pthread_mutex_lock(&sched->mutex_lock);
+    int queued = lane->head != NULL || lane->planned > 0;
+    pthread_mutex_unlock(&sched->mutex_lock);
+    return queued;
+}
+
+
+/**
+ * Record that a range handed out by sched_get has finished, so its
+ * bytes no longer count towards what is left of its file
+ * @param sched - Pointer to the scheduler
+ * @param lane - The lane of the range
+ * @param length - Length of the range in bytes
+ */
+void sched_done(Sched *sched, Lane *lane, int64_t length) {
+    pthread_mutex_lock(&sched->mutex_lock);
+    lane->remaining -= length;
+    pthread_mutex_unlock(&sched->mutex_lock);
+}
+
+
+/**
+ * Wake every waiting sched_get. Once nothing is queued they return NULL.
+ * @param sched - Pointer to the scheduler
+ */
+void sched_close(Sched *sched) {
+    pthread_mutex_lock(&sched->mutex_lock);
+    sched->closed = 1;
+    pthread_cond_broadcast(&sched->ready);
+    pthread_mutex_unlock(&sched->mutex_lock);
+}
@@ -0,0 +1,122 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdint.h>
+
+
+/*
+ * Sched - a concurrent priority scheduler for download ranges.
+ * Ranges are put into lanes, one lane per file. sched_get always hands
+ * out a range from the lane with the highest priority, choosing between
+ * lanes of equal priority by the scheduler's policy. Within a lane
+ * ranges come out in the order they were put.
+ */
+typedef struct SchedStruct Sched;
+
+typedef struct LaneStruct Lane;
+
+
+// How lanes of equal priority are ordered
+typedef enum {
+    SCHED_FIFO,         // The file queued first
+    SCHED_SHORTEST,     // The file with the fewest bytes left, minimises mean completion time
+    SCHED_FRONT         // The range nearest the start of its file, for streaming consumers
+} SchedPolicy;
+
+
+/**
+ * Allocate a scheduler
+ * @param policy - How to order lanes of equal priority
+ * @return sched - Pointer to the allocated scheduler
+ */
+Sched *sched_alloc(SchedPolicy policy);
+
+
+/**
+ * Free a scheduler and any lanes left in it
+ * Don't call this function while the scheduler is still in use.
+ * @param sched - Pointer to the scheduler to free
+ */
+void sched_free(Sched *sched);
+
+
+/**
+ * Add a lane for the ranges of one file
+ * @param sched - Pointer to the scheduler
+ * @param priority - Lanes with a higher priority are always served first
+ * @return lane - Pointer to the new lane
+ */
+Lane *sched_lane_alloc(Sched *sched, int priority);
+
+
+/**
+ * Remove a lane once all of its ranges are done
+ * @param sched - Pointer to the scheduler
+ * @param lane - Pointer to the lane to remove
+ */
+void sched_lane_free(Sched *sched, Lane *lane);
+
+
+/**
+ * Count bytes of a file whose ranges are queued later towards what is
+ * left of it, so its lane is ordered as if they were queued already
+ * @param sched - Pointer to the scheduler
+ * @param lane - The lane of the file
+ * @param length - Bytes the later sched_put calls add up to
+ */
+void sched_lane_plan(Sched *sched, Lane *lane, int64_t length);
+
+
+/**
+ * Queue a range. Never blocks.
+ * @param sched - Pointer to the scheduler
+ * @param lane - The lane of the file the range belongs to
+ * @param item - The range, returned by sched_get
+ * @param offset - Offset of the range in its file
+ * @param length - Length of the range in bytes
+ */
+void sched_put(Sched *sched, Lane *lane, void *item, int64_t offset, int64_t length);
+
+
+/**
+ * Get the most urgent range, blocking until one is queued
+ * @param sched - Pointer to the scheduler
+ * @return item - The range, or NULL once the scheduler is closed and empty
+ */
+void *sched_get(Sched *sched);
+
+
+/**
+ * Get the most urgent range without blocking
+ * @param sched - Pointer to the scheduler
+ * @return item - The range, or NULL if nothing is queued
+ */
+void *sched_try_get(Sched *sched);
+
+
+/**
+ * @param sched - Pointer to the scheduler
+ * @param lane - Pointer to a lane
+ * @return int - 1 if the lane has ranges no worker has taken yet,
+ *               including planned ones not queued yet
+ */
+int sched_lane_queued(Sched *sched, Lane *lane);
+
+
+/**
+ * Record that a range handed out by sched_get has finished, so its
+ * bytes no longer count towards what is left of its file
+ * @param sched - Pointer to the scheduler
+ * @param lane - The lane of the range
+ * @param length - Length of the range in bytes
+ */
+void sched_done(Sched *sched, Lane *lane, int64_t length);
+
+
+/**
+ * Wake every waiting sched_get. Once nothing is queued they return NULL.
+ * @param sched - Pointer to the scheduler
+ */
+void sched_close(Sched *sched);
+
+#endif
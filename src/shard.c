@@ -0,0 +1,523 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shard.h"
+
+#define SHARD_MAGIC 0x6472616873ULL     // "shard"
+#define NAME_SIZE 256
+#define ATTACH_POLL_US 10000
+
+#define handle_error(msg) \
+        do { perror(msg); exit(EXIT_FAILURE); } while (0)
+
+// A state word holds the state in its low half and the owner pid in its high half
+#define STATE(word) ((int)((word) & 0xffffffff))
+#define OWNER(word) ((pid_t)((word) >> 32))
+#define WORD(state, pid) (((uint64_t)(pid) << 32) | (uint64_t)(state))
+
+// File states
+#define FILE_NEW 0          // Listed, not probed yet
+#define FILE_PLANNING 1     // Being probed by its owner
+#define FILE_PLANNED 2      // Ranges published
+#define FILE_COMPLETE 3     // Every range downloaded, waiting to be merged
+#define FILE_MERGING 4      // Being merged by its owner
+#define FILE_DONE 5
+
+// Range states
+#define RANGE_EMPTY 0       // Reserved, not published yet
+#define RANGE_FREE 1
+#define RANGE_CLAIMED 2     // Being downloaded by its owner
+#define RANGE_DONE 3
+
+
+typedef struct {
+    uint64_t magic;
+    int ready;              // Set once the creator has filled in the files
+    int num_files;
+    int num_ranges;         // Ranges reserved so far
+    int files_done;
+} Header;
+
+
+typedef struct {
+    uint64_t state;
+    int file;
+    int attempts;       // Failed tries so far
+    int64_t offset;
+    int64_t length;
+} Range;
+
+
+// Everything lives in one segment, with the tables after the header
+typedef struct {
+    Header header;
+    ShardFile files[SHARD_MAX_FILES];
+    Range ranges[SHARD_MAX_RANGES];
+} Segment;
+
+
+/*
+ * Shard - a URL list shared by several downloader processes.
+ * Hidden from the outside, see shard.h
+ */
+typedef struct ShardStruct {
+    Segment *segment;
+    char name[NAME_SIZE];
+    pid_t pid;
+    int range_cursor;       // Ranges below this are known to be done
+    int file_cursor;        // Files below this are known to be done
+} Shard;
+
+
+static uint64_t load(uint64_t *word) {
+    return __atomic_load_n(word, __ATOMIC_ACQUIRE);
+}
+
+
+static int swap(uint64_t *word, uint64_t expected, uint64_t desired) {
+    return __atomic_compare_exchange_n(word, &expected, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+
+static int is_dead(pid_t pid) {
+    return pid > 0 && kill(pid, 0) == -1 && errno == ESRCH;
+}
+
+
+// Fill in the files of a new segment from the url file
+static void fill(Segment *segment, const char *url_file) {
+    FILE *fp = fopen(url_file, "r");
+    char *line = NULL;
+    size_t size = 0;
+
+    if (fp == NULL) {
+        handle_error("url_file");
+    }
+
+    ListEntry entry;
+    ssize_t length;
+
+    while ((length = getline(&line, &size, fp)) != -1) {
+        if (list_parse_line(line, length, &entry) == -1) {
+            continue;
+        }
+        if (segment->header.num_files == SHARD_MAX_FILES) {
+            fprintf(stderr, "url_file has more than %d urls\n", SHARD_MAX_FILES);
+            exit(EXIT_FAILURE);
+        }
+
+        ShardFile *file = &segment->files[segment->header.num_files++];
+        strcpy(file->url, entry.url);
+        strcpy(file->ranges, entry.ranges);
+        file->priority = entry.priority;
+    }
+
+    free(line);
+    fclose(fp);
+}
+
+
+/**
+ * Attach to the shared list called name, creating it from url_file if no
+ * process has created it yet. Lines of url_file are a URL optionally
+ * followed by a priority, as for a normal download.
+ * @param name - Name of the list, the same for every cooperating process
+ * @param url_file - Path of the URL list, read only by the creator
+ * @return shard - Pointer to the attached list
+ */
+Shard *shard_open(const char *name, const char *url_file) {
+    Shard *shard = (Shard *)calloc(1, sizeof(Shard));
+    snprintf(shard->name, NAME_SIZE, "/downloader-%s", name);
+    shard->pid = getpid();
+
+    int created = 1;
+    int fd = shm_open(shard->name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd == -1 && errno == EEXIST) {
+        created = 0;
+        fd = shm_open(shard->name, O_RDWR, 0600);
+    }
+    if (fd == -1) {
+        handle_error("shm_open");
+    }
+
+    if (created && ftruncate(fd, sizeof(Segment)) == -1) {
+        handle_error("ftruncate");
+    }
+
+    // The creator may not have sized the segment yet
+    struct stat st;
+    while (fstat(fd, &st) == 0 && st.st_size < sizeof(Segment)) {
+        usleep(ATTACH_POLL_US);
+    }
+
+    shard->segment = mmap(NULL, sizeof(Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shard->segment == MAP_FAILED) {
+        handle_error("mmap");
+    }
+    close(fd);
+
+    Header *header = &shard->segment->header;
+    if (created) {
+        fill(shard->segment, url_file);
+        header->magic = SHARD_MAGIC;
+        __atomic_store_n(&header->ready, 1, __ATOMIC_RELEASE);
+    }
+
+    while (!__atomic_load_n(&header->ready, __ATOMIC_ACQUIRE)) {
+        usleep(ATTACH_POLL_US);
+    }
+    if (header->magic != SHARD_MAGIC) {
+        fprintf(stderr, "%s is not a downloader list\n", shard->name);
+        exit(EXIT_FAILURE);
+    }
+
+    return shard;
+}
+
+
+/**
+ * Detach from a shared list. Once every file is done the segment is
+ * removed, so the next run with the same name starts over.
+ * @param shard - Pointer to the list
+ */
+void shard_close(Shard *shard) {
+    if (shard_finished(shard)) {
+        shm_unlink(shard->name);        // Others may have removed it already
+    }
+    munmap(shard->segment, sizeof(Segment));
+    free(shard);
+}
+
+
+static int claim_range(Shard *shard, ShardClaim *claim) {
+    Segment *segment = shard->segment;
+    int num_ranges = __atomic_load_n(&segment->header.num_ranges, __ATOMIC_ACQUIRE);
+    int i;
+
+    // Done is final, so the cursor only has to move forwards
+    while (shard->range_cursor < num_ranges && STATE(load(&segment->ranges[shard->range_cursor].state)) == RANGE_DONE) {
+        ++shard->range_cursor;
+    }
+
+    for (i = shard->range_cursor; i < num_ranges; ++i) {
+        Range *range = &segment->ranges[i];
+        ShardFile *file = &segment->files[range->file];
+        uint64_t word = load(&range->state);
+
+        // Ranges published by a planner that died before finishing are
+        // superseded once the file is planned again
+        if (STATE(word) == RANGE_FREE && (i < file->first_range || i >= file->first_range + file->num_ranges)) {
+            swap(&range->state, word, WORD(RANGE_DONE, 0));
+            continue;
+        }
+
+        if (STATE(word) == RANGE_FREE && swap(&range->state, word, WORD(RANGE_CLAIMED, shard->pid))) {
+            claim->file = range->file;
+            claim->range = i;
+            claim->offset = range->offset;
+            claim->length = range->length;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * Claim the next piece of work. Ranges are preferred over planning new
+ * files, so files are finished before more are started.
+ * @param shard - Pointer to the list
+ * @param claim - Filled in with what was claimed
+ * @return kind - What was claimed, SHARD_NONE if nothing is available
+ */
+ShardClaimKind shard_claim(Shard *shard, ShardClaim *claim) {
+    Segment *segment = shard->segment;
+    int i;
+
+    if (claim_range(shard, claim)) {
+        return SHARD_RANGE;
+    }
+
+    while (shard->file_cursor < segment->header.num_files && STATE(load(&segment->files[shard->file_cursor].state)) == FILE_DONE) {
+        ++shard->file_cursor;
+    }
+
+    for (i = shard->file_cursor; i < segment->header.num_files; ++i) {
+        ShardFile *file = &segment->files[i];
+        uint64_t word = load(&file->state);
+
+        claim->file = i;
+        if (STATE(word) == FILE_NEW && swap(&file->state, word, WORD(FILE_PLANNING, shard->pid))) {
+            return SHARD_PLAN;
+        }
+        if (STATE(word) == FILE_COMPLETE && swap(&file->state, word, WORD(FILE_MERGING, shard->pid))) {
+            return SHARD_MERGE;
+        }
+    }
+    return SHARD_NONE;
+}
+
+
+/**
+ * Publish the ranges of a file claimed with SHARD_PLAN, given explicitly
+ * or as num_ranges chunks of bytes each if ranges is NULL. The file fails
+ * if its ranges do not fit in the range table.
+ */
+static void publish(Shard *shard, int file, const HttpHead *head, int64_t bytes,
+                    const HttpRange *ranges, int num_ranges) {
+    Segment *segment = shard->segment;
+    ShardFile *planned = &segment->files[file];
+    int i;
+
+    // Only reserve ranges that fit, so the table never counts past its end
+    int first = __atomic_load_n(&segment->header.num_ranges, __ATOMIC_ACQUIRE);
+    do {
+        if (first + num_ranges > SHARD_MAX_RANGES) {
+            fprintf(stderr, "shared list has more than %d ranges\n", SHARD_MAX_RANGES);
+            shard_fail(shard, file);
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&segment->header.num_ranges, &first, first + num_ranges,
+                                          0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    // The file must be complete before its ranges can be claimed and finished
+    planned->head = *head;
+    planned->bytes = bytes;
+    planned->num_ranges = num_ranges;
+    planned->first_range = first;
+    planned->done = 0;
+    planned->sparse = ranges != NULL;
+
+    for (i = 0; i < num_ranges; ++i) {
+        Range *range = &segment->ranges[first + i];
+        range->file = file;
+        range->attempts = 0;
+        if (ranges) {
+            range->offset = ranges[i].offset;
+            range->length = ranges[i].length;
+        }
+        else {
+            range->offset = i * bytes;
+            range->length = bytes;
+            if (range->offset + range->length > head->content_length) {
+                range->length = head->content_length - range->offset;
+            }
+        }
+        __atomic_store_n(&range->state, WORD(RANGE_FREE, 0), __ATOMIC_RELEASE);
+    }
+
+    // Whoever finishes the last range may already have moved the file on
+    swap(&planned->state, WORD(FILE_PLANNING, shard->pid), WORD(FILE_PLANNED, shard->pid));
+}
+
+
+/**
+ * Publish the ranges of a file claimed with SHARD_PLAN, or fail the file
+ * if the range table has no room for them
+ * @param shard - Pointer to the list
+ * @param file - Index of the file
+ * @param head - The probe response
+ * @param bytes - The chunk size, see plan_chunks
+ * @param num_ranges - The number of ranges of bytes each, the last one
+ *                     ending at the end of the file
+ */
+void shard_plan(Shard *shard, int file, const HttpHead *head, int64_t bytes, int num_ranges) {
+    publish(shard, file, head, bytes, NULL, num_ranges);
+}
+
+
+/**
+ * Publish the ranges of a file claimed with SHARD_PLAN that is only
+ * wanted in part, see plan_ranges
+ * @param shard - Pointer to the list
+ * @param file - Index of the file
+ * @param head - The probe response
+ * @param ranges - The planned ranges
+ * @param num_ranges - The number of ranges
+ */
+void shard_plan_ranges(Shard *shard, int file, const HttpHead *head, const HttpRange *ranges, int num_ranges) {
+    publish(shard, file, head, 0, ranges, num_ranges);
+}
+
+
+/**
+ * Copy the ranges of a planned file
+ * @param shard - Pointer to the list
+ * @param file - Index of the file
+ * @param ranges - Room for the file's num_ranges ranges
+ */
+void shard_ranges(Shard *shard, int file, HttpRange *ranges) {
+    ShardFile *planned = &shard->segment->files[file];
+    int i;
+
+    for (i = 0; i < planned->num_ranges; ++i) {
+        ranges[i].offset = shard->segment->ranges[planned->first_range + i].offset;
+        ranges[i].length = shard->segment->ranges[planned->first_range + i].length;
+    }
+}
+
+
+/**
+ * Mark a file claimed with SHARD_PLAN as failed, e.g. because its probe
+ * failed, so no process downloads it
+ * @param shard - Pointer to the list
+ * @param file - Index of the file
+ */
+void shard_fail(Shard *shard, int file) {
+    __atomic_store_n(&shard->segment->files[file].failed, 1, __ATOMIC_RELEASE);
+    shard_file_done(shard, file);
+}
+
+
+/**
+ * Mark a file claimed with SHARD_PLAN as done without downloading it,
+ * e.g. because it was restored from the cache
+ * @param shard - Pointer to the list
+ * @param file - Index of the file
+ */
+void shard_skip(Shard *shard, int file) {
+    shard_file_done(shard, file);
+}
+
+
+/**
+ * Mark a range claimed with SHARD_RANGE as downloaded
+ * @param shard - Pointer to the list
+ * @param range - Index of the range
+ * @return int - 1 if that was the last range of its file and the caller
+ *               now owns merging it, 0 otherwise
+ */
+int shard_range_done(Shard *shard, int range) {
+    Segment *segment = shard->segment;
+    Range *done = &segment->ranges[range];
+    ShardFile *file = &segment->files[done->file];
+
+    __atomic_store_n(&done->state, WORD(RANGE_DONE, shard->pid), __ATOMIC_RELEASE);
+    if (range < file->first_range || range >= file->first_range + file->num_ranges) {
+        return 0;       // Superseded by a later plan of the file
+    }
+    if (__atomic_add_fetch(&file->done, 1, __ATOMIC_ACQ_REL) != file->num_ranges) {
+        return 0;
+    }
+
+    // Last range, so this process merges. The planner may not have
+    // marked the file planned yet, so take it from either state.
+    uint64_t word = load(&file->state);
+    while (STATE(word) == FILE_PLANNING || STATE(word) == FILE_PLANNED) {
+        if (swap(&file->state, word, WORD(FILE_MERGING, shard->pid))) {
+            return 1;
+        }
+        word = load(&file->state);
+    }
+    return 0;
+}
+
+
+/**
+ * Hand back a range claimed with SHARD_RANGE that could not be
+ * downloaded, so it is tried again. After SHARD_MAX_ATTEMPTS tries the
+ * file is marked failed instead and the range counts as done, so the
+ * file is finished without being merged.
+ * @param shard - Pointer to the list
+ * @param range - Index of the range
+ * @return int - As shard_range_done
+ */
+int shard_range_failed(Shard *shard, int range) {
+    Segment *segment = shard->segment;
+    Range *failed = &segment->ranges[range];
+
+    // Only the owner of the claim changes attempts
+    if (++failed->attempts < SHARD_MAX_ATTEMPTS) {
+        __atomic_store_n(&failed->state, WORD(RANGE_FREE, 0), __ATOMIC_RELEASE);
+        return 0;
+    }
+    __atomic_store_n(&segment->files[failed->file].failed, 1, __ATOMIC_RELEASE);
+    return shard_range_done(shard, range);
+}
+
+
+/**
+ * Mark a file as merged
+ * @param shard - Pointer to the list
+ * @param file - Index of the file
+ */
+void shard_file_done(Shard *shard, int file) {
+    Segment *segment = shard->segment;
+
+    __atomic_store_n(&segment->files[file].state, WORD(FILE_DONE, shard->pid), __ATOMIC_RELEASE);
+    __atomic_add_fetch(&segment->header.files_done, 1, __ATOMIC_ACQ_REL);
+}
+
+
+// Non zero if every range of a planned file is done
+static int all_ranges_done(Segment *segment, ShardFile *file) {
+    int i;
+    for (i = 0; i < file->num_ranges; ++i) {
+        if (STATE(load(&segment->ranges[file->first_range + i].state)) != RANGE_DONE) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/**
+ * Hand the claims of processes that have died back to the others
+ * @param shard - Pointer to the list
+ */
+void shard_reclaim(Shard *shard) {
+    Segment *segment = shard->segment;
+    int num_ranges = __atomic_load_n(&segment->header.num_ranges, __ATOMIC_ACQUIRE);
+    int i;
+
+    for (i = shard->range_cursor; i < num_ranges; ++i) {
+        uint64_t word = load(&segment->ranges[i].state);
+        if (STATE(word) == RANGE_CLAIMED && is_dead(OWNER(word))) {
+            swap(&segment->ranges[i].state, word, WORD(RANGE_FREE, 0));
+        }
+    }
+
+    for (i = shard->file_cursor; i < segment->header.num_files; ++i) {
+        ShardFile *file = &segment->files[i];
+        uint64_t word = load(&file->state);
+
+        if (STATE(word) == FILE_PLANNING && is_dead(OWNER(word))) {
+            // Ranges it reserved are lost, the file is planned again
+            swap(&file->state, word, WORD(FILE_NEW, 0));
+        }
+        else if (STATE(word) == FILE_MERGING && is_dead(OWNER(word))) {
+            swap(&file->state, word, WORD(FILE_COMPLETE, 0));
+        }
+        else if (STATE(word) == FILE_PLANNED && all_ranges_done(segment, file)) {
+            // A process died between finishing the last range and counting it
+            swap(&file->state, word, WORD(FILE_COMPLETE, 0));
+        }
+    }
+}
+
+
+/**
+ * @param shard - Pointer to the list
+ * @return int - 1 once every file of the list is done
+ */
+int shard_finished(Shard *shard) {
+    Header *header = &shard->segment->header;
+    return __atomic_load_n(&header->files_done, __ATOMIC_ACQUIRE) == header->num_files;
+}
+
+
+/**
+ * @param shard - Pointer to the list
+ * @param file - Index of a file
+ * @return file - The shared record of the file
+ */
+const ShardFile *shard_file(Shard *shard, int file) {
+    return &shard->segment->files[file];
+}
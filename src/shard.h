@@ -0,0 +1,193 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdint.h>
+
+#include "http.h"
+#include "list.h"
+
+#define SHARD_MAX_FILES 4096        // URLs a shared list may hold
+#define SHARD_MAX_RANGES 262144     // Ranges over all files of a shared list
+#define SHARD_URL_SIZE LIST_URL_SIZE
+#define SHARD_MAX_ATTEMPTS 3        // Tries at a range before its file is failed
+
+
+/*
+ * Shard - a URL list shared by several downloader processes.
+ * The files and ranges of the list live in a POSIX shared memory segment.
+ * Every state change is a compare-and-swap on a word holding the state and
+ * the pid of the process that made it, so processes claim files to probe,
+ * ranges to download and files to merge without any lock. Claims held by
+ * a process that has died are handed back by shard_reclaim.
+ */
+typedef struct ShardStruct Shard;
+
+
+// A file of the shared list, see shard_file
+typedef struct {
+    uint64_t state;             // State and owner pid, see shard.c
+    char url[SHARD_URL_SIZE];
+    int priority;
+    char ranges[LIST_RANGES_SIZE];  // Byte ranges wanted, "" for the whole file
+    HttpHead head;              // Probe response, valid once planned
+    int64_t bytes;              // Chunk size, valid once planned
+    int num_ranges;             // Valid once planned
+    int first_range;            // Index of the first range in the range table
+    int done;                   // Ranges downloaded so far
+    int sparse;                 // Set if planned by shard_plan_ranges
+    int failed;                 // Set if it must not be merged, see shard_range_failed
+
+} ShardFile;
+
+
+// What shard_claim handed to the caller
+typedef enum {
+    SHARD_NONE,         // Nothing to claim right now
+    SHARD_PLAN,         // Probe the file and call shard_plan or shard_skip
+    SHARD_RANGE,        // Download the range and call shard_range_done
+    SHARD_MERGE         // Merge the file's chunks and call shard_file_done
+} ShardClaimKind;
+
+
+typedef struct {
+    int file;           // Index of the file
+    int range;          // Index of the range for SHARD_RANGE
+    int64_t offset;     // Offset of the range for SHARD_RANGE
+    int64_t length;     // Length of the range for SHARD_RANGE, 0 if unknown
+
+} ShardClaim;
+
+
+/**
+ * Attach to the shared list called name, creating it from url_file if no
+ * process has created it yet. Lines of url_file are read as for a normal
+ * download, see list_parse_line.
+ * @param name - Name of the list, the same for every cooperating process
+ * @param url_file - Path of the URL list, read only by the creator
+ * @return shard - Pointer to the attached list
+ */
+Shard *shard_open(const char *name, const char *url_file);
+
+
+/**
+ * Detach from a shared list. Once every file is done the segment is
+ * removed, so the next run with the same name starts over.
+ * @param shard - Pointer to the list
+ */
+void shard_close(Shard *shard);
+
+
+/**
+ * Claim the next piece of work. Ranges are preferred over planning new
+ * files, so files are finished before more are started.
+ * @param shard - Pointer to the list
+ * @param claim - Filled in with what was claimed
+ * @return kind - What was claimed, SHARD_NONE if nothing is available
+ */
+ShardClaimKind shard_claim(Shard *shard, ShardClaim *claim);
+
+
+/**
+ * Publish the ranges of a file claimed with SHARD_PLAN, or fail the file
+ * if the range table has no room for them
+ * @param shard - Pointer to the list
+ * @param file - Index of the file
+ * @param head - The probe response
+ * @param bytes - The chunk size, see plan_chunks
+ * @param num_ranges - The number of ranges of bytes each, the last one
+ *                     ending at the end of the file
+ */
+void shard_plan(Shard *shard, int file, const HttpHead *head, int64_t bytes, int num_ranges);
+
+
+/**
+ * Publish the ranges of a file claimed with SHARD_PLAN that is only
+ * wanted in part, see plan_ranges
+ * @param shard - Pointer to the list
+ * @param file - Index of the file
+ * @param head - The probe response
+ * @param ranges - The planned ranges
+ * @param num_ranges - The number of ranges
+ */
+void shard_plan_ranges(Shard *shard, int file, const HttpHead *head, const HttpRange *ranges, int num_ranges);
+
+
+/**
+ * Copy the ranges of a planned file
+ * @param shard - Pointer to the list
+ * @param file - Index of the file
+ * @param ranges - Room for the file's num_ranges ranges
+ */
+void shard_ranges(Shard *shard, int file, HttpRange *ranges);
+
+
+/**
+ * Mark a file claimed with SHARD_PLAN as failed, e.g. because its probe
+ * failed, so no process downloads it
+ * @param shard - Pointer to the list
+ * @param file - Index of the file
+ */
+void shard_fail(Shard *shard, int file);
+
+
+/**
+ * Mark a file claimed with SHARD_PLAN as done without downloading it,
+ * e.g. because it was restored from the cache
+ * @param shard - Pointer to the list
+ * @param file - Index of the file
+ */
+void shard_skip(Shard *shard, int file);
+
+
+/**
+ * Mark a range claimed with SHARD_RANGE as downloaded
+ * @param shard - Pointer to the list
+ * @param range - Index of the range
+ * @return int - 1 if that was the last range of its file and the caller
+ *               now owns merging it, 0 otherwise
+ */
+int shard_range_done(Shard *shard, int range);
+
+
+/**
+ * Hand back a range claimed with SHARD_RANGE that could not be
+ * downloaded, so it is tried again. After SHARD_MAX_ATTEMPTS tries the
+ * file is marked failed instead and the range counts as done, so the
+ * file is finished without being merged.
+ * @param shard - Pointer to the list
+ * @param range - Index of the range
+ * @return int - As shard_range_done
+ */
+int shard_range_failed(Shard *shard, int range);
+
+
+/**
+ * Mark a file as merged
+ * @param shard - Pointer to the list
+ * @param file - Index of the file
+ */
+void shard_file_done(Shard *shard, int file);
+
+
+/**
+ * Hand the claims of processes that have died back to the others
+ * @param shard - Pointer to the list
+ */
+void shard_reclaim(Shard *shard);
+
+
+/**
+ * @param shard - Pointer to the list
+ * @return int - 1 once every file of the list is done
+ */
+int shard_finished(Shard *shard);
+
+
+/**
+ * @param shard - Pointer to the list
+ * @param file - Index of a file
+ * @return file - The shared record of the file
+ */
+const ShardFile *shard_file(Shard *shard, int file);
+
+#endif
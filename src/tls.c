@@ -0,0 +1,435 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#include "tls.h"
+#include "coro.h"
+
+#define HOST_SIZE 256
+#define MAX_SESSIONS 8          // Sessions kept per server, TLS 1.3 servers hand out two per connection
+
+
+// Sessions kept for one server, most recent last
+typedef struct ServerStruct {
+    char host[HOST_SIZE];
+    int port;
+    SSL_SESSION *sessions[MAX_SESSIONS];
+    int num_sessions;
+    struct ServerStruct *next;
+} Server;
+
+
+/*
+ * Tls - the client side of TLS for https:// URLs.
+ * Hidden from the outside, see tls.h
+ */
+typedef struct TlsStruct {
+    SSL_CTX *ctx;
+
+    // Guarded by mutex_lock
+    Server *servers;
+    TlsStats stats;
+    pthread_mutex_t mutex_lock;
+} Tls;
+
+
+/*
+ * TlsConn - TLS on one connected socket.
+ * Hidden from the outside, see tls.h
+ */
+typedef struct TlsConnStruct {
+    Tls *tls;
+    SSL *ssl;
+    int fd;
+    char host[HOST_SIZE];
+    int port;
+    char protocol[HOST_SIZE];   // Agreed by ALPN, "" if none
+    int failed;                 // Set once the connection failed, its session is then dropped
+    int block;                  // Set if waits must not yield, see tls_block
+    pthread_mutex_t mutex_lock; // An SSL object must not be used by two threads at once
+} TlsConn;
+
+
+// Find the sessions kept for a server. Caller holds the lock.
+static Server *find_server(Tls *tls, const char *host, int port, int create) {
+    Server *server;
+
+    for (server = tls->servers; server; server = server->next) {
+        if (server->port == port && strcmp(server->host, host) == 0) {
+            return server;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    server = (Server *)calloc(1, sizeof(Server));
+    snprintf(server->host, HOST_SIZE, "%s", host);
+    server->port = port;
+    server->next = tls->servers;
+    tls->servers = server;
+    return server;
+}
+
+
+// Drop a kept session. Caller holds the lock.
+static void drop_session(Server *server, int index) {
+    SSL_SESSION_free(server->sessions[index]);
+    memmove(server->sessions + index, server->sessions + index + 1,
+        (server->num_sessions - index - 1) * sizeof(SSL_SESSION *));
+    --server->num_sessions;
+}
+
+
+// Keep a session the server handed out. Taking the reference returns 1.
+static int new_session(SSL *ssl, SSL_SESSION *session) {
+    TlsConn *conn = (TlsConn *)SSL_get_app_data(ssl);
+    Tls *tls = conn->tls;
+
+    pthread_mutex_lock(&tls->mutex_lock);
+    Server *server = find_server(tls, conn->host, conn->port, 1);
+    if (server->num_sessions == MAX_SESSIONS) {
+        drop_session(server, 0);
+    }
+    server->sessions[server->num_sessions++] = session;
+    pthread_mutex_unlock(&tls->mutex_lock);
+    return 1;
+}
+
+
+/**
+ * Choose a kept session to resume with. A TLS 1.3 ticket is best used
+ * once, so the most recent one is taken while others are left; the last
+ * is shared rather than doing a full handshake.
+ * @return session - A session with a reference for the caller, or NULL
+ */
+static SSL_SESSION *take_session(Tls *tls, const char *host, int port) {
+    SSL_SESSION *session = NULL;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&tls->mutex_lock);
+    Server *server = find_server(tls, host, port, 0);
+    while (server && server->num_sessions > 0) {
+        SSL_SESSION *last = server->sessions[server->num_sessions - 1];
+
+        if (!SSL_SESSION_is_resumable(last) || SSL_SESSION_get_time(last) + SSL_SESSION_get_timeout(last) <= now) {
+            drop_session(server, server->num_sessions - 1);
+            continue;
+        }
+        if (server->num_sessions > 1) {
+            session = last;     // The caller takes the kept reference
+            --server->num_sessions;
+        }
+        else if (SSL_SESSION_up_ref(last)) {
+            session = last;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&tls->mutex_lock);
+    return session;
+}
+
+
+/**
+ * Allocate a TLS client context. Servers are verified against the system's
+ * trusted certificates, and those in ca_file if given.
+ * @param ca_file - A PEM file of further certificates to trust, or NULL
+ * @return tls - Pointer to the allocated context, NULL if ca_file could
+ *               not be loaded
+ */
+Tls *tls_alloc(const char *ca_file) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (!ctx) {
+        fprintf(stderr, "could not create a TLS context\n");
+        return NULL;
+    }
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    SSL_CTX_set_default_verify_paths(ctx);
+    if (ca_file && SSL_CTX_load_verify_locations(ctx, ca_file, NULL) != 1) {
+        fprintf(stderr, "could not load certificates from %s\n", ca_file);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+
+    // Sessions are kept per server here rather than in OpenSSL's cache,
+    // which only servers look sessions up in
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, new_session);
+
+    // Servers that close without close_notify end the content like plain HTTP
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);   // Used where the kernel has the tls module
+#endif
+
+    Tls *tls = (Tls *)calloc(1, sizeof(Tls));
+    tls->ctx = ctx;
+    pthread_mutex_init(&tls->mutex_lock, NULL);
+    return tls;
+}
+
+
+/**
+ * Free a TLS context and the sessions it kept. No connection may be left.
+ * @param tls - Pointer to the context to free
+ */
+void tls_free(Tls *tls) {
+    while (tls->servers) {
+        Server *server = tls->servers;
+        tls->servers = server->next;
+        while (server->num_sessions > 0) {
+            drop_session(server, server->num_sessions - 1);
+        }
+        free(server);
+    }
+    SSL_CTX_free(tls->ctx);
+    pthread_mutex_destroy(&tls->mutex_lock);
+    free(tls);
+}
+
+
+// Why the last call on a connection failed
+static const char *failure(TlsConn *conn) {
+    long result = SSL_get_verify_result(conn->ssl);
+    unsigned long error = ERR_peek_last_error();
+
+    if (result != X509_V_OK) {
+        return X509_verify_cert_error_string(result);
+    }
+    return error ? ERR_reason_error_string(error) : strerror(errno);
+}
+
+
+// Wait until the socket is readable, or writable if write is set
+static void wait_socket(TlsConn *conn, int write) {
+    if (conn->block) {
+        struct pollfd pollfd = { .fd = conn->fd, .events = write ? POLLOUT : POLLIN };
+        while (poll(&pollfd, 1, -1) == -1 && errno == EINTR) {}
+    }
+    else {
+        coro_wait(conn->fd, write);     // Yields inside a coroutine
+    }
+}
+
+
+/**
+ * Run one call on the connection's SSL object until it completes, waiting
+ * for the socket without holding the lock when it would block
+ * @param call - The call, e.g. a wrapper of SSL_read_ex
+ * @return int - 1 on success, 0 once the server closed the connection,
+ *               -1 on failure
+ */
+static int run(TlsConn *conn, int (*call)(SSL *ssl, void *buf, size_t count, size_t *done),
+               void *buf, size_t count, size_t *done) {
+    while (1) {
+        pthread_mutex_lock(&conn->mutex_lock);
+        ERR_clear_error();
+        int ok = call(conn->ssl, buf, count, done);
+        int error = ok == 1 ? SSL_ERROR_NONE : SSL_get_error(conn->ssl, ok);
+        pthread_mutex_unlock(&conn->mutex_lock);
+
+        switch (error) {
+        case SSL_ERROR_NONE:
+            return 1;
+        case SSL_ERROR_WANT_READ:
+            wait_socket(conn, 0);
+            break;
+        case SSL_ERROR_WANT_WRITE:
+            wait_socket(conn, 1);
+            break;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        default:
+            conn->failed = 1;
+            return -1;
+        }
+    }
+}
+
+
+static int do_handshake(SSL *ssl, void *buf, size_t count, size_t *done) {
+    return SSL_connect(ssl);
+}
+
+
+static int do_read(SSL *ssl, void *buf, size_t count, size_t *done) {
+    return SSL_read_ex(ssl, buf, count, done);
+}
+
+
+static int do_write(SSL *ssl, void *buf, size_t count, size_t *done) {
+    return SSL_write_ex(ssl, buf, count, done);
+}
+
+
+/**
+ * Make a TLS connection over a connected socket, resuming a session kept
+ * for the server if there is one. The socket is made non-blocking, and
+ * waiting for it yields inside a coroutine.
+ * @param tls - Pointer to the context
+ * @param fd - The connected socket, still owned by the caller
+ * @param host - The host name the certificate must be valid for
+ * @param port - The port, sessions are kept per host and port
+ * @param alpn - The application protocol to ask for, e.g. h2, or NULL
+ * @return conn - The connection, NULL if the handshake failed
+ */
+TlsConn *tls_connect(Tls *tls, int fd, const char *host, int port, const char *alpn) {
+    struct in_addr ip;
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    // The Finished message and the request are separate small writes. A
+    // server with no ticket to send would otherwise delay its ACK of the
+    // first and hold the request back.
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    TlsConn *conn = (TlsConn *)calloc(1, sizeof(TlsConn));
+    conn->tls = tls;
+    conn->fd = fd;
+    snprintf(conn->host, HOST_SIZE, "%s", host);
+    conn->port = port;
+    pthread_mutex_init(&conn->mutex_lock, NULL);
+
+    conn->ssl = SSL_new(tls->ctx);
+    SSL_set_app_data(conn->ssl, conn);
+    SSL_set_fd(conn->ssl, fd);
+
+    // Names are sent for virtual hosting and checked against the
+    // certificate, addresses are only checked
+    if (inet_pton(AF_INET, host, &ip) == 1) {
+        X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(conn->ssl), host);
+    }
+    else {
+        SSL_set_tlsext_host_name(conn->ssl, host);
+        SSL_set1_host(conn->ssl, host);
+    }
+
+    if (alpn) {
+        unsigned char protos[HOST_SIZE];
+        size_t length = strlen(alpn);
+        protos[0] = length;
+        memcpy(protos + 1, alpn, length);
+        SSL_set_alpn_protos(conn->ssl, protos, length + 1);
+    }
+
+    SSL_SESSION *session = take_session(tls, host, port);
+    if (session) {
+        SSL_set_session(conn->ssl, session);
+        SSL_SESSION_free(session);      // The SSL object holds its own reference
+    }
+
+    if (run(conn, do_handshake, NULL, 0, NULL) != 1) {
+        fprintf(stderr, "TLS handshake with %s failed: %s\n", host, failure(conn));
+        tls_close(conn);
+        return NULL;
+    }
+
+    const unsigned char *protocol;
+    unsigned int length;
+    SSL_get0_alpn_selected(conn->ssl, &protocol, &length);
+    snprintf(conn->protocol, HOST_SIZE, "%.*s", (int)length, protocol ? (const char *)protocol : "");
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_mutex_lock(&tls->mutex_lock);
+    if (SSL_session_reused(conn->ssl)) {
+        ++tls->stats.resumed;
+    }
+    else {
+        ++tls->stats.full;
+    }
+#ifndef OPENSSL_NO_KTLS
+    tls->stats.ktls_send += BIO_get_ktls_send(SSL_get_wbio(conn->ssl)) ? 1 : 0;
+    tls->stats.ktls_recv += BIO_get_ktls_recv(SSL_get_rbio(conn->ssl)) ? 1 : 0;
+#endif
+    tls->stats.seconds += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    pthread_mutex_unlock(&tls->mutex_lock);
+    return conn;
+}
+
+
+/**
+ * Make waits for the socket block the calling thread even inside a
+ * coroutine, for a connection written to by callers holding locks
+ * @param conn - The connection
+ */
+void tls_block(TlsConn *conn) {
+    conn->block = 1;
+}
+
+
+/**
+ * The application protocol the server agreed to
+ * @param conn - The connection
+ * @return protocol - e.g. h2, or "" if none was agreed
+ */
+const char *tls_protocol(TlsConn *conn) {
+    return conn->protocol;
+}
+
+
+/**
+ * Read decrypted content, as read does
+ * @return ssize_t - Bytes read, 0 once the server closed the connection,
+ *                   -1 on failure
+ */
+ssize_t tls_read(TlsConn *conn, void *buf, size_t count) {
+    size_t num_bytes = 0;
+    int result = run(conn, do_read, buf, count, &num_bytes);
+    return result == 1 ? (ssize_t)num_bytes : result;
+}
+
+
+/**
+ * Write all of a buffer
+ * @return ssize_t - count on success, -1 on failure
+ */
+ssize_t tls_write(TlsConn *conn, const void *buf, size_t count) {
+    size_t num_bytes = 0;
+    // Not partial writes, so SSL_write_ex only returns once all is sent
+    return run(conn, do_write, (void *)buf, count, &num_bytes) == 1 ? (ssize_t)count : -1;
+}
+
+
+/**
+ * Free a connection. Its session stays resumable unless the connection
+ * failed. The socket is left for the caller to close.
+ * @param conn - The connection to free
+ */
+void tls_close(TlsConn *conn) {
+    // The connection is dropped without close_notify, as HTTP clients do.
+    // Marking it shut down keeps OpenSSL from spoiling its session.
+    if (!conn->failed) {
+        SSL_set_shutdown(conn->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    }
+    SSL_free(conn->ssl);
+    pthread_mutex_destroy(&conn->mutex_lock);
+    free(conn);
+}
+
+
+/**
+ * Read the counts of what the handshakes so far did
+ * @param tls - Pointer to the context
+ * @param stats - Filled in with the counts
+ */
+void tls_stats(Tls *tls, TlsStats *stats) {
+    pthread_mutex_lock(&tls->mutex_lock);
+    *stats = tls->stats;
+    pthread_mutex_unlock(&tls->mutex_lock);
+}
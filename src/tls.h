@@ -0,0 +1,114 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+
+/*
+ * Tls - the client side of TLS for https:// URLs. Sessions that servers
+ * hand out are kept per host and port, so a later connection to the same
+ * server resumes one: the handshake is abbreviated, with no certificate
+ * chain sent or verified again. Where the kernel supports it, the record
+ * layer is handed to it after the handshake (kTLS), so content is
+ * decrypted as the socket is read into the response rather than passing
+ * through OpenSSL's buffers.
+ */
+typedef struct TlsStruct Tls;
+
+
+/*
+ * TlsConn - TLS on one connected socket. One thread may read from it
+ * while another writes.
+ */
+typedef struct TlsConnStruct TlsConn;
+
+
+// Counts of what the handshakes so far did
+typedef struct {
+    int64_t full;           // Handshakes that exchanged certificates
+    int64_t resumed;        // Handshakes that resumed a kept session
+    int64_t ktls_send;      // Connections the kernel encrypts for
+    int64_t ktls_recv;      // Connections the kernel decrypts for
+    double seconds;         // Time spent in handshakes
+} TlsStats;
+
+
+/**
+ * Allocate a TLS client context. Servers are verified against the system's
+ * trusted certificates, and those in ca_file if given.
+ * @param ca_file - A PEM file of further certificates to trust, or NULL
+ * @return tls - Pointer to the allocated context, NULL if ca_file could
+ *               not be loaded
+ */
+Tls *tls_alloc(const char *ca_file);
+
+
+/**
+ * Free a TLS context and the sessions it kept. No connection may be left.
+ * @param tls - Pointer to the context to free
+ */
+void tls_free(Tls *tls);
+
+
+/**
+ * Make a TLS connection over a connected socket, resuming a session kept
+ * for the server if there is one. The socket is made non-blocking, and
+ * waiting for it yields inside a coroutine.
+ * @param tls - Pointer to the context
+ * @param fd - The connected socket, still owned by the caller
+ * @param host - The host name the certificate must be valid for
+ * @param port - The port, sessions are kept per host and port
+ * @param alpn - The application protocol to ask for, e.g. h2, or NULL
+ * @return conn - The connection, NULL if the handshake failed
+ */
+TlsConn *tls_connect(Tls *tls, int fd, const char *host, int port, const char *alpn);
+
+
+/**
+ * Make waits for the socket block the calling thread even inside a
+ * coroutine, for a connection written to by callers holding locks
+ * @param conn - The connection
+ */
+void tls_block(TlsConn *conn);
+
+
+/**
+ * The application protocol the server agreed to
+ * @param conn - The connection
+ * @return protocol - e.g. h2, or "" if none was agreed
+ */
+const char *tls_protocol(TlsConn *conn);
+
+
+/**
+ * Read decrypted content, as read does
+ * @return ssize_t - Bytes read, 0 once the server closed the connection,
+ *                   -1 on failure
+ */
+ssize_t tls_read(TlsConn *conn, void *buf, size_t count);
+
+
+/**
+ * Write all of a buffer
+ * @return ssize_t - count on success, -1 on failure
+ */
+ssize_t tls_write(TlsConn *conn, const void *buf, size_t count);
+
+
+/**
+ * Free a connection. Its session stays resumable unless the connection
+ * failed. The socket is left for the caller to close.
+ * @param conn - The connection to free
+ */
+void tls_close(TlsConn *conn);
+
+
+/**
+ * Read the counts of what the handshakes so far did
+ * @param tls - Pointer to the context
+ * @param stats - Filled in with the counts
+ */
+void tls_stats(Tls *tls, TlsStats *stats);
+
+#endif
@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+
+#define LAST_MODIFIED "Tue, 02 Sep 2014 04:47:16 GMT"
+#define REQUEST_SIZE 4096
+
+
+// An HTTP/1.0 server of one resource, answering a connection at a time,
+// and what it saw
+typedef struct {
+    int listener;
+    int port;
+    char etag[64];          // Current ETag of the resource
+    int heads;
+    int conditional;        // HEAD requests with a validator
+    int not_modified;       // Answered 304
+    int gets;
+} Server;
+
+
+void write_file(const char *path, const char *content) {
+    FILE *fp = fopen(path, "w");
+    fputs(content, fp);
+    fclose(fp);
+}
+
+
+int same_content(const char *path, const char *content) {
+    char buffer[256] = "";
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    size_t len = fread(buffer, 1, sizeof(buffer) - 1, fp);
+    buffer[len] = '\0';
+    fclose(fp);
+    return strcmp(buffer, content) == 0;
+}
+
+
+// Value of a request header, "" if it is missing
+void request_header(const char *request, const char *name, char *value, size_t size) {
+    const char *start = strstr(request, name);
+    value[0] = '\0';
+    if (start) {
+        start += strlen(name);
+        snprintf(value, size, "%.*s", (int)strcspn(start, "\r\n"), start);
+    }
+}
+
+
+void *server_thread(void *arg) {
+    Server *server = (Server *)arg;
+    char request[REQUEST_SIZE], response[REQUEST_SIZE], etag[64], since[64];
+    int fd;
+
+    while ((fd = accept(server->listener, NULL, NULL)) != -1) {
+        size_t length = 0;
+        ssize_t num_bytes;
+        while (length < sizeof(request) - 1 && (num_bytes = read(fd, request + length, sizeof(request) - 1 - length)) > 0) {
+            length += num_bytes;
+            request[length] = '\0';
+            if (strstr(request, "\r\n\r\n")) break;
+        }
+        request[length] = '\0';
+
+        request_header(request, "If-None-Match: ", etag, sizeof(etag));
+        request_header(request, "If-Modified-Since: ", since, sizeof(since));
+        int head = strncmp(request, "HEAD ", 5) == 0;
+
+        // An ETag decides over a date when both are sent
+        int unchanged = etag[0] ? strcmp(etag, server->etag) == 0 : since[0] && strcmp(since, LAST_MODIFIED) == 0;
+        if (head) {
+            __atomic_add_fetch(&server->heads, 1, __ATOMIC_SEQ_CST);
+            if (etag[0] || since[0]) __atomic_add_fetch(&server->conditional, 1, __ATOMIC_SEQ_CST);
+            if (unchanged) __atomic_add_fetch(&server->not_modified, 1, __ATOMIC_SEQ_CST);
+        }
+        else {
+            __atomic_add_fetch(&server->gets, 1, __ATOMIC_SEQ_CST);
+        }
+
+        if (head && unchanged) {
+            length = snprintf(response, sizeof(response), "HTTP/1.0 304 Not Modified\r\nETag: %s\r\n\r\n", server->etag);
+        }
+        else {
+            length = snprintf(response, sizeof(response), "HTTP/1.0 200 OK\r\nContent-Length: 5\r\nETag: %s\r\n"
+                "Last-Modified: %s\r\n\r\n%s", server->etag, LAST_MODIFIED, head ? "" : "hello");
+        }
+        write(fd, response, length);
+        close(fd);
+    }
+    return NULL;
+}
+
+
+int main(int argc, char **argv) {
+
+    char dir[] = "/tmp/cache_testXXXXXX";
+    char cache_dir[512], first[512], second[512], restored[512];
+    int failed = 0;
+
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    snprintf(cache_dir, sizeof(cache_dir), "%s/cache", dir);
+    snprintf(first, sizeof(first), "%s/first", dir);
+    snprintf(second, sizeof(second), "%s/second", dir);
+    snprintf(restored, sizeof(restored), "%s/restored", dir);
+
+    Cache *cache = cache_open(cache_dir);
+    HttpHead head = { 200, 5, "\"v1\"", "Tue, 02 Sep 2014 04:47:16 GMT" };
+    CacheEntry entry;
+
+    // Miss before anything is stored
+    if (cache_lookup(cache, "example.com/a", &entry) == 0) {
+        printf("lookup hit on an empty cache\n");
+        failed = 1;
+    }
+
+    // Store and revalidate
+    write_file(first, "hello");
+    cache_store(cache, "example.com/a", &head, first);
+    if (cache_lookup(cache, "example.com/a", &entry) != 0 || strcmp(entry.etag, "\"v1\"") != 0
+        || strcmp(entry.last_modified, head.last_modified) != 0) {
+        printf("lookup after store did not return the validators\n");
+        failed = 1;
+    }
+
+    if (cache_materialize(cache, &entry, restored) != 0 || !same_content(restored, "hello")) {
+        printf("materialize did not restore the content\n");
+        failed = 1;
+    }
+
+    // The same content from another URL is stored once
+    struct stat first_st, second_st;
+    write_file(second, "hello");
+    cache_store(cache, "mirror.example.com/a", &head, second);
+    stat(first, &first_st);
+    stat(second, &second_st);
+    printf("duplicate stored as %s\n", first_st.st_ino == second_st.st_ino ? "hardlink" : "reflink or copy");
+    if (!same_content(second, "hello") || cache_lookup(cache, "mirror.example.com/a", &entry) != 0) {
+        printf("duplicate content was not cached\n");
+        failed = 1;
+    }
+
+    // A server answering 304 to a conditional probe, so nothing is downloaded
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    Server server = { 0 };
+    pthread_t server_id;
+    char url[64], dated_url[64], probed[512], unreachable[512];
+    HttpHead probe;
+
+    signal(SIGPIPE, SIG_IGN);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server.listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (bind(server.listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(server.listener, 8) == -1) {
+        perror("listen");
+        exit(1);
+    }
+    getsockname(server.listener, (struct sockaddr *)&addr, &addrlen);
+    server.port = ntohs(addr.sin_port);
+    strcpy(server.etag, "\"v1\"");
+    pthread_create(&server_id, NULL, server_thread, &server);
+
+    snprintf(url, sizeof(url), "127.0.0.1:%d/a", server.port);
+    snprintf(dated_url, sizeof(dated_url), "127.0.0.1:%d/b", server.port);
+    snprintf(probed, sizeof(probed), "%s/probed", dir);
+    snprintf(unreachable, sizeof(unreachable), "%s/missing/probed", dir);
+
+    unlink(first);      // Linked to the cached copy by now
+    write_file(first, "hello");
+    cache_store(cache, url, &head, first);
+    if (cache_probe(cache, url, probed, &probe) != 0 || probe.status != 304 || !same_content(probed, "hello")
+        || server.conditional != 1 || server.not_modified != 1 || server.gets != 0) {
+        printf("unchanged URL was not restored from the cache on a 304\n");
+        failed = 1;
+    }
+
+    // The same with only a date to revalidate by
+    HttpHead dated = { 200, 5, "", LAST_MODIFIED };
+    unlink(second);
+    write_file(second, "hello");
+    cache_store(cache, dated_url, &dated, second);
+    unlink(probed);
+    if (cache_probe(cache, dated_url, probed, &probe) != 0 || !same_content(probed, "hello")
+        || server.not_modified != 2 || server.gets != 0) {
+        printf("URL revalidated by date was not restored from the cache\n");
+        failed = 1;
+    }
+
+    // A copy that cannot be restored is probed again in full
+    if (cache_probe(cache, url, unreachable, &probe) != 1 || probe.status != 200
+        || server.heads != 4 || server.conditional != 3) {
+        printf("failed restore was not probed again\n");
+        failed = 1;
+    }
+
+    // A changed resource has to be downloaded
+    strcpy(server.etag, "\"v2\"");
+    if (cache_probe(cache, url, probed, &probe) != 1 || probe.status != 200 || strcmp(probe.etag, "\"v2\"") != 0) {
+        printf("changed URL was restored from the cache\n");
+        failed = 1;
+    }
+
+    shutdown(server.listener, SHUT_RDWR);
+    pthread_join(server_id, NULL);
+    close(server.listener);
+
+    cache_close(cache);
+
+    char command[600];
+    snprintf(command, sizeof(command), "rm -rf %s", dir);
+    system(command);
+
+    printf("%s\n", failed ? "FAILED" : "cache ok");
+    return failed;
+}
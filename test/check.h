@@ -0,0 +1,18 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+
+
+/**
+ * Print the outcome of one check of a test
+ * @param ok - Non zero if the check passed
+ * @param what - What was checked
+ * @return int - 1 if it failed, so the outcomes of a test can be or-ed
+ */
+static inline int check(int ok, const char *what) {
+    printf("%-40s %s\n", what, ok ? "ok" : "FAILED");
+    return !ok;
+}
+
+#endif
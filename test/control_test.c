@@ -0,0 +1,48 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "control.h"
+
+#define MAX_LIMIT 32
+#define CAPACITY 8          // Connections that saturate the simulated link
+#define PER_CONNECTION 100.0
+#define STEPS 200
+
+
+// Goodput of a link that scales linearly until it saturates
+double simulate(int limit) {
+    int useful = limit < CAPACITY ? limit : CAPACITY;
+    return useful * PER_CONNECTION;
+}
+
+
+int main(int argc, char **argv) {
+
+    int i, lowest = MAX_LIMIT, highest = 0;
+    Control *control = control_alloc(1, MAX_LIMIT, 100);
+
+    for (i = 0; i < STEPS; ++i) {
+        control_update(control, simulate(control_limit(control)), 0);
+
+        // Ignore the initial climb, then record how far it wanders
+        if (i > STEPS / 2) {
+            int limit = control_limit(control);
+            if (limit < lowest) lowest = limit;
+            if (limit > highest) highest = limit;
+        }
+    }
+    printf("settled between %d and %d, link saturates at %d\n", lowest, highest, CAPACITY);
+
+    int before = control_limit(control);
+    control_update(control, simulate(before), 3);
+    int after = control_limit(control);
+    printf("errors moved limit from %d to %d\n", before, after);
+
+    control_free(control);
+
+    if (lowest < CAPACITY - 1 || highest > CAPACITY + 1 || after > before / 2) {
+        printf("FAILED\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,64 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "coro.h"
+
+#define NUM_THREADS 4
+#define N 400               // Coroutines blocked on a socket at the same time
+#define STACK_SIZE (32 * 1024)
+
+typedef struct {
+    int fd;
+    int value;
+} Reader;
+
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+int sum = 0;
+
+
+// Blocks in coro_read until main writes to the other end of the socket
+void read_value(void *arg) {
+    Reader *reader = (Reader *)arg;
+
+    if (coro_read(reader->fd, &reader->value, sizeof(int)) == sizeof(int)) {
+        pthread_mutex_lock(&lock);
+        sum += reader->value;
+        pthread_mutex_unlock(&lock);
+    }
+    close(reader->fd);
+}
+
+
+int main(int argc, char **argv) {
+
+    int i, fds[N][2];
+    Reader readers[N];
+
+    Runtime *runtime = coro_runtime_alloc(NUM_THREADS, N, STACK_SIZE);
+
+    for (i = 0; i < N; ++i) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]) == -1) {
+            perror("socketpair");
+            exit(1);
+        }
+        readers[i].fd = fds[i][0];
+        coro_spawn(runtime, read_value, &readers[i]);
+    }
+
+    // Every coroutine is parked by now, wake them in reverse order
+    usleep(100000);
+    int expected = 0;
+    for (i = N - 1; i >= 0; --i) {
+        write(fds[i][1], &i, sizeof(int));
+        close(fds[i][1]);
+        expected += i;
+    }
+
+    coro_runtime_free(runtime);
+
+    printf("total sum: %d, expected sum: %d\n", sum, expected);
+    return sum != expected;
+}
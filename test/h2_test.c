@@ -0,0 +1,332 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "h2.h"
+#include "hpack.h"
+#include "check.h"
+
+#define PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define STREAM_WINDOW 32768     // Small, so the server waits on WINDOW_UPDATE
+#define CONN_WINDOW 65535
+#define MULTI_STREAMS 3
+#define MULTI_LENGTH 100000
+#define BIG_LENGTH 300000
+#define CANCEL_LENGTH 1000000
+#define STALL_AFTER 1000        // Bytes of the cancelled response sent before it stalls
+#define MAX_STREAMS 16
+#define FRAME_SIZE 16384
+
+
+// A response the server is sending
+typedef struct {
+    uint32_t id;
+    char path[64];
+    int64_t length;
+    int64_t sent;
+    int64_t window;
+    int sending;
+} ServerStream;
+
+
+// An h2c server answering one connection at a time, and what it saw
+typedef struct {
+    int listener;
+    int port;
+    int connections;        // That sent the preface
+    int window_updates;
+    int resets;             // RST_STREAM of the stalled response
+    int goaways;
+} Server;
+
+
+int read_all(int fd, void *data, size_t length) {
+    char *pos = (char *)data;
+    while (length > 0) {
+        ssize_t num_bytes = read(fd, pos, length);
+        if (num_bytes <= 0) return -1;
+        pos += num_bytes;
+        length -= num_bytes;
+    }
+    return 0;
+}
+
+
+void send_frame(int fd, int type, int flags, uint32_t id, const void *payload, size_t length) {
+    uint8_t header[9] = { length >> 16, length >> 8, length, type, flags, id >> 24, id >> 16, id >> 8, id };
+    if (write(fd, header, 9) != 9 || (length && write(fd, payload, length) != (ssize_t)length)) {
+        perror("server write");
+    }
+}
+
+
+void take_path(const char *name, const char *value, void *arg) {
+    if (strcmp(name, ":path") == 0) {
+        snprintf((char *)arg, 64, "%s", value);
+    }
+}
+
+
+// Send what the flow control windows allow of every response being sent,
+// a frame of each in turn so the responses interleave
+void flush(int fd, ServerStream *streams, int num_streams, int64_t *conn_window) {
+    char data[FRAME_SIZE];
+    int i, j, sent = 1;
+
+    while (sent) {
+        sent = 0;
+        for (i = 0; i < num_streams; ++i) {
+            ServerStream *stream = &streams[i];
+            int64_t end = strcmp(stream->path, "/cancel") == 0 ? STALL_AFTER : stream->length;
+            if (!stream->sending || stream->sent >= end || stream->window <= 0 || *conn_window <= 0) {
+                continue;
+            }
+
+            int64_t count = end - stream->sent;
+            if (count > FRAME_SIZE) count = FRAME_SIZE;
+            if (count > stream->window) count = stream->window;
+            if (count > *conn_window) count = *conn_window;
+
+            for (j = 0; j < count; ++j) data[j] = 'a' + (stream->sent + j) % 26;
+            stream->sent += count;
+            stream->window -= count;
+            *conn_window -= count;
+            send_frame(fd, 0x0, stream->sent == stream->length ? 0x1 : 0, stream->id, data, count);
+            sent = 1;
+        }
+    }
+}
+
+
+// Answer the requests of one connection until the client closes it
+void serve_conn(Server *server, int fd) {
+    ServerStream streams[MAX_STREAMS];
+    uint8_t header[9], payload[1 << 16], block[256];
+    char preface[24];
+    int64_t conn_window = 65535, initial_window = 65535;
+    int num_streams = 0, i;
+
+    if (read_all(fd, preface, sizeof(preface)) == -1 || memcmp(preface, PREFACE, 24) != 0) {
+        return;     // A connection the client raced and dropped
+    }
+    __atomic_add_fetch(&server->connections, 1, __ATOMIC_SEQ_CST);
+    send_frame(fd, 0x4, 0, 0, NULL, 0);
+    Hpack *hpack = hpack_alloc(4096);
+
+    for (;;) {
+        flush(fd, streams, num_streams, &conn_window);
+
+        if (read_all(fd, header, 9) == -1) break;
+        size_t length = header[0] << 16 | header[1] << 8 | header[2];
+        uint32_t id = ((uint32_t)header[5] << 24 | header[6] << 16 | header[7] << 8 | header[8]) & 0x7fffffff;
+        if (length > sizeof(payload) || read_all(fd, payload, length) == -1) break;
+
+        if (header[3] == 0x4 && !(header[4] & 0x1)) {
+            for (i = 0; i + 6 <= (int)length; i += 6) {
+                if ((payload[i] << 8 | payload[i + 1]) == 0x4) {
+                    initial_window = (int64_t)payload[i + 2] << 24 | payload[i + 3] << 16 | payload[i + 4] << 8 | payload[i + 5];
+                }
+            }
+            send_frame(fd, 0x4, 0x1, 0, NULL, 0);
+        }
+        else if (header[3] == 0x8) {
+            __atomic_add_fetch(&server->window_updates, 1, __ATOMIC_SEQ_CST);
+            int64_t increment = ((int64_t)payload[0] << 24 | payload[1] << 16 | payload[2] << 8 | payload[3]) & 0x7fffffff;
+            if (id == 0) conn_window += increment;
+            for (i = 0; i < num_streams; ++i) {
+                if (streams[i].id == id) streams[i].window += increment;
+            }
+        }
+        else if (header[3] == 0x3) {
+            for (i = 0; i < num_streams; ++i) {
+                if (streams[i].id == id && strcmp(streams[i].path, "/cancel") == 0) {
+                    __atomic_add_fetch(&server->resets, 1, __ATOMIC_SEQ_CST);
+                }
+            }
+        }
+        else if (header[3] == 0x1 && num_streams < MAX_STREAMS) {
+            const uint8_t *fragment = payload;
+            if (header[4] & 0x20) {
+                fragment += 5;
+                length -= 5;
+            }
+            ServerStream *stream = &streams[num_streams++];
+            memset(stream, 0, sizeof(ServerStream));
+            stream->id = id;
+            stream->window = initial_window;
+            hpack_decode(hpack, fragment, length, take_path, stream->path);
+
+            // The first try is refused as if the server were shutting down
+            if (strcmp(stream->path, "/goaway") == 0 && server->goaways++ == 0) {
+                uint8_t goaway[8] = { 0 };
+                uint32_t last = id > 2 ? id - 2 : 0;
+                goaway[0] = last >> 24; goaway[1] = last >> 16; goaway[2] = last >> 8; goaway[3] = last;
+                send_frame(fd, 0x7, 0, 0, goaway, sizeof(goaway));
+                break;
+            }
+
+            stream->length = strncmp(stream->path, "/multi", 6) == 0 ? MULTI_LENGTH :
+                strcmp(stream->path, "/big") == 0 ? BIG_LENGTH :
+                strcmp(stream->path, "/cancel") == 0 ? CANCEL_LENGTH : 10;
+            char content_length[32];
+            snprintf(content_length, sizeof(content_length), "%lld", (long long)stream->length);
+            size_t block_length = hpack_encode(":status", "200", block, sizeof(block));
+            block_length += hpack_encode("content-length", content_length, block + block_length, sizeof(block) - block_length);
+            send_frame(fd, 0x1, 0x4, id, block, block_length);
+
+            // Nothing of the multiplexed responses goes out before all of them were asked for
+            int multi = 0;
+            for (i = 0; i < num_streams; ++i) {
+                if (strncmp(streams[i].path, "/multi", 6) == 0) ++multi;
+            }
+            for (i = 0; i < num_streams; ++i) {
+                if (strncmp(streams[i].path, "/multi", 6) != 0 || multi == MULTI_STREAMS) {
+                    streams[i].sending |= streams[i].sent < streams[i].length;
+                }
+            }
+        }
+    }
+    hpack_free(hpack);
+}
+
+
+void *server_thread(void *arg) {
+    Server *server = (Server *)arg;
+    int fd;
+
+    while ((fd = accept(server->listener, NULL, NULL)) != -1) {
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        serve_conn(server, fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+
+// Non zero if a response holds length bytes of the server's content
+int content_ok(Buffer *response, int64_t length) {
+    if (!response || http_get_status(response) != 200) {
+        return 0;
+    }
+    char *content = http_get_content(response);
+    int64_t received = response->length - (content - response->data), i;
+    for (i = 0; i < received; ++i) {
+        if (content[i] != 'a' + i % 26) return 0;
+    }
+    return received == length;
+}
+
+
+typedef struct {
+    H2 *h2;
+    Server *server;
+    char page[16];
+    Buffer *response;
+} Request;
+
+
+void *request_thread(void *arg) {
+    Request *request = (Request *)arg;
+    request->response = h2_request(request->h2, "127.0.0.1", request->server->port, 0, "GET", request->page,
+        NULL, 0, NULL);
+    return NULL;
+}
+
+
+// Cancel a request once some of its content arrived
+void *cancel_thread(void *arg) {
+    HttpProgress *progress = (HttpProgress *)arg;
+    while (__atomic_load_n(&progress->received, __ATOMIC_RELAXED) < STALL_AFTER) {
+        usleep(1000);
+    }
+    http_cancel(progress);
+    return NULL;
+}
+
+
+void free_response(Buffer *response) {
+    if (response) {
+        free(response->data);
+        free(response);
+    }
+}
+
+
+int main(int argc, char **argv) {
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    Server server = { 0 };
+    Request requests[MULTI_STREAMS];
+    pthread_t threads[MULTI_STREAMS], server_id, canceller;
+    HttpProgress progress;
+    int failed = 0, i;
+
+    alarm(30);      // A stream that never ends fails the test rather than hanging it
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server.listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (bind(server.listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(server.listener, 8) == -1) {
+        perror("listen");
+        return 1;
+    }
+    getsockname(server.listener, (struct sockaddr *)&addr, &addrlen);
+    server.port = ntohs(addr.sin_port);
+    pthread_create(&server_id, NULL, server_thread, &server);
+
+    H2 *h2 = h2_alloc(1, STREAM_WINDOW, CONN_WINDOW, NULL);
+
+    // The server answers none of them until it has all three on one connection
+    int multi_ok = 1;
+    for (i = 0; i < MULTI_STREAMS; ++i) {
+        requests[i].h2 = h2;
+        requests[i].server = &server;
+        snprintf(requests[i].page, sizeof(requests[i].page), "multi/%d", i);
+        pthread_create(&threads[i], NULL, request_thread, &requests[i]);
+    }
+    for (i = 0; i < MULTI_STREAMS; ++i) {
+        pthread_join(threads[i], NULL);
+        multi_ok &= content_ok(requests[i].response, MULTI_LENGTH);
+        free_response(requests[i].response);
+    }
+    failed |= check(multi_ok, "multiplexed streams");
+    failed |= check(server.connections == 1, "one connection");
+
+    Buffer *response = h2_request(h2, "127.0.0.1", server.port, 0, "GET", "big", NULL, 0, NULL);
+    failed |= check(content_ok(response, BIG_LENGTH), "response larger than the window");
+    failed |= check(server.window_updates > 0, "window updates sent");
+    free_response(response);
+
+    http_progress_init(&progress, 0);
+    pthread_create(&canceller, NULL, cancel_thread, &progress);
+    response = h2_request(h2, "127.0.0.1", server.port, 0, "GET", "cancel", NULL, 0, &progress);
+    pthread_join(canceller, NULL);
+    for (i = 0; i < 1000 && !__atomic_load_n(&server.resets, __ATOMIC_SEQ_CST); ++i) {
+        usleep(1000);
+    }
+    failed |= check(response && http_get_status(response) == 200, "cancelled keeps what arrived");
+    failed |= check(server.resets == 1, "cancel resets the stream");
+    free_response(response);
+    http_progress_destroy(&progress);
+
+    response = h2_request(h2, "127.0.0.1", server.port, 0, "GET", "goaway", NULL, 0, NULL);
+    failed |= check(content_ok(response, 10), "retried after goaway");
+    failed |= check(server.goaways == 2 && server.connections == 2, "retry on a new connection");
+    free_response(response);
+
+    h2_free(h2);
+    shutdown(server.listener, SHUT_RDWR);
+    pthread_join(server_id, NULL);
+    close(server.listener);
+    return failed;
+}
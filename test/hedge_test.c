@@ -0,0 +1,38 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "hedge.h"
+#include "check.h"
+
+#define MB (1024 * 1024)
+
+
+int main(int argc, char **argv) {
+
+    // Ranges of one file, the last one crawling
+    double rates[] = { 10.0 * MB, 12.0 * MB, 11.0 * MB, 0.5 * MB };
+    int failed = 0;
+
+    // 5% extra on 100 MB planned is 5 MB
+    Hedge *hedge = hedge_alloc(0.05, 0.5, 0.5);
+    hedge_planned(hedge, 100 * MB);
+
+    failed |= check(!hedge_decide(hedge, 10.0 * MB, rates, 4, 2.0, 1 * MB), "healthy range left alone");
+    failed |= check(!hedge_decide(hedge, 0.5 * MB, rates, 4, 0.1, 1 * MB), "too early to judge");
+    failed |= check(!hedge_decide(hedge, 0.5 * MB, rates, 1, 2.0, 1 * MB), "no median from one range");
+
+    failed |= check(hedge_decide(hedge, 0.5 * MB, rates, 4, 2.0, 3 * MB), "straggler hedged");
+    failed |= check(hedge_extra(hedge) == 3 * MB, "charged its remaining bytes");
+    failed |= check(!hedge_decide(hedge, 0.5 * MB, rates, 4, 2.0, 3 * MB), "budget caps extra bytes");
+
+    // A duplicate dropped before it was sent gives its bytes back
+    hedge_refund(hedge, 3 * MB);
+    failed |= check(hedge_decide(hedge, 0.5 * MB, rates, 4, 2.0, 3 * MB), "refund restores budget");
+
+    // More planned bytes grow the budget
+    hedge_planned(hedge, 100 * MB);
+    failed |= check(hedge_decide(hedge, 0.5 * MB, rates, 4, 2.0, 3 * MB), "budget grows with planned bytes");
+
+    hedge_free(hedge);
+    return failed;
+}
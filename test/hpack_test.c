@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hpack.h"
+#include "check.h"
+
+
+// Fields decoded from one header block, as "name: value" lines
+typedef struct {
+    char text[1024];
+    int length;
+} Decoded;
+
+
+void collect(const char *name, const char *value, void *arg) {
+    Decoded *decoded = (Decoded *)arg;
+    decoded->length += snprintf(decoded->text + decoded->length, sizeof(decoded->text) - decoded->length,
+        "%s: %s\n", name, value);
+}
+
+
+// Decode a block given in hex and compare the fields with the expected lines
+int decodes(Hpack *hpack, const char *hex, const char *expected) {
+    uint8_t block[512];
+    size_t length = 0;
+    Decoded decoded = { "", 0 };
+
+    for (; hex[0] && hex[1]; hex += 2) {
+        while (*hex == ' ') ++hex;
+        sscanf(hex, "%2hhx", &block[length++]);
+    }
+    if (hpack_decode(hpack, block, length, collect, &decoded) == -1) {
+        return 0;
+    }
+    if (strcmp(decoded.text, expected) != 0) {
+        printf("got:\n%s", decoded.text);
+        return 0;
+    }
+    return 1;
+}
+
+
+int main(int argc, char **argv) {
+
+    int failed = 0;
+
+    // RFC 7541 C.4, requests with Huffman coding
+    Hpack *hpack = hpack_alloc(HPACK_TABLE_SIZE);
+    failed |= check(decodes(hpack, "828684418cf1e3c2e5f23a6ba0ab90f4ff",
+        ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n"), "first request");
+    failed |= check(decodes(hpack, "828684be5886a8eb10649cbf",
+        ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n"),
+        "second request uses the table");
+    failed |= check(decodes(hpack, "828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf",
+        ":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\ncustom-key: custom-value\n"),
+        "third request adds a new name");
+    hpack_free(hpack);
+
+    // RFC 7541 C.6, responses with Huffman coding and a 256 byte table
+    hpack = hpack_alloc(256);
+    failed |= check(decodes(hpack,
+        "488264025885aec3771a4b6196d07abe941054d444a8200595040b8166e082a62d1bff6e919d29ad171863c78f0b97c8e9ae82ae43d3",
+        ":status: 302\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\nlocation: https://www.example.com\n"),
+        "first response");
+    failed |= check(decodes(hpack, "4883640effc1c0bf",
+        ":status: 307\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\nlocation: https://www.example.com\n"),
+        "second response evicts");
+    failed |= check(decodes(hpack,
+        "88c16196d07abe941054d444a8200595040b8166e084a62d1bffc05a839bd9ab77ad94e7821dd7f2e6c7b335dfdfcd5b3960d5af27087f3672c1ab270fb5291f9587316065c003ed4ee5b1063d5007",
+        ":status: 200\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:22 GMT\nlocation: https://www.example.com\n"
+        "content-encoding: gzip\nset-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1\n"),
+        "third response evicts again");
+
+    // Errors
+    failed |= check(!decodes(hpack, "ff", ""), "truncated integer rejected");
+    failed |= check(!decodes(hpack, "c5", ""), "index past the table rejected");
+    failed |= check(!decodes(hpack, "3fe201", ""), "table size over the limit rejected");
+    hpack_free(hpack);
+
+    // What is encoded decodes to the same fields
+    uint8_t block[256];
+    size_t length = 0;
+    Decoded decoded = { "", 0 };
+    length += hpack_encode(":method", "GET", block + length, sizeof(block) - length);
+    length += hpack_encode(":path", "/big.bin", block + length, sizeof(block) - length);
+    length += hpack_encode("range", "bytes=0-1023", block + length, sizeof(block) - length);
+    length += hpack_encode("x-custom", "value", block + length, sizeof(block) - length);
+    hpack = hpack_alloc(HPACK_TABLE_SIZE);
+    failed |= check(hpack_decode(hpack, block, length, collect, &decoded) == 0 &&
+        strcmp(decoded.text, ":method: GET\n:path: /big.bin\nrange: bytes=0-1023\nx-custom: value\n") == 0,
+        "encoded fields round trip");
+    failed |= check(hpack_encode("range", "bytes=0-1023", block, 4) == 0, "encoding too big for the room");
+    hpack_free(hpack);
+
+    return failed;
+}
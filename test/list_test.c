@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "list.h"
+#include "check.h"
+
+#define WINDOW 16
+#define PROBERS 4
+#define UNIQUE 2000
+#define LINES 10000
+
+
+// Probes in flight and how far ahead of the taker they ran
+typedef struct {
+    int in_flight;
+    int most_in_flight;
+    int probed;
+    int taken;
+    int most_ahead;
+} Watch;
+
+
+int probe(ListEntry *entry, void *arg) {
+    Watch *watch = (Watch *)arg;
+
+    int in_flight = __atomic_add_fetch(&watch->in_flight, 1, __ATOMIC_SEQ_CST);
+    if (in_flight > __atomic_load_n(&watch->most_in_flight, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&watch->most_in_flight, in_flight, __ATOMIC_SEQ_CST);
+    }
+    int ahead = __atomic_add_fetch(&watch->probed, 1, __ATOMIC_SEQ_CST) - __atomic_load_n(&watch->taken, __ATOMIC_SEQ_CST);
+    if (ahead > __atomic_load_n(&watch->most_ahead, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&watch->most_ahead, ahead, __ATOMIC_SEQ_CST);
+    }
+
+    usleep(entry->priority == 1 ? 2000 : 100);     // Some probes are slow
+    entry->head.content_length = atoi(entry->url + 12);
+
+    __atomic_sub_fetch(&watch->in_flight, 1, __ATOMIC_SEQ_CST);
+    return 1;
+}
+
+
+// Write a list to a temporary file
+void write_list(char *path, const char *text) {
+    strcpy(path, "/tmp/list_test_XXXXXX");
+    int fd = mkstemp(path);
+    write(fd, text, strlen(text));
+    close(fd);
+}
+
+
+int main(int argc, char **argv) {
+    char path[64];
+    ListEntry entry;
+    Watch watch = { 0 };
+    int failed = 0;
+    int i;
+
+    // Every URL is listed five times, with blank and CRLF lines between
+    size_t size = (size_t)LINES * 64;
+    char *text = (char *)malloc(size);
+    int length = 0;
+    for (i = 0; i < LINES; ++i) {
+        length += snprintf(text + length, size - length, "http://host/%d %d%s%s", i % UNIQUE, i % 7,
+            i % UNIQUE == 3 ? " ranges=0-9,-5" : "", i % 3 ? "\n" : "\r\n\n");
+    }
+    text[length - 1] = '\0';      // No newline after the last line
+    write_list(path, text);
+    free(text);
+
+    List *list = list_open(path, WINDOW, PROBERS, probe, &watch);
+    int in_order = 1, fields = 1, taken = 0;
+    while (list_next(list, &entry) == 0) {
+        __atomic_add_fetch(&watch.taken, 1, __ATOMIC_SEQ_CST);
+        in_order &= atoi(entry.url + 12) == taken && entry.head.content_length == taken && entry.probed == 1;
+        fields &= entry.priority == taken % 7 && strcmp(entry.ranges, taken == 3 ? "0-9,-5" : "") == 0;
+        ++taken;
+    }
+
+    failed |= check(taken == UNIQUE, "every url once");
+    failed |= check(list_duplicates(list) == LINES - UNIQUE, "duplicates counted");
+    failed |= check(in_order, "probed lines taken in order");
+    failed |= check(fields, "priority and ranges read");
+    failed |= check(watch.most_in_flight > 1 && watch.most_in_flight <= PROBERS, "probes run at once");
+    failed |= check(watch.most_ahead <= WINDOW + 1, "probes stay within the window");
+    list_close(list);
+    unlink(path);
+
+    write_list(path, "");
+    list = list_open(path, WINDOW, PROBERS, probe, &watch);
+    failed |= check(list_next(list, &entry) == -1, "empty list");
+    list_close(list);
+    unlink(path);
+
+    write_list(path, "http://host/1\nhttp://host/2\nhttp://host/3\nhttp://host/4\n");
+    list = list_open(path, 2, 1, probe, &watch);
+    failed |= check(list_next(list, &entry) == 0 && strcmp(entry.url, "http://host/1") == 0, "first of a list taken");
+    list_close(list);       // With lines left
+    unlink(path);
+
+    // Listed again with other ranges, the first line is kept
+    write_list(path, "http://host/1 ranges=0-1\nhttp://host/1 ranges=5-6\nhttp://host/2\n");
+    list = list_open(path, WINDOW, PROBERS, probe, &watch);
+    int kept = list_next(list, &entry) == 0 && strcmp(entry.ranges, "0-1") == 0;
+    kept &= list_next(list, &entry) == 0 && strcmp(entry.url, "http://host/2") == 0;
+    failed |= check(kept && list_next(list, &entry) == -1 && list_duplicates(list) == 1, "other ranges skipped");
+    list_close(list);
+    unlink(path);
+
+    failed |= check(list_open("/tmp/list_test_missing", WINDOW, PROBERS, probe, &watch) == NULL, "missing list refused");
+    return failed;
+}
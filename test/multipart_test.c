@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "multipart.h"
+#include "check.h"
+
+#define SIZE 64
+
+
+// The resource as rebuilt from the parts
+typedef struct {
+    char data[SIZE];
+    int emits;
+} Rebuilt;
+
+
+int place(int64_t offset, const char *data, size_t length, void *arg) {
+    Rebuilt *rebuilt = (Rebuilt *)arg;
+    if (offset < 0 || offset + length > SIZE) {
+        return -1;
+    }
+    memcpy(rebuilt->data + offset, data, length);
+    ++rebuilt->emits;
+    return 0;
+}
+
+
+// Feed a body in pieces of step bytes, returning the parser's verdict
+int parse(const char *body, size_t step, Rebuilt *rebuilt, int *done) {
+    Multipart *multipart = multipart_alloc("THIS_STRING_SEPARATES", place, rebuilt);
+    size_t length = strlen(body);
+    size_t i;
+    int result = 0;
+
+    memset(rebuilt, '.', sizeof(rebuilt->data));
+    rebuilt->emits = 0;
+    for (i = 0; i < length && result == 0; i += step) {
+        result = multipart_feed(multipart, body + i, i + step > length ? length - i : step);
+    }
+    *done = multipart_done(multipart);
+    multipart_free(multipart);
+    return result;
+}
+
+
+int main(int argc, char **argv) {
+    const char *body =
+        "\r\n--THIS_STRING_SEPARATES\r\n"
+        "Content-Type: application/octet-stream\r\n"
+        "Content-Range: bytes 2-5/64\r\n"
+        "\r\n"
+        "abcd"
+        "\r\n--THIS_STRING_SEPARATES\r\n"
+        "Content-Range: bytes 10-21/64\r\n"
+        "\r\n"
+        "line\r\n--THIS"       // Content that looks like a boundary
+        "\r\n--THIS_STRING_SEPARATES--\r\n"
+        "epilogue";
+    const char *expected = "..abcd....line\r\n--THIS..........................................";
+    char boundary[64];
+    Rebuilt rebuilt;
+    int failed = 0;
+    int done;
+    size_t step;
+
+    failed |= check(multipart_boundary("multipart/byteranges; boundary=THIS_STRING_SEPARATES", boundary, sizeof(boundary)) == 0
+        && strcmp(boundary, "THIS_STRING_SEPARATES") == 0, "boundary read");
+    failed |= check(multipart_boundary("multipart/byteranges; charset=x; boundary=\"a b\"", boundary, sizeof(boundary)) == 0
+        && strcmp(boundary, "a b") == 0, "quoted boundary read");
+    failed |= check(multipart_boundary("text/html; boundary=x", boundary, sizeof(boundary)) == -1, "other types refused");
+
+    failed |= check(parse(body, strlen(body), &rebuilt, &done) == 0 && done
+        && memcmp(rebuilt.data, expected, SIZE) == 0 && rebuilt.emits == 2, "parts placed");
+
+    int split_ok = 1;
+    for (step = 1; step < 40; ++step) {
+        split_ok &= parse(body, step, &rebuilt, &done) == 0 && done && memcmp(rebuilt.data, expected, SIZE) == 0;
+    }
+    failed |= check(split_ok, "parts placed from any split");
+
+    failed |= check(parse("--THIS_STRING_SEPARATES\r\n\r\nabcd", 1, &rebuilt, &done) == -1, "part without range refused");
+    failed |= check(parse("--THIS_STRING_SEPARATES\r\nContent-Range: bytes 60-69/64\r\n\r\n0123456789", 3, &rebuilt, &done) == -1,
+        "emit failure reported");
+    failed |= check(parse(body, 7, &rebuilt, &done) == 0 && done, "closing boundary seen");
+    failed |= check(parse("--THIS_STRING_SEPARATES\r\nContent-Range: bytes 0-3/64\r\n\r\nab", 5, &rebuilt, &done) == 0 && !done,
+        "truncated body not done");
+
+    return failed;
+}
@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "http.h"
+
+#define GB (1024LL * 1024 * 1024)
+#define MB (1024LL * 1024)
+
+
+// Plans a download and checks the ranges cover it exactly, stay within
+// the memory budget and give every worker several ranges when the size allows
+int check(int64_t content_length, int workers, int64_t max_in_flight) {
+    int64_t chunk_size;
+    int num_chunks = plan_chunks(content_length, workers, max_in_flight, &chunk_size);
+    int failed = 0;
+
+    printf("%14" PRId64 " bytes, %2d workers: %6d chunks of %10" PRId64 "\n",
+        content_length, workers, num_chunks, chunk_size);
+
+    if (content_length == 0) {
+        return num_chunks != 1 || chunk_size != 0;
+    }
+
+    // The last chunk ends exactly at the end
+    failed |= (int64_t)num_chunks * chunk_size < content_length;
+    failed |= (int64_t)(num_chunks - 1) * chunk_size >= content_length;
+
+    failed |= chunk_size > max_in_flight / workers && chunk_size > MIN_CHUNK_SIZE;
+    if (content_length / CHUNKS_PER_WORKER / workers >= MIN_CHUNK_SIZE) {
+        failed |= num_chunks < workers * CHUNKS_PER_WORKER;
+    }
+
+    if (failed) {
+        printf("FAILED\n");
+    }
+    return failed;
+}
+
+
+// Plans the ranges of spec and compares them with the expected
+// offset-length pairs, as e.g. "0+100 4096+10"
+int check_ranges(const char *spec, int64_t content_length, int64_t gap, const char *expected) {
+    HttpRange wanted[16];
+    char planned[256] = "";
+    int64_t chunk_size;
+    int num_wanted = http_parse_ranges(spec, wanted, 16);
+    int num_ranges = 0;
+    int length = 0;
+    int i;
+
+    HttpRange *ranges = num_wanted < 0 ? NULL : plan_ranges(wanted, num_wanted, content_length, gap, 4, 256 * MB,
+        &num_ranges, &chunk_size);
+    for (i = 0; ranges && i < num_ranges; ++i) {
+        length += snprintf(planned + length, sizeof(planned) - length, "%s%" PRId64 "+%" PRId64,
+            i ? " " : "", ranges[i].offset, ranges[i].length);
+    }
+    free(ranges);
+
+    int failed = ranges ? strcmp(planned, expected) != 0 : expected != NULL;
+    printf("%-24s %-40s %s\n", spec, ranges ? planned : "(none)", failed ? "FAILED" : "ok");
+    return failed;
+}
+
+
+int main(int argc, char **argv) {
+
+    int failed = 0;
+
+    failed |= check(0, 4, 256 * MB);           // Unknown length
+    failed |= check(777, 4, 256 * MB);         // Too small to split
+    failed |= check(5 * MB, 4, 256 * MB);
+    failed |= check(3 * GB - 1, 8, 256 * MB);  // Past what an int holds
+    failed |= check(300 * GB, 8, 256 * MB);    // Bounded by memory
+    failed |= check(300 * GB, 32, 256 * MB);
+
+    failed |= check_ranges("0-99,4096-4105", 10000, 0, "0+100 4096+10");
+    failed |= check_ranges("4096-4105,0-99", 10000, 4096, "0+4106");           // Coalesced over a gap
+    failed |= check_ranges("10-19,15-29,30-39", 10000, 0, "10+30");            // Overlapping and adjacent
+    failed |= check_ranges("-100,9000-", 10000, 0, "9000+1000");               // Suffix and open ended
+    failed |= check_ranges("9990-10099,20000-20010", 10000, 0, "9990+10");     // Clipped to the end
+    failed |= check_ranges("-100", 0, 0, NULL);                                // Unknown length
+    failed |= check_ranges("0-99,x", 10000, 0, NULL);                          // Malformed
+    failed |= check_ranges("0-", MB, 0, "0+262144 262144+262144 524288+262144 786432+262144");        // Split
+
+    return failed;
+}
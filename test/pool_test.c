@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+
+#include "pool.h"
+#include "check.h"
+
+
+// A socket standing in for a connection
+int connection(void) {
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    close(fds[1]);
+    return fds[0];
+}
+
+
+int is_open(int fd) {
+    return fcntl(fd, F_GETFD) != -1;
+}
+
+
+int main(int argc, char **argv) {
+
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    TlsConn *tls = NULL;
+    int failed = 0;
+
+    Pool *pool = pool_alloc(2, 30, 60);
+
+    failed |= check(pool_resolve(pool, "localhost", 80, 0, &addr, &addrlen) == 0, "resolves a host");
+    failed |= check(ntohs(((struct sockaddr_in *)&addr)->sin_port) == 80, "address has the port");
+    failed |= check(pool_resolve(pool, "localhost", 80, 5, &addr, &addrlen) == 0, "address index wraps around");
+    failed |= check(pool_resolve(pool, "no.such.host.invalid", 80, 0, &addr, &addrlen) == -1, "unknown host fails");
+
+    failed |= check(pool_get(pool, "localhost", 80, 0, NULL) == -1, "nothing idle at first");
+
+    int a = connection(), b = connection(), c = connection();
+    pool_put(pool, "localhost", 80, 0, a, NULL);
+    failed |= check(pool_get(pool, "localhost", 81, 0, NULL) == -1, "other port not matched");
+    failed |= check(pool_get(pool, "localhost", 80, 1, NULL) == -1, "other address not matched");
+    failed |= check(pool_get(pool, "localhost", 80, 0, &tls) == -1, "plain connection not used for TLS");
+    failed |= check(pool_get(pool, "localhost", 80, 0, NULL) == a, "idle connection reused");
+    failed |= check(pool_get(pool, "localhost", 80, 0, NULL) == -1, "taken only once");
+
+    // Most recently used first, and the oldest closed over the limit
+    pool_put(pool, "localhost", 80, 0, a, NULL);
+    pool_put(pool, "localhost", 80, 0, b, NULL);
+    pool_put(pool, "localhost", 80, 0, c, NULL);
+    failed |= check(!is_open(a), "oldest closed over the limit");
+    failed |= check(pool_get(pool, "localhost", 80, 0, NULL) == c, "most recent taken first");
+    failed |= check(pool_get(pool, "localhost", 80, 0, NULL) == b, "then the next");
+    close(b);
+    close(c);
+    pool_free(pool);
+
+    // Connections idle too long are closed rather than reused
+    pool = pool_alloc(2, 0, 60);
+    a = connection();
+    pool_put(pool, "localhost", 80, 0, a, NULL);
+    sleep(2);
+    failed |= check(pool_get(pool, "localhost", 80, 0, NULL) == -1, "expired connection not reused");
+    failed |= check(!is_open(a), "expired connection closed");
+    pool_free(pool);
+
+    return failed;
+}
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sched.h"
+
+
+// Two files of three ranges each and one urgent single range file.
+// Returns the order ranges come out in as a string of their names.
+void run(SchedPolicy policy, char *order) {
+    static char *names[] = { "a0", "a1", "a2", "b0", "b1", "b2", "u0" };
+    Sched *sched = sched_alloc(policy);
+    int i;
+
+    Lane *a = sched_lane_alloc(sched, 0);
+    Lane *b = sched_lane_alloc(sched, 0);
+
+    // a is large, b is small
+    for (i = 0; i < 3; ++i) {
+        sched_put(sched, a, names[i], i * 1000, 1000);
+    }
+    for (i = 0; i < 3; ++i) {
+        sched_put(sched, b, names[3 + i], i * 10, 10);
+    }
+
+    order[0] = '\0';
+    for (i = 0; i < 6; ++i) {
+        // Something urgent arrives while the first range is in flight
+        if (i == 1) {
+            Lane *urgent = sched_lane_alloc(sched, 1);
+            sched_put(sched, urgent, names[6], 0, 5000);
+        }
+
+        char *name = (char *)sched_get(sched);
+        strcat(order, name);
+        strcat(order, " ");
+    }
+    char *name = (char *)sched_get(sched);
+    strcat(order, name);
+
+    sched_close(sched);
+    if (sched_get(sched) != NULL) {
+        strcat(order, " (not empty)");
+    }
+    sched_free(sched);
+}
+
+
+// File a queues one range of the many it plans, b queues both of its small ones
+void run_planned(char *order) {
+    Sched *sched = sched_alloc(SCHED_SHORTEST);
+
+    Lane *a = sched_lane_alloc(sched, 0);
+    Lane *b = sched_lane_alloc(sched, 0);
+    sched_lane_plan(sched, a, 10000);
+    sched_put(sched, a, "a0", 0, 1000);
+    sched_put(sched, b, "b0", 0, 10);
+    sched_put(sched, b, "b1", 10, 10);
+
+    char *first = (char *)sched_get(sched);
+    char *second = (char *)sched_get(sched);
+    sprintf(order, "%s %s %s", first, second, (char *)sched_get(sched));
+    if (!sched_lane_queued(sched, a)) {
+        strcat(order, " (plan lost)");
+    }
+    sched_free(sched);
+}
+
+
+int check(const char *policy, const char *order, const char *expected) {
+    printf("%-8s %s\n", policy, order);
+    if (strcmp(order, expected) != 0) {
+        printf("FAILED, expected %s\n", expected);
+        return 1;
+    }
+    return 0;
+}
+
+
+int main(int argc, char **argv) {
+
+    char order[256];
+    int failed = 0;
+
+    run(SCHED_FIFO, order);
+    failed |= check("fifo", order, "a0 u0 a1 a2 b0 b1 b2");
+
+    run(SCHED_SHORTEST, order);
+    failed |= check("shortest", order, "b0 u0 b1 b2 a0 a1 a2");
+
+    run(SCHED_FRONT, order);
+    failed |= check("front", order, "a0 u0 b0 b1 b2 a1 a2");
+
+    run_planned(order);
+    failed |= check("planned", order, "b0 b1 a0");
+
+    return failed;
+}
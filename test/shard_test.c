@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "shard.h"
+#include "check.h"
+
+#define NAME "shard_test"
+#define URL_FILE "/tmp/shard_test_urls"
+#define NUM_RANGES 3
+
+
+int main(int argc, char **argv) {
+
+    ShardClaim claim;
+    HttpHead head = { 200, 300, "", "" };
+    int failed = 0;
+
+    FILE *fp = fopen(URL_FILE, "w");
+    fprintf(fp, "localhost/a.bin\n\nlocalhost/b.bin 2 ranges=0-9,-5\nlocalhost/c.bin\nlocalhost/d.bin\n");
+    fclose(fp);
+
+    Shard *shard = shard_open(NAME, URL_FILE);
+    failed |= check(strcmp(shard_file(shard, 1)->url, "localhost/b.bin") == 0, "blank lines skipped");
+    failed |= check(shard_file(shard, 1)->priority == 2, "priority parsed");
+    failed |= check(strcmp(shard_file(shard, 1)->ranges, "0-9,-5") == 0 && !shard_file(shard, 0)->ranges[0], "ranges parsed");
+
+    // The first file has to be planned before anything else
+    failed |= check(shard_claim(shard, &claim) == SHARD_PLAN && claim.file == 0, "plan first file");
+    shard_plan(shard, 0, &head, 100, NUM_RANGES);
+
+    // A child claims one range and dies holding it
+    pid_t child = fork();
+    if (child == 0) {
+        Shard *other = shard_open(NAME, URL_FILE);
+        shard_claim(other, &claim);
+        _exit(0);
+    }
+    waitpid(child, NULL, 0);
+
+    // The other two ranges are ours, then the second file needs planning
+    int merge = 0, ranges = 0;
+    while (shard_claim(shard, &claim) == SHARD_RANGE) {
+        merge |= shard_range_done(shard, claim.range);
+        ++ranges;
+    }
+    failed |= check(ranges == NUM_RANGES - 1, "claimed ranges not held by the child");
+    failed |= check(claim.file == 1, "plan second file");
+    failed |= check(!merge, "no merge while a range is held");
+
+    // Sparse ranges are published as given
+    HttpRange sparse[2] = { { 0, 10 }, { 295, 5 } }, copy[2];
+    shard_plan_ranges(shard, 1, &head, sparse, 2);
+    shard_ranges(shard, 1, copy);
+    failed |= check(shard_file(shard, 1)->sparse && memcmp(copy, sparse, sizeof(sparse)) == 0, "sparse ranges published");
+
+    // A failed range comes back until it runs out of attempts
+    int attempts = 0;
+    while (shard_claim(shard, &claim) == SHARD_RANGE && claim.file == 1 && claim.offset == 0) {
+        merge = shard_range_failed(shard, claim.range);
+        ++attempts;
+    }
+    failed |= check(attempts == SHARD_MAX_ATTEMPTS && !merge, "failed range retried");
+    failed |= check(shard_file(shard, 1)->failed && claim.offset == 295, "file failed after retries");
+    failed |= check(shard_range_done(shard, claim.range), "failed file still finishes");
+    shard_file_done(shard, 1);
+
+    // A file that cannot be probed is failed without ranges
+    failed |= check(shard_claim(shard, &claim) == SHARD_PLAN && claim.file == 2, "plan third file");
+    shard_fail(shard, 2);
+    failed |= check(shard_file(shard, 2)->failed, "probe failure fails the file");
+
+    // So is a file whose ranges do not fit in the range table
+    failed |= check(shard_claim(shard, &claim) == SHARD_PLAN && claim.file == 3, "plan fourth file");
+    shard_plan(shard, 3, &head, 1, SHARD_MAX_RANGES);
+    failed |= check(shard_file(shard, 3)->failed, "too many ranges fail the file");
+
+    // Reclaiming hands back the child's range, finishing it merges the file
+    failed |= check(shard_claim(shard, &claim) == SHARD_NONE, "nothing free before reclaim");
+    shard_reclaim(shard);
+    failed |= check(shard_claim(shard, &claim) == SHARD_RANGE && claim.offset == 0, "dead claim reclaimed");
+    failed |= check(shard_range_done(shard, claim.range), "last range merges");
+    shard_file_done(shard, 0);
+
+    failed |= check(shard_finished(shard), "finished");
+    shard_close(shard);
+    unlink(URL_FILE);
+
+    // Closing a finished list removes it, so the name starts over
+    shard = shard_open(NAME, "/dev/null");
+    failed |= check(shard_finished(shard), "reopened empty");
+    shard_close(shard);
+
+    return failed;
+}
@@ -0,0 +1,324 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+
+#include "tls.h"
+#include "coro.h"
+#include "check.h"
+
+#define BLOCK_SIZE (64 * 1024)
+#define BENCH_SECONDS 2
+#define BENCH_BYTES (1024LL * 1024 * 1024)
+
+
+// A TLS server on the loopback interface, sending as many bytes as asked
+typedef struct {
+    SSL_CTX *ctx;
+    int listen_fd;
+    int port;
+    pthread_t thread;
+} Server;
+
+
+// A fetch run inside a coroutine
+typedef struct {
+    Tls *tls;
+    int port;
+    long long received;
+} Fetch;
+
+
+double now(clockid_t clock) {
+    struct timespec time;
+    clock_gettime(clock, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+
+// Make a certificate for name signed by issuer, or by itself without one
+X509 *make_cert(const char *name, EVP_PKEY *key, X509 *issuer, EVP_PKEY *issuer_key, int ca) {
+    X509 *cert = X509_new();
+    X509V3_CTX ctx;
+    char san[256];
+
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), ca ? 1 : 2);
+    X509_gmtime_adj(X509_getm_notBefore(cert), -60);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 60 * 60);
+    X509_set_pubkey(cert, key);
+    X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC, (const unsigned char *)name, -1, -1, 0);
+    X509_set_issuer_name(cert, X509_get_subject_name(issuer ? issuer : cert));
+
+    X509V3_set_ctx(&ctx, issuer ? issuer : cert, cert, NULL, NULL, 0);
+    snprintf(san, sizeof(san), ca ? "critical,CA:TRUE" : "CA:FALSE");
+    X509_EXTENSION *extension = X509V3_EXT_conf_nid(NULL, &ctx, NID_basic_constraints, san);
+    X509_add_ext(cert, extension, -1);
+    X509_EXTENSION_free(extension);
+    if (!ca) {
+        snprintf(san, sizeof(san), "DNS:%s,IP:127.0.0.1", name);
+        extension = X509V3_EXT_conf_nid(NULL, &ctx, NID_subject_alt_name, san);
+        X509_add_ext(cert, extension, -1);
+        X509_EXTENSION_free(extension);
+    }
+
+    X509_sign(cert, issuer_key ? issuer_key : key, EVP_sha256());
+    return cert;
+}
+
+
+// Agree to the first protocol the client asks for
+int select_protocol(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                    const unsigned char *in, unsigned int inlen, void *arg) {
+    if (inlen < 1 || in[0] + 1 > inlen) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = in + 1;
+    *outlen = in[0];
+    return SSL_TLSEXT_ERR_OK;
+}
+
+
+// Serve one connection at a time: read a byte count, send that many bytes
+void *serve(void *arg) {
+    Server *server = (Server *)arg;
+    char *block = (char *)calloc(1, BLOCK_SIZE);
+    int fd;
+
+    while ((fd = accept(server->listen_fd, NULL, NULL)) != -1) {
+        SSL *ssl = SSL_new(server->ctx);
+        char request[32];
+        int length;
+
+        SSL_set_fd(ssl, fd);
+        if (SSL_accept(ssl) == 1 && (length = SSL_read(ssl, request, sizeof(request) - 1)) > 0) {
+            request[length] = '\0';
+            long long left = atoll(request);
+            while (left > 0) {
+                int chunk = left < BLOCK_SIZE ? left : BLOCK_SIZE;
+                if (SSL_write(ssl, block, chunk) <= 0) break;
+                left -= chunk;
+            }
+            SSL_shutdown(ssl);
+        }
+        SSL_free(ssl);
+        close(fd);
+    }
+    free(block);
+    return NULL;
+}
+
+
+// Start a server for the certificate. Without tickets no session can be resumed.
+void server_start(Server *server, X509 *cert, EVP_PKEY *key, X509 *ca, int tickets) {
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+
+    server->ctx = SSL_CTX_new(TLS_server_method());
+    SSL_CTX_use_certificate(server->ctx, cert);
+    SSL_CTX_use_PrivateKey(server->ctx, key);
+    X509_up_ref(ca);
+    SSL_CTX_add_extra_chain_cert(server->ctx, ca);
+    SSL_CTX_set_alpn_select_cb(server->ctx, select_protocol, NULL);
+    if (!tickets) {
+        SSL_CTX_set_num_tickets(server->ctx, 0);
+        SSL_CTX_set_options(server->ctx, SSL_OP_NO_TICKET);
+        SSL_CTX_set_session_cache_mode(server->ctx, SSL_SESS_CACHE_OFF);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+    listen(server->listen_fd, 64);
+    getsockname(server->listen_fd, (struct sockaddr *)&addr, &addrlen);
+    server->port = ntohs(addr.sin_port);
+
+    pthread_create(&server->thread, NULL, serve, server);
+}
+
+
+void server_stop(Server *server) {
+    shutdown(server->listen_fd, SHUT_RDWR);
+    pthread_join(server->thread, NULL);
+    close(server->listen_fd);
+    SSL_CTX_free(server->ctx);
+}
+
+
+/**
+ * Fetch bytes from the server over a new connection
+ * @param alpn - Set to the protocol agreed, or NULL
+ * @return long long - Bytes received, -1 if the handshake failed
+ */
+long long fetch(Tls *tls, const char *host, int port, long long bytes, char *alpn) {
+    struct sockaddr_in addr;
+    char request[32];
+    long long received = 0;
+    ssize_t num_bytes;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (coro_connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    TlsConn *conn = tls_connect(tls, fd, host, port, "http/1.1");
+    if (!conn) {
+        close(fd);
+        return -1;
+    }
+    if (alpn) {
+        strcpy(alpn, tls_protocol(conn));
+    }
+
+    char *block = (char *)malloc(BLOCK_SIZE);
+    int length = snprintf(request, sizeof(request), "%lld\n", bytes);
+    if (tls_write(conn, request, length) == length) {
+        while ((num_bytes = tls_read(conn, block, BLOCK_SIZE)) > 0) {
+            received += num_bytes;
+        }
+    }
+    free(block);
+    tls_close(conn);
+    close(fd);
+    return received;
+}
+
+
+void fetch_coroutine(void *arg) {
+    Fetch *fetched = (Fetch *)arg;
+    fetched->received = fetch(fetched->tls, "localhost", fetched->port, 1024 * 1024, NULL);
+}
+
+
+// Handshakes a second over new connections to the server
+double handshake_rate(Tls *tls, int port) {
+    double start = now(CLOCK_MONOTONIC), elapsed;
+    int count = 0;
+
+    do {
+        fetch(tls, "localhost", port, 1, NULL);
+        ++count;
+    } while ((elapsed = now(CLOCK_MONOTONIC) - start) < BENCH_SECONDS);
+    return count / elapsed;
+}
+
+
+/**
+ * Measure what TLS costs the client: handshakes a second, full and
+ * resumed, and the CPU time reading a gigabyte takes. The server runs in
+ * the same process, so handshake rates include its share.
+ */
+void bench(const char *ca_file, Server *resuming, Server *full) {
+    Tls *tls = tls_alloc(ca_file);
+    TlsStats stats;
+
+    printf("%-40s %.0f\n", "full handshakes/s", handshake_rate(tls, full->port));
+    printf("%-40s %.0f\n", "resumed handshakes/s", handshake_rate(tls, resuming->port));
+
+    double wall = now(CLOCK_MONOTONIC), cpu = now(CLOCK_THREAD_CPUTIME_ID);
+    long long received = fetch(tls, "localhost", resuming->port, BENCH_BYTES, NULL);
+    wall = now(CLOCK_MONOTONIC) - wall;
+    cpu = now(CLOCK_THREAD_CPUTIME_ID) - cpu;
+
+    tls_stats(tls, &stats);
+    printf("%-40s %.0f\n", "MB/s", received / wall / (1024 * 1024));
+    printf("%-40s %.2f\n", "client CPU seconds per GB", cpu * (1024.0 * 1024 * 1024) / received);
+    printf("%-40s %lld/%lld\n", "kTLS send/receive connections", (long long)stats.ktls_send, (long long)stats.ktls_recv);
+    tls_free(tls);
+}
+
+
+int main(int argc, char **argv) {
+
+    char ca_file[] = "/tmp/tls_test_XXXXXX";
+    char alpn[64] = "";
+    TlsStats stats;
+    Server resuming, full;
+    int failed = 0;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    // A CA of our own signing the server's certificate
+    EVP_PKEY *ca_key = EVP_EC_gen("P-256");
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    X509 *ca = make_cert("getter test CA", ca_key, NULL, NULL, 1);
+    X509 *cert = make_cert("localhost", key, ca, ca_key, 0);
+
+    int fd = mkstemp(ca_file);
+    FILE *fp = fdopen(fd, "w");
+    PEM_write_X509(fp, ca);
+    fclose(fp);
+
+    server_start(&resuming, cert, key, ca, 1);
+    server_start(&full, cert, key, ca, 0);
+
+    if (argc == 2 && strcmp(argv[1], "bench") == 0) {
+        bench(ca_file, &resuming, &full);
+    }
+    else {
+        failed |= check(tls_alloc("/no/such/file.pem") == NULL, "missing CA file rejected");
+
+        Tls *tls = tls_alloc(ca_file);
+        failed |= check(fetch(tls, "localhost", resuming.port, 100000, alpn) == 100000, "content arrives over TLS");
+        failed |= check(strcmp(alpn, "http/1.1") == 0, "protocol agreed by ALPN");
+        tls_stats(tls, &stats);
+        failed |= check(stats.full == 1 && stats.resumed == 0, "first connection does a full handshake");
+
+        failed |= check(fetch(tls, "localhost", resuming.port, 1000, NULL) == 1000, "second connection works");
+        tls_stats(tls, &stats);
+        failed |= check(stats.full == 1 && stats.resumed == 1, "second connection resumes");
+
+        failed |= check(fetch(tls, "localhost", full.port, 10, NULL) == 10 &&
+                        fetch(tls, "localhost", full.port, 10, NULL) == 10, "server without tickets works");
+        tls_stats(tls, &stats);
+        failed |= check(stats.full == 3 && stats.resumed == 1, "nothing resumed without tickets");
+
+        failed |= check(fetch(tls, "127.0.0.1", resuming.port, 10, NULL) == 10, "address checked against certificate");
+        failed |= check(fetch(tls, "other.example", resuming.port, 10, NULL) == -1, "certificate for other name rejected");
+
+        Tls *untrusting = tls_alloc(NULL);
+        failed |= check(fetch(untrusting, "localhost", resuming.port, 10, NULL) == -1, "unknown CA rejected");
+        tls_free(untrusting);
+
+        // Handshakes and reads yield inside coroutines
+        Fetch fetches[4];
+        int i, all = 1;
+        Runtime *runtime = coro_runtime_alloc(2, 4, 128 * 1024);
+        for (i = 0; i < 4; ++i) {
+            fetches[i].tls = tls;
+            fetches[i].port = resuming.port;
+            coro_spawn(runtime, fetch_coroutine, &fetches[i]);
+        }
+        coro_runtime_free(runtime);
+        for (i = 0; i < 4; ++i) {
+            all &= fetches[i].received == 1024 * 1024;
+        }
+        failed |= check(all, "fetches in coroutines");
+        tls_free(tls);
+    }
+
+    server_stop(&resuming);
+    server_stop(&full);
+    unlink(ca_file);
+    X509_free(cert);
+    X509_free(ca);
+    EVP_PKEY_free(key);
+    EVP_PKEY_free(ca_key);
+    return failed;
+}